@@ -5,59 +5,478 @@
  *      Author: ricard
  */
 
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
 #include "app_comms_mng.h"
+#include "drv_modbus/drv_modbus.h"
 #include "drv_modbus/drv_modbus_registers.h"
 #include "drv_modbus/drv_modbus_common.h"
+#include "drv_modbus/drv_modbus_file.h"
 #include "drv_led/drv_led.h"
 #include "drv_push_button/drv_push_button.h"
+#include "hal_os/hal_os.h"
+#include "hal_clk/hal_clk.h"
+#include "hal_timer/hal_timer.h"
+#include "hal_trace/hal_trace.h"
+#include "status.h"
 
-#define APP_COMMS_MNG_LED_OFF_REG_VAL	0
-#define APP_COMMS_MNG_LED_ON_REG_VAL	1
-#define APP_COMMS_MNG_LED_BLINK_REG_VAL	2
+#define APP_COMMS_MNG_LED_OFF_REG_VAL	DRV_MODBUS_0_LED_OFF
+#define APP_COMMS_MNG_LED_ON_REG_VAL	DRV_MODBUS_0_LED_ON
+#define APP_COMMS_MNG_LED_BLINK_REG_VAL	DRV_MODBUS_0_LED_BLINK
+
+/* Files of Modbus 0 */
+#define APP_COMMS_MNG_FILE_LATENCY		1
+#define APP_COMMS_MNG_FILE_TRACE		4
+
+/* Record of the trace file that freezes the trace when written with 1 */
+#define APP_COMMS_MNG_TRACE_FROZEN_RECORD	(offsetof(hal_trace_buffer_s, frozen) / sizeof(uint16_t))
+
+static error_e app_comms_mng_bind(void);
+static void app_comms_mng_os_prof_provide(drv_modbus_inst inst,
+										  uint16_t addr,
+										  uint16_t n_regs);
+static void app_comms_mng_put_u32(uint16_t *regs, uint32_t val);
+static uint32_t app_comms_mng_get_u32(const uint16_t *regs);
+static drv_modbus_write_result_e app_comms_mng_holding_write(drv_modbus_inst inst,
+															 uint16_t addr,
+															 uint16_t n_regs,
+															 const uint16_t *vals);
+static void app_comms_mng_apply_clk_baudrate(void);
+static error_e app_comms_mng_trace_write(void *ctx,
+										 uint16_t record,
+										 uint16_t n_records,
+										 const uint16_t *vals);
+static void app_comms_mng_publish_clk_baudrate(void);
+static void app_comms_mng_led_apply(void);
+static void app_comms_mng_scan(void);
+
+static status_e vapp_comms_mng_status;
+static bool vapp_comms_mng_process_image;
+
+/* A clock or baudrate change has been requested through Modbus 0, and the
+ * values requested */
+static bool vapp_comms_mng_clk_baudrate_pending;
+static uint32_t vapp_comms_mng_clk_freq_req;
+static uint32_t vapp_comms_mng_baudrate_req;
+
+/* Storage of the main input and holding registers of Modbus 0, served in
+ * place */
+static drv_modbus_0_input_s vapp_comms_mng_input;
+static drv_modbus_0_holding_s vapp_comms_mng_holding;
 
 void app_comms_mng_init(void)
 {
+	vapp_comms_mng_status = STATUS_NOT_STARTED;
+
+	vapp_comms_mng_process_image = false;
+
+	vapp_comms_mng_clk_baudrate_pending = false;
 
+	vapp_comms_mng_clk_freq_req = 0;
+
+	vapp_comms_mng_baudrate_req = 0;
+
+	memset(&vapp_comms_mng_input, 0, sizeof(vapp_comms_mng_input));
+
+	memset(&vapp_comms_mng_holding, 0, sizeof(vapp_comms_mng_holding));
 }
 
-void app_comms_mng_start(void)
+void app_comms_mng_start(const app_comms_mng_config_s config)
 {
+	drv_modbus_file_s file;
+
+	vapp_comms_mng_process_image = config.process_image;
+
+	/* The latency histograms can also be fetched in bulk, as a read only
+	 * file */
+	file.file_num = APP_COMMS_MNG_FILE_LATENCY;
+	file.n_records = DRV_MODBUS_LATENCY_REG_MAX;
+	file.read = drv_modbus_file_mem_read;
+	file.write = NULL;
+	file.write_record = 0;
+	file.n_write_records = 0;
+	file.ctx = vdrv_modbus_0_latency_regs_val;
+
+	drv_modbus_file_register(DRV_MODBUS_INST_0, &file);
+
+	/* So can the event trace. It is frozen by writing its frozen field, for
+	 * as long as it takes to read it whole */
+	file.file_num = APP_COMMS_MNG_FILE_TRACE;
+	file.n_records = sizeof(hal_trace_buffer_s) / sizeof(uint16_t);
+	file.read = drv_modbus_file_mem_read;
+	file.write = app_comms_mng_trace_write;
+	file.write_record = APP_COMMS_MNG_TRACE_FROZEN_RECORD;
+	file.n_write_records = 1;
+	file.ctx = (void *)hal_trace_buffer_get();
+
+	drv_modbus_file_register(DRV_MODBUS_INST_0, &file);
 
+	/* The main registers, and their legacy I/O aliases, are served from the
+	 * structs of this module. A bind only fails if the register map and the
+	 * structs disagree. The registers would then never be updated, so the
+	 * module is left in error and never run */
+	if(app_comms_mng_bind() != ERROR_NONE)
+	{
+		vapp_comms_mng_status = STATUS_ERROR;
+
+		return;
+	}
+
+	/* Clock and baudrate changes are done in the background */
+	app_comms_mng_publish_clk_baudrate();
+
+	/* The OS profiling registers are only computed when read */
+	drv_modbus_provider_attach(DRV_MODBUS_INST_0,
+							   DRV_MODBUS_0_BANK_MAIN,
+							   DRV_MODBUS_REGISTER_TYPE_INPUT,
+							   DRV_MODBUS_0_INPUT_RANGE_OS_PROF,
+							   app_comms_mng_os_prof_provide);
+
+	drv_modbus_write_cb_attach(DRV_MODBUS_INST_0,
+							   DRV_MODBUS_0_BANK_MAIN,
+							   DRV_MODBUS_0_HOLDING_RANGE_MAIN,
+							   app_comms_mng_holding_write);
+
+	/* The LED is only looked at when written. It gets its initial value
+	 * here */
+	app_comms_mng_led_apply();
+
+	vapp_comms_mng_status = STATUS_STARTED;
 }
 
 void app_comms_mng_fxn(void)
 {
-	uint16_t data;
+	uint16_t addr;
+
+	if(vapp_comms_mng_status != STATUS_STARTED)
+
+		return;
+
+	if(vapp_comms_mng_process_image)
+	{
+		app_comms_mng_scan();
+
+		return;
+	}
 
 	/* Modbus 0 input registers */
 
-	/* Push button */
+	vapp_comms_mng_input.push_button = (uint16_t)(drv_push_button_read(DRV_PUSH_BUTTON_0));
+
+	/* Modbus 0 holding registers written by the master since last time. The
+	 * legacy I/O bank shares the LED register. The latency reset register is
+	 * handled by its write hook */
+
+	while(drv_modbus_changed_get(DRV_MODBUS_INST_0,
+								 DRV_MODBUS_0_BANK_MAIN,
+								 DRV_MODBUS_0_HOLDING_REG_LED,
+								 1,
+								 &addr))
 
-	data = (uint16_t)(drv_push_button_read(DRV_PUSH_BUTTON_0));
+		app_comms_mng_led_apply();
 
-	drv_modbus_write_register(DRV_MODBUS_INST_0,
-							  DRV_MODBUS_REGISTER_TYPE_INPUT,
-							  DRV_MODBUS_0_INPUT_REG_PUSH_BUTTON,
-							  data);
+	while(drv_modbus_changed_get(DRV_MODBUS_INST_0,
+								 DRV_MODBUS_0_BANK_LEGACY_IO,
+								 0x0000,
+								 1,
+								 &addr))
 
-	/* Modbus 0 holding registers */
+		app_comms_mng_led_apply();
 
-	drv_modbus_read_register(DRV_MODBUS_INST_0,
-							 DRV_MODBUS_REGISTER_TYPE_HOLDING,
-							 DRV_MODBUS_0_HOLDING_REG_LED,
-							 &data);
+	/* A clock or baudrate change is applied once its response has left the
+	 * wire, otherwise the master wouldn't understand it */
 
-	if(data == 0)
+	if(vapp_comms_mng_clk_baudrate_pending && drv_modbus_bus_idle_get(DRV_MODBUS_INST_0))
+	{
+		app_comms_mng_apply_clk_baudrate();
+
+		vapp_comms_mng_clk_baudrate_pending = false;
+	}
+}
+
+/* STATUS_ERROR if the registers could not be served from the structs */
+status_e app_comms_mng_status_get(void)
+{
+	return vapp_comms_mng_status;
+}
+
+/* One scan of process image mode. The inputs are all read first and latched
+ * together, so that a master never sees some of them from this scan and some
+ * from the previous one. Then every output is applied */
+static void app_comms_mng_scan(void)
+{
+	drv_modbus_0_input_s input;
+
+	/* Read the inputs */
+
+	input.push_button = (uint16_t)(drv_push_button_read(DRV_PUSH_BUTTON_0));
+
+	/* Latch them into the input image */
+
+	drv_modbus_range_update_begin(DRV_MODBUS_INST_0,
+								  DRV_MODBUS_0_BANK_MAIN,
+								  DRV_MODBUS_REGISTER_TYPE_INPUT,
+								  DRV_MODBUS_0_INPUT_RANGE_MAIN);
+
+	vapp_comms_mng_input = input;
+
+	drv_modbus_range_update_end(DRV_MODBUS_INST_0,
+								DRV_MODBUS_0_BANK_MAIN,
+								DRV_MODBUS_REGISTER_TYPE_INPUT,
+								DRV_MODBUS_0_INPUT_RANGE_MAIN);
+
+	/* Apply the output image */
+
+	app_comms_mng_led_apply();
+
+	if(vapp_comms_mng_clk_baudrate_pending && drv_modbus_bus_idle_get(DRV_MODBUS_INST_0))
+	{
+		app_comms_mng_apply_clk_baudrate();
+
+		vapp_comms_mng_clk_baudrate_pending = false;
+	}
+}
+
+/* Applies the LED holding register of Modbus 0 */
+static void app_comms_mng_led_apply(void)
+{
+	if(vapp_comms_mng_holding.led == APP_COMMS_MNG_LED_OFF_REG_VAL)
 
 		drv_led_set_request(DRV_LED_INST_0, DRV_LED_REQUEST_OFF);
 
-	else if(data == 1)
+	else if(vapp_comms_mng_holding.led == APP_COMMS_MNG_LED_ON_REG_VAL)
 
 		drv_led_set_request(DRV_LED_INST_0, DRV_LED_REQUEST_ON);
 
 	else
 
 		drv_led_set_request(DRV_LED_INST_0, DRV_LED_REQUEST_BLINK);
+}
+
+/* Write handler of the main holding range of Modbus 0, which starts at
+ * address 0x0000. The values are not stored yet */
+static drv_modbus_write_result_e app_comms_mng_holding_write(drv_modbus_inst inst,
+															 uint16_t addr,
+															 uint16_t n_regs,
+															 const uint16_t *vals)
+{
+	drv_modbus_0_holding_s req = vapp_comms_mng_holding;
+
+	(void)inst;
+
+	/* Only the clock frequency and baudrate registers trigger slow work */
+	if(addr > DRV_MODBUS_0_HOLDING_REG_BAUDRATE_LOW
+		|| addr + n_regs <= DRV_MODBUS_0_HOLDING_REG_CLK_FREQ_HIGH)
+
+		return DRV_MODBUS_WRITE_DONE;
+
+	/* The registers as they will be once the request is stored */
+	memcpy((uint16_t *)&req + addr, vals, n_regs * sizeof(uint16_t));
+
+	/* Nothing to do if the request is already in effect */
+	if(app_comms_mng_get_u32(req.clk_freq) == hal_clk_get_freq_hz()
+		&& app_comms_mng_get_u32(req.baudrate) == drv_modbus_baudrate_get(DRV_MODBUS_INST_0))
+
+		return DRV_MODBUS_WRITE_DONE;
+
+	vapp_comms_mng_clk_freq_req = app_comms_mng_get_u32(req.clk_freq);
+
+	vapp_comms_mng_baudrate_req = app_comms_mng_get_u32(req.baudrate);
+
+	vapp_comms_mng_clk_baudrate_pending = true;
+
+	return DRV_MODBUS_WRITE_PENDING;
+}
+
+/* Applies the requested clock frequency and baudrate. Values that can't be
+ * applied are replaced by the ones in effect in the holding registers */
+static void app_comms_mng_apply_clk_baudrate(void)
+{
+	uint32_t clk_freq_hz;
+	uint32_t baudrate;
+
+	clk_freq_hz = vapp_comms_mng_clk_freq_req;
+
+	baudrate = vapp_comms_mng_baudrate_req;
+
+	if(clk_freq_hz != hal_clk_get_freq_hz()
+		&& hal_clk_set_freq_hz(clk_freq_hz) == ERROR_NONE)
+
+		/* Timers count at the new frequency */
+		hal_timer_update_freq(hal_clk_get_freq_hz());
+
+	/* The baudrate divider depends on the clock frequency, so it is always
+	 * recalculated */
+	if(baudrate == 0
+		|| drv_modbus_update_baudrate(DRV_MODBUS_INST_0, hal_clk_get_freq_hz(), baudrate)
+			!= ERROR_NONE)
+
+		(void)drv_modbus_update_baudrate(DRV_MODBUS_INST_0,
+										 hal_clk_get_freq_hz(),
+										 drv_modbus_baudrate_get(DRV_MODBUS_INST_0));
+
+	/* A request answered with Server Busy is only stored now, so the values
+	 * in effect are published afterwards */
+	drv_modbus_complete(DRV_MODBUS_INST_0, DRV_MODBUS_0_BANK_MAIN, true);
+
+	app_comms_mng_publish_clk_baudrate();
+}
+
+static void app_comms_mng_publish_clk_baudrate(void)
+{
+	drv_modbus_range_update_begin(DRV_MODBUS_INST_0,
+								  DRV_MODBUS_0_BANK_MAIN,
+								  DRV_MODBUS_REGISTER_TYPE_HOLDING,
+								  DRV_MODBUS_0_HOLDING_RANGE_MAIN);
+
+	app_comms_mng_put_u32(vapp_comms_mng_holding.clk_freq, hal_clk_get_freq_hz());
+
+	app_comms_mng_put_u32(vapp_comms_mng_holding.baudrate, drv_modbus_baudrate_get(DRV_MODBUS_INST_0));
 
+	drv_modbus_range_update_end(DRV_MODBUS_INST_0,
+								DRV_MODBUS_0_BANK_MAIN,
+								DRV_MODBUS_REGISTER_TYPE_HOLDING,
+								DRV_MODBUS_0_HOLDING_RANGE_MAIN);
 }
 
+/* Binds the main registers and their legacy I/O aliases to the structs */
+static error_e app_comms_mng_bind(void)
+{
+	error_e error;
+
+	error = drv_modbus_range_bind(DRV_MODBUS_INST_0,
+								  DRV_MODBUS_0_BANK_MAIN,
+								  DRV_MODBUS_REGISTER_TYPE_INPUT,
+								  DRV_MODBUS_0_INPUT_RANGE_MAIN,
+								  (uint16_t *)&vapp_comms_mng_input,
+								  sizeof(vapp_comms_mng_input) / sizeof(uint16_t));
+
+	if(error != ERROR_NONE)
+
+		return error;
+
+	error = drv_modbus_range_bind(DRV_MODBUS_INST_0,
+								  DRV_MODBUS_0_BANK_MAIN,
+								  DRV_MODBUS_REGISTER_TYPE_HOLDING,
+								  DRV_MODBUS_0_HOLDING_RANGE_MAIN,
+								  (uint16_t *)&vapp_comms_mng_holding,
+								  sizeof(vapp_comms_mng_holding) / sizeof(uint16_t));
+
+	if(error != ERROR_NONE)
+
+		return error;
+
+	error = drv_modbus_range_bind(DRV_MODBUS_INST_0,
+								  DRV_MODBUS_0_BANK_LEGACY_IO,
+								  DRV_MODBUS_REGISTER_TYPE_INPUT,
+								  DRV_MODBUS_0_LEGACY_IO_INPUT_RANGE_MAIN,
+								  &vapp_comms_mng_input.push_button,
+								  1);
+
+	if(error != ERROR_NONE)
+
+		return error;
+
+	return drv_modbus_range_bind(DRV_MODBUS_INST_0,
+								 DRV_MODBUS_0_BANK_LEGACY_IO,
+								 DRV_MODBUS_REGISTER_TYPE_HOLDING,
+								 DRV_MODBUS_0_LEGACY_IO_HOLDING_RANGE_MAIN,
+								 &vapp_comms_mng_holding.led,
+								 1);
+}
+
+/* Provider of the read-only OS profiling block. Copies the hal_os profiling
+ * figures, skipping the tasks whose registers are not being read */
+static void app_comms_mng_os_prof_provide(drv_modbus_inst inst,
+										  uint16_t addr,
+										  uint16_t n_regs)
+{
+	uint16_t *regs = vdrv_modbus_0_os_prof_regs_val;
+	uint16_t first = addr - DRV_MODBUS_0_OS_PROF_START_ADDR;
+	uint16_t *task_regs;
+	uint16_t task_first;
+	hal_os_loop_prof_s loop_prof;
+	hal_os_task_prof_s task_prof;
+	hal_os_task_stats_s task_stats;
+	uint8_t n_tasks;
+
+	(void)inst;
+
+	n_tasks = hal_os_task_cnt_get();
+
+	if(n_tasks > DRV_MODBUS_0_OS_PROF_MAX_TASKS)
+
+		n_tasks = DRV_MODBUS_0_OS_PROF_MAX_TASKS;
+
+	regs[DRV_MODBUS_0_OS_PROF_REG_N_TASKS] = n_tasks;
+
+	hal_os_loop_prof_get(&loop_prof);
+
+	app_comms_mng_put_u32(&regs[DRV_MODBUS_0_OS_PROF_REG_LOOP_PASSES_HIGH], loop_prof.passes);
+	app_comms_mng_put_u32(&regs[DRV_MODBUS_0_OS_PROF_REG_LOOP_MIN_HIGH], loop_prof.min_period_cycles);
+	app_comms_mng_put_u32(&regs[DRV_MODBUS_0_OS_PROF_REG_LOOP_MAX_HIGH], loop_prof.max_period_cycles);
+	app_comms_mng_put_u32(&regs[DRV_MODBUS_0_OS_PROF_REG_LOOP_JITTER_HIGH], loop_prof.jitter_cycles);
+
+	for(uint8_t task_id = 0; task_id < n_tasks; task_id++)
+	{
+		task_first = DRV_MODBUS_0_OS_PROF_REG_TASKS + task_id * DRV_MODBUS_OS_PROF_TASK_REG_MAX;
+
+		/* Only the tasks whose registers are read */
+		if(task_first >= first + n_regs || task_first + DRV_MODBUS_OS_PROF_TASK_REG_MAX <= first)
+
+			continue;
+
+		task_regs = &regs[task_first];
+
+		if(hal_os_task_prof_get(task_id, &task_prof) != ERROR_NONE
+			|| hal_os_task_stats_get(task_id, &task_stats) != ERROR_NONE)
+
+			continue;
+
+		app_comms_mng_put_u32(&task_regs[DRV_MODBUS_OS_PROF_TASK_REG_CALLS_HIGH], task_prof.calls);
+		app_comms_mng_put_u32(&task_regs[DRV_MODBUS_OS_PROF_TASK_REG_MIN_HIGH], task_prof.min_cycles);
+		app_comms_mng_put_u32(&task_regs[DRV_MODBUS_OS_PROF_TASK_REG_MAX_HIGH], task_prof.max_cycles);
+		app_comms_mng_put_u32(&task_regs[DRV_MODBUS_OS_PROF_TASK_REG_MEAN_HIGH], task_prof.mean_cycles);
+
+		task_regs[DRV_MODBUS_OS_PROF_TASK_REG_LOAD_PERMILLE] = task_prof.load_permille;
+
+		/* Counters saturate */
+		task_regs[DRV_MODBUS_OS_PROF_TASK_REG_MISSED_DEADLINES] =
+				task_stats.missed_deadlines > UINT16_MAX ? UINT16_MAX : task_stats.missed_deadlines;
+
+		task_regs[DRV_MODBUS_OS_PROF_TASK_REG_OVERRUNS] =
+				task_stats.overruns > UINT16_MAX ? UINT16_MAX : task_stats.overruns;
+	}
+}
+
+/* 32-bit values are stored high word first */
+static void app_comms_mng_put_u32(uint16_t *regs, uint32_t val)
+{
+	regs[0] = (uint16_t)(val >> 16);
+	regs[1] = (uint16_t)(val & 0xFFFF);
+}
+
+static uint32_t app_comms_mng_get_u32(const uint16_t *regs)
+{
+	return (uint32_t)regs[0] << 16 | regs[1];
+}
+
+/* Only called for the frozen field of the trace, the one writable record */
+static error_e app_comms_mng_trace_write(void *ctx,
+										 uint16_t record,
+										 uint16_t n_records,
+										 const uint16_t *vals)
+{
+	(void)ctx;
+	(void)record;
+	(void)n_records;
+
+	if(vals[0] > 1)
+
+		return ERROR_MODBUS_FILE_ACCESS;
+
+	hal_trace_freeze(vals[0] == 1);
+
+	return ERROR_NONE;
+}
@@ -8,9 +8,23 @@
 #ifndef APP_APP_COMMS_MNG_H_
 #define APP_APP_COMMS_MNG_H_
 
+#include <stdbool.h>
+#include "status.h"
+
+/* In process image mode, the task is a PLC-like scan run once per period:
+ * the inputs are latched into the input registers as one image, and every
+ * output in the holding registers is applied, whether written or not. Masters
+ * are served from the images in between. Otherwise, inputs are stored as they
+ * are read and outputs are applied when written */
+typedef struct
+{
+	bool process_image;
+} app_comms_mng_config_s;
+
 void app_comms_mng_init(void);
-void app_comms_mng_start(void);
+void app_comms_mng_start(const app_comms_mng_config_s config);
 void app_comms_mng_fxn(void);
+status_e app_comms_mng_status_get(void);
 
 
 #endif /* APP_APP_COMMS_MNG_H_ */
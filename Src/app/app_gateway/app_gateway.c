@@ -0,0 +1,393 @@
+/*
+ * app_gateway.c
+ *
+ *  Created on: Oct 19, 2026
+ *      Author: ricard
+ */
+
+#include <stdlib.h>
+#include "app_gateway.h"
+#include "drv_modbus/drv_modbus.h"
+#include "status.h"
+
+#define APP_GATEWAY_FC_READ_HOLDING_REGS		0x03
+#define APP_GATEWAY_FC_READ_INPUT_REGS			0x04
+#define APP_GATEWAY_FC_WRITE_SINGLE_REG			0x06
+#define APP_GATEWAY_FC_WRITE_MULTIPLE_REGS		0x10
+
+/* Most registers read from a device at once */
+#define APP_GATEWAY_MAX_BLOCK_REGS				125
+
+#define APP_GATEWAY_AGE_MAX_MS					0xFFFF
+
+/* Type definitions */
+
+typedef struct
+{
+	drv_modbus_master_trans_s trans;
+	uint16_t age_ms;
+	int32_t next_poll_ms;
+	bool valid;			/* Read at least once since the last failed write */
+	bool in_flight;
+	bool enabled;
+} app_gateway_block_state_s;
+
+/* Local variables */
+
+static status_e vapp_gateway_status;
+static app_gateway_config_s vapp_gateway_config;
+static app_gateway_block_state_s vapp_gateway_block[DRV_MODBUS_0_GW_MAX_BLOCKS];
+static const drv_modbus_range_s *vapp_gateway_input_cache;
+static const drv_modbus_range_s *vapp_gateway_holding_cache;
+static const drv_modbus_range_s *vapp_gateway_status_regs;
+
+/* Write being forwarded downstream. Upstream writes are refused while there
+ * is one, so a single one is needed */
+static drv_modbus_master_trans_s vapp_gateway_write;
+static uint16_t vapp_gateway_write_vals[DRV_MODBUS_0_GW_HOLDING_REG_MAX];
+static uint8_t vapp_gateway_write_block;
+
+/* The last forwarded write is in effect downstream */
+static bool vapp_gateway_write_ok;
+
+/* Local function declarations */
+
+static void app_gateway_tick(void);
+static void app_gateway_publish_status(void);
+static bool app_gateway_block_stale(uint8_t b);
+static uint16_t *app_gateway_cache_get(const app_gateway_block_s *block);
+static bool app_gateway_write_in_effect(uint8_t b, uint16_t addr, const uint16_t *vals, uint16_t n_regs);
+static void app_gateway_poll_done(drv_modbus_master_trans_s *trans,
+								  drv_modbus_master_result_e result);
+static void app_gateway_write_done(drv_modbus_master_trans_s *trans,
+								   drv_modbus_master_result_e result);
+static drv_modbus_read_result_e app_gateway_read(drv_modbus_inst inst,
+												 drv_modbus_register_type_s type,
+												 uint16_t addr,
+												 uint16_t n_regs);
+static drv_modbus_write_result_e app_gateway_holding_write(drv_modbus_inst inst,
+														   uint16_t addr,
+														   uint16_t n_regs,
+														   const uint16_t *vals);
+
+void app_gateway_init(void)
+{
+	vapp_gateway_status = STATUS_NOT_STARTED;
+
+	for(uint8_t b = 0; b < DRV_MODBUS_0_GW_MAX_BLOCKS; b++)
+	{
+		vapp_gateway_block[b].enabled = false;
+
+		vapp_gateway_block[b].in_flight = false;
+	}
+
+	vapp_gateway_write_ok = false;
+}
+
+void app_gateway_start(const app_gateway_config_s config)
+{
+	const drv_modbus_bank_s *bank;
+	const app_gateway_block_s *block;
+	const drv_modbus_range_s *cache;
+
+	if(vapp_gateway_status != STATUS_NOT_STARTED)
+
+		return;
+
+	bank = drv_modbus_bank_get(config.modbus_inst, config.bank);
+
+	if(bank == NULL
+		|| bank->n_input_ranges < DRV_MODBUS_0_GATEWAY_INPUT_RANGE_MAX
+		|| bank->n_holding_ranges < DRV_MODBUS_0_GATEWAY_HOLDING_RANGE_MAX)
+
+		return;
+
+	vapp_gateway_config = config;
+
+	vapp_gateway_input_cache = &bank->input_ranges[DRV_MODBUS_0_GATEWAY_INPUT_RANGE_CACHE];
+
+	vapp_gateway_status_regs = &bank->input_ranges[DRV_MODBUS_0_GATEWAY_INPUT_RANGE_STATUS];
+
+	vapp_gateway_holding_cache = &bank->holding_ranges[DRV_MODBUS_0_GATEWAY_HOLDING_RANGE_CACHE];
+
+	if(vapp_gateway_config.n_blocks > DRV_MODBUS_0_GW_MAX_BLOCKS)
+
+		vapp_gateway_config.n_blocks = DRV_MODBUS_0_GW_MAX_BLOCKS;
+
+	for(uint8_t b = 0; b < vapp_gateway_config.n_blocks; b++)
+	{
+		block = &config.blocks[b];
+
+		cache = block->type == DRV_MODBUS_REGISTER_TYPE_INPUT ?
+				vapp_gateway_input_cache : vapp_gateway_holding_cache;
+
+		/* Blocks that don't fit in the cache are never polled */
+		vapp_gateway_block[b].enabled =
+				block->n_regs > 0 && block->n_regs <= APP_GATEWAY_MAX_BLOCK_REGS
+				&& block->local_addr >= cache->start_addr
+				&& (uint32_t)block->local_addr + block->n_regs <= (uint32_t)cache->start_addr + cache->n_regs;
+
+		vapp_gateway_block[b].trans.unit_id = block->unit_id;
+		vapp_gateway_block[b].trans.fc = block->type == DRV_MODBUS_REGISTER_TYPE_INPUT ?
+				APP_GATEWAY_FC_READ_INPUT_REGS : APP_GATEWAY_FC_READ_HOLDING_REGS;
+		vapp_gateway_block[b].trans.read_addr = block->remote_addr;
+		vapp_gateway_block[b].trans.n_read = block->n_regs;
+		vapp_gateway_block[b].trans.read_vals = vapp_gateway_block[b].enabled ?
+				app_gateway_cache_get(block) : NULL;
+		vapp_gateway_block[b].trans.n_write = 0;
+		vapp_gateway_block[b].trans.write_vals = NULL;
+		vapp_gateway_block[b].trans.cb = app_gateway_poll_done;
+		vapp_gateway_block[b].trans.ctx = &vapp_gateway_block[b];
+
+		vapp_gateway_block[b].age_ms = APP_GATEWAY_AGE_MAX_MS;
+
+		vapp_gateway_block[b].valid = false;
+
+		/* Spread the first polls over the schedule */
+		vapp_gateway_block[b].next_poll_ms = (int32_t)b * APP_GATEWAY_TICK_MS;
+	}
+
+	drv_modbus_read_cb_attach(config.modbus_inst, config.bank, app_gateway_read);
+
+	drv_modbus_write_cb_attach(config.modbus_inst,
+							   config.bank,
+							   DRV_MODBUS_0_GATEWAY_HOLDING_RANGE_CACHE,
+							   app_gateway_holding_write);
+
+	app_gateway_publish_status();
+
+	vapp_gateway_status = STATUS_STARTED;
+}
+
+/* Released by hal_os every APP_GATEWAY_TICK_MS, so each run is one tick */
+void app_gateway_fxn(void)
+{
+	if(vapp_gateway_status != STATUS_STARTED)
+
+		return;
+
+	app_gateway_tick();
+}
+
+/* Ages the cache and submits the polls that are due */
+static void app_gateway_tick(void)
+{
+	app_gateway_block_state_s *state;
+
+	for(uint8_t b = 0; b < vapp_gateway_config.n_blocks; b++)
+	{
+		state = &vapp_gateway_block[b];
+
+		if(!state->enabled)
+
+			continue;
+
+		if(state->age_ms <= APP_GATEWAY_AGE_MAX_MS - APP_GATEWAY_TICK_MS)
+
+			state->age_ms += APP_GATEWAY_TICK_MS;
+
+		else
+
+			state->age_ms = APP_GATEWAY_AGE_MAX_MS;
+
+		state->next_poll_ms -= APP_GATEWAY_TICK_MS;
+
+		/* A block whose last poll is still on its way is not queued again.
+		 * If the queue is full, it is tried on the next tick */
+		if(state->next_poll_ms <= 0 && !state->in_flight
+			&& drv_modbus_master_submit(vapp_gateway_config.master_inst, &state->trans) == ERROR_NONE)
+		{
+			state->in_flight = true;
+
+			state->next_poll_ms = vapp_gateway_config.blocks[b].period_ms;
+		}
+	}
+
+	app_gateway_publish_status();
+}
+
+static void app_gateway_publish_status(void)
+{
+	uint16_t stale_flags = 0;
+
+	for(uint8_t b = 0; b < vapp_gateway_config.n_blocks; b++)
+	{
+		if(app_gateway_block_stale(b))
+
+			stale_flags |= 1U << b;
+
+		vapp_gateway_status_regs->val[DRV_MODBUS_0_GW_STATUS_REG_AGES + b] = vapp_gateway_block[b].age_ms;
+	}
+
+	vapp_gateway_status_regs->val[DRV_MODBUS_0_GW_STATUS_REG_STALE_FLAGS] = stale_flags;
+}
+
+static bool app_gateway_block_stale(uint8_t b)
+{
+	return !vapp_gateway_block[b].valid
+			|| vapp_gateway_block[b].age_ms > vapp_gateway_config.blocks[b].max_age_ms;
+}
+
+/* Cache registers of a block */
+static uint16_t *app_gateway_cache_get(const app_gateway_block_s *block)
+{
+	const drv_modbus_range_s *cache;
+
+	cache = block->type == DRV_MODBUS_REGISTER_TYPE_INPUT ?
+			vapp_gateway_input_cache : vapp_gateway_holding_cache;
+
+	return &cache->val[block->local_addr - cache->start_addr];
+}
+
+/* The response has already been copied to the cache */
+static void app_gateway_poll_done(drv_modbus_master_trans_s *trans,
+								  drv_modbus_master_result_e result)
+{
+	app_gateway_block_state_s *state = trans->ctx;
+
+	state->in_flight = false;
+
+	if(result == DRV_MODBUS_MASTER_RESULT_OK)
+	{
+		state->age_ms = 0;
+
+		state->valid = true;
+	}
+}
+
+static void app_gateway_write_done(drv_modbus_master_trans_s *trans,
+								   drv_modbus_master_result_e result)
+{
+	const app_gateway_block_s *block = &vapp_gateway_config.blocks[vapp_gateway_write_block];
+	uint16_t *cache = app_gateway_cache_get(block);
+
+	vapp_gateway_write_ok = result == DRV_MODBUS_MASTER_RESULT_OK;
+
+	if(result == DRV_MODBUS_MASTER_RESULT_OK)
+	{
+		/* A poll may have overwritten the cache before the write went out */
+		for(uint16_t j = 0; j < trans->n_write; j++)
+
+			cache[trans->write_addr - block->remote_addr + j] = trans->write_vals[j];
+	}
+	else
+
+		/* The cache no longer reflects the device until it is polled
+		 * again */
+		vapp_gateway_block[vapp_gateway_write_block].valid = false;
+
+	app_gateway_publish_status();
+
+	drv_modbus_complete(vapp_gateway_config.modbus_inst,
+						vapp_gateway_config.bank,
+						result == DRV_MODBUS_MASTER_RESULT_OK);
+}
+
+static drv_modbus_read_result_e app_gateway_read(drv_modbus_inst inst,
+												 drv_modbus_register_type_s type,
+												 uint16_t addr,
+												 uint16_t n_regs)
+{
+	const app_gateway_block_s *block;
+
+	(void)inst;
+
+	if(!vapp_gateway_config.stale_exception)
+
+		return DRV_MODBUS_READ_OK;
+
+	for(uint8_t b = 0; b < vapp_gateway_config.n_blocks; b++)
+	{
+		block = &vapp_gateway_config.blocks[b];
+
+		if(vapp_gateway_block[b].enabled
+			&& block->type == type
+			&& addr < block->local_addr + block->n_regs
+			&& (uint32_t)addr + n_regs > block->local_addr
+			&& app_gateway_block_stale(b))
+
+			return DRV_MODBUS_READ_UNAVAILABLE;
+	}
+
+	return DRV_MODBUS_READ_OK;
+}
+
+/* Upstream writes are forwarded to the device of the block that contains
+ * them. Writes that fall outside a block, or span two, have no single device
+ * to go to and are refused */
+static drv_modbus_write_result_e app_gateway_holding_write(drv_modbus_inst inst,
+														   uint16_t addr,
+														   uint16_t n_regs,
+														   const uint16_t *vals)
+{
+	const app_gateway_block_s *block;
+
+	(void)inst;
+
+	for(uint8_t b = 0; b < vapp_gateway_config.n_blocks; b++)
+	{
+		block = &vapp_gateway_config.blocks[b];
+
+		if(!vapp_gateway_block[b].enabled
+			|| block->type != DRV_MODBUS_REGISTER_TYPE_HOLDING
+			|| addr < block->local_addr
+			|| (uint32_t)addr + n_regs > (uint32_t)block->local_addr + block->n_regs)
+
+			continue;
+
+		/* A master answered with Server Busy repeats the request once it has
+		 * been forwarded */
+		if(app_gateway_write_in_effect(b, addr, vals, n_regs))
+
+			return DRV_MODBUS_WRITE_DONE;
+
+		vapp_gateway_write_ok = false;
+
+		for(uint16_t j = 0; j < n_regs; j++)
+
+			vapp_gateway_write_vals[j] = vals[j];
+
+		vapp_gateway_write.unit_id = block->unit_id;
+		vapp_gateway_write.fc = n_regs == 1 ?
+				APP_GATEWAY_FC_WRITE_SINGLE_REG : APP_GATEWAY_FC_WRITE_MULTIPLE_REGS;
+		vapp_gateway_write.write_addr = block->remote_addr + (addr - block->local_addr);
+		vapp_gateway_write.n_write = n_regs;
+		vapp_gateway_write.write_vals = vapp_gateway_write_vals;
+		vapp_gateway_write.n_read = 0;
+		vapp_gateway_write.read_vals = NULL;
+		vapp_gateway_write.cb = app_gateway_write_done;
+		vapp_gateway_write.ctx = NULL;
+
+		vapp_gateway_write_block = b;
+
+		if(drv_modbus_master_submit(vapp_gateway_config.master_inst, &vapp_gateway_write) == ERROR_NONE)
+
+			return DRV_MODBUS_WRITE_PENDING;
+
+		/* The master queue is full, or the master is not running, so it
+		 * can't be forwarded */
+		return DRV_MODBUS_WRITE_UNAVAILABLE;
+	}
+
+	return DRV_MODBUS_WRITE_UNAVAILABLE;
+}
+
+static bool app_gateway_write_in_effect(uint8_t b, uint16_t addr, const uint16_t *vals, uint16_t n_regs)
+{
+	const app_gateway_block_s *block = &vapp_gateway_config.blocks[b];
+
+	if(!vapp_gateway_write_ok
+		|| vapp_gateway_write_block != b
+		|| vapp_gateway_write.write_addr != block->remote_addr + (addr - block->local_addr)
+		|| vapp_gateway_write.n_write != n_regs)
+
+		return false;
+
+	for(uint16_t j = 0; j < n_regs; j++)
+
+		if(vapp_gateway_write_vals[j] != vals[j])
+
+			return false;
+
+	return true;
+}
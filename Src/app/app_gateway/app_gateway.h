@@ -0,0 +1,53 @@
+/*
+ * app_gateway.h
+ *
+ *  Created on: Oct 19, 2026
+ *      Author: ricard
+ */
+
+#ifndef APP_APP_GATEWAY_H_
+#define APP_APP_GATEWAY_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+#include "drv_modbus/drv_modbus_common.h"
+#include "drv_modbus/drv_modbus_registers.h"
+#include "drv_modbus/drv_modbus_master.h"
+
+/* Resolution of the poll schedule and of the block ages. app_gateway_fxn must
+ * run every APP_GATEWAY_TICK_MS */
+#define APP_GATEWAY_TICK_MS		10
+
+/* A block of downstream registers, polled every period_ms with FC 0x03 or
+ * 0x04 depending on type, and cached at local_addr of the gateway bank. Its
+ * data is stale when it is older than max_age_ms or has never been read */
+typedef struct
+{
+	uint8_t unit_id;
+	drv_modbus_register_type_s type;
+	uint16_t remote_addr;
+	uint16_t local_addr;
+	uint16_t n_regs;
+	uint16_t period_ms;
+	uint16_t max_age_ms;
+} app_gateway_block_s;
+
+/* bank is the register bank of modbus_inst that holds the cache, laid out as
+ * DRV_MODBUS_0_BANK_GATEWAY. With stale_exception, reads of stale blocks are
+ * answered with exception 0x0B. Otherwise they are served, and the stale
+ * flags tell how good the data is */
+typedef struct
+{
+	drv_modbus_inst modbus_inst;
+	uint8_t bank;
+	drv_modbus_master_inst_e master_inst;
+	const app_gateway_block_s *blocks;
+	uint8_t n_blocks;
+	bool stale_exception;
+} app_gateway_config_s;
+
+void app_gateway_init(void);
+void app_gateway_start(const app_gateway_config_s config);
+void app_gateway_fxn(void);
+
+#endif /* APP_APP_GATEWAY_H_ */
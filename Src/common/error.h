@@ -16,6 +16,13 @@ typedef enum
 	ERROR_UART_BUFFER_EMPTY,
 	ERROR_NON_EXISTENT_TIMER,
 	ERROR_MODBUS_INEXISTENT_REGISTER,
+	ERROR_OS_NON_EXISTENT_TASK,
+	ERROR_MODBUS_FILE_TABLE_FULL,
+	ERROR_MODBUS_FILE_ACCESS,
+	ERROR_MODBUS_MASTER_QUEUE_FULL,
+	ERROR_MODBUS_MASTER_BAD_REQUEST,
+	ERROR_MODBUS_NOTIFY_TABLE_FULL,
+	ERROR_MODBUS_MASTER_NOT_STARTED,
 	ERROR_MAX
 } error_e;
 
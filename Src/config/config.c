@@ -7,14 +7,21 @@
 #include "stdlib.h"
 #include "config.h"
 #include "app_comms_mng/app_comms_mng.h"
+#include "app_gateway/app_gateway.h"
 #include "drv_modbus/drv_modbus.h"
 #include "drv_modbus/drv_modbus_common.h"
+#include "drv_modbus/drv_modbus_fifo.h"
+#include "drv_modbus/drv_modbus_master.h"
+#include "drv_modbus/drv_modbus_bridge.h"
+#include "drv_modbus/drv_modbus_sniffer.h"
+#include "drv_modbus/drv_modbus_registers.h"
 #include "drv_led/drv_led.h"
 #include "drv_push_button/drv_push_button.h"
 #include "hal_uart/hal_uart.h"
 #include "hal_clk/hal_clk.h"
 #include "hal_pin_mat/hal_pin_mat.h"
 #include "hal_os/hal_os.h"
+#include "hal_trace/hal_trace.h"
 
 typedef enum
 {
@@ -23,31 +30,88 @@ typedef enum
 	CONFIG_TASK_UART,
 	CONFIG_TASK_GPIO,
 	CONFIG_TASK_TIMER,
+	CONFIG_TASK_TRACE,
 	/* DRV */
 	CONFIG_TASK_LED,
 	CONFIG_TASK_PUSH_BUTTON,
 	CONFIG_TASK_MODBUS,
+	CONFIG_TASK_MODBUS_FIFO,
+	CONFIG_TASK_MODBUS_MASTER,
+	CONFIG_TASK_MODBUS_BRIDGE,
+	CONFIG_TASK_MODBUS_SNIFFER,
 	/* APP */
 	CONFIG_TASK_COMMS_MNG,
+	CONFIG_TASK_GATEWAY,
 
 	CONFIG_TASK_MAX
 } config_tasks_e;
 
+/* Every task from CONFIG_TASK_LED on has a fxn, and gets an entry in the OS
+ * profiling registers */
+_Static_assert(CONFIG_TASK_MAX - CONFIG_TASK_LED <= DRV_MODBUS_0_OS_PROF_MAX_TASKS,
+			   "The OS profiling registers can't hold every task");
+
 typedef struct
 {
 	void (*init)(void);
 	void (*start)(void);
 	void (*fxn)(void);
+	uint16_t period_ms;
+	uint8_t priority;
 } config_task_s;
 
+/* Timer whose ticks drive the periodic tasks, and its tick period */
+#define CONFIG_OS_TICK_TIMER_INST	HAL_TIMER_TIMER_INST_6
+#define CONFIG_OS_TICK_MS			1
+
+/* Free running 32-bit timer that counts us, for timestamps */
+#define CONFIG_US_COUNTER_TIMER_INST	HAL_TIMER_TIMER_INST_2
+#define CONFIG_US_COUNTER_FREQ_HZ		1000000
+
+/* Task priorities. The lower, the more urgent */
+#define CONFIG_PRIORITY_MODBUS			HAL_OS_HIGHEST_PRIORITY
+#define CONFIG_PRIORITY_MODBUS_MASTER	HAL_OS_HIGHEST_PRIORITY
+#define CONFIG_PRIORITY_MODBUS_BRIDGE	HAL_OS_HIGHEST_PRIORITY
+#define CONFIG_PRIORITY_MODBUS_SNIFFER	HAL_OS_HIGHEST_PRIORITY
+#define CONFIG_PRIORITY_COMMS_MNG		1
+#define CONFIG_PRIORITY_GATEWAY			1
+#define CONFIG_PRIORITY_MODBUS_FIFO		2
+#define CONFIG_PRIORITY_PUSH_BUTTON		3
+#define CONFIG_PRIORITY_LED				4
+
+/* In bridge mode, both UARTs are repeaters of each other, and neither the
+ * Modbus engine nor the master is started */
+#define CONFIG_BRIDGE_MODE				0
+
+/* In sniffer mode, USART1 only listens and captures every frame on its bus,
+ * and the master is not started */
+#define CONFIG_SNIFFER_MODE				0
+
+/* In process image mode, the comms manager latches inputs and applies outputs
+ * once per scan period, like a PLC. Otherwise, it runs every scan period and
+ * also when the master writes an output */
+#define CONFIG_PROCESS_IMAGE_MODE		0
+#define CONFIG_SCAN_PERIOD_MS			10
+
 void config_uart_start(void);
 void config_timer_start(void);
+void config_trace_start(void);
 void config_led_start(void);
 void config_push_button_start(void);
 void config_modbus_start(void);
+void config_modbus_fifo_start(void);
+void config_modbus_master_start(void);
+void config_gateway_start(void);
+void config_comms_mng_start(void);
+void config_modbus_bridge_start(void);
+void config_modbus_sniffer_start(void);
+static void config_uart_event(hal_uart_uart_num_e uart_num, hal_uart_event_e event);
+static void config_modbus_notify_start(void);
 
 extern const config_task_s config_task[CONFIG_TASK_MAX];
 
+static uint8_t vconfig_task_id[CONFIG_TASK_MAX];
+
 const hal_uart_config_s config_uart[HAL_UART_UART_MAX] =
 {
 		{
@@ -56,7 +120,23 @@ const hal_uart_config_s config_uart[HAL_UART_UART_MAX] =
 				.clk_freq_hz = HAL_CLK_TARGET_FREQ_HZ,
 				.parity = HAL_UART_PARITY_EVEN,
 				.n_stop_bits = HAL_UART_STOP_BITS_1,
-				.n_bits = HAL_UART_N_BITS_8
+				.n_bits = HAL_UART_N_BITS_8,
+				.de_enable = 1,
+				.de_polarity = HAL_UART_DE_POLARITY_HIGH,
+				.de_assert_time = 8,
+				.de_deassert_time = 8
+		},
+		{
+				.uart_num = HAL_UART_USART_1,
+				.baudrate = 9600,
+				.clk_freq_hz = HAL_CLK_TARGET_FREQ_HZ,
+				.parity = HAL_UART_PARITY_EVEN,
+				.n_stop_bits = HAL_UART_STOP_BITS_1,
+				.n_bits = HAL_UART_N_BITS_8,
+				.de_enable = 1,
+				.de_polarity = HAL_UART_DE_POLARITY_HIGH,
+				.de_assert_time = 8,
+				.de_deassert_time = 8
 		}
 };
 
@@ -88,6 +168,13 @@ const drv_hal_push_button_config_s config_push_button[DRV_PUSH_BUTTON_MAX] =
 		}
 };
 
+/* Unit ids answered by Modbus 0 besides its own address */
+const drv_modbus_unit_s config_modbus_0_units[] =
+{
+		{	.unit_id = 0x11,	.bank = DRV_MODBUS_0_BANK_LEGACY_IO	},
+		{	.unit_id = 0x12,	.bank = DRV_MODBUS_0_BANK_GATEWAY	}
+};
+
 const drv_modbus_config_s config_modbus[DRV_MODBUS_INST_MAX] =
 {
 		{
@@ -95,23 +182,117 @@ const drv_modbus_config_s config_modbus[DRV_MODBUS_INST_MAX] =
 				.uart_inst = HAL_UART_USART_2,
 				.timer_inst = HAL_TIMER_TIMER_INST_6,
 				.mb_addr = 0x10,
+				.pending_reply = DRV_MODBUS_PENDING_REPLY_ACK,
+				.units = config_modbus_0_units,
+				.n_units = sizeof(config_modbus_0_units) / sizeof(drv_modbus_unit_s)
+		}
+};
+
+/* The push button FIFO records every change of its input register, which is
+ * refreshed by the comms manager. Samples are acknowledged through the
+ * FIFO acknowledge holding register */
+const drv_modbus_fifo_config_s config_modbus_fifo[DRV_MODBUS_FIFO_INST_MAX] =
+{
+		{
+				.fifo_inst = DRV_MODBUS_FIFO_INST_0,
+				.modbus_inst = DRV_MODBUS_INST_0,
+				.ptr_addr = 0x0000,
+				.ack_reg = DRV_MODBUS_0_HOLDING_REG_FIFO_ACK,
+				.reg_type = DRV_MODBUS_REGISTER_TYPE_INPUT,
+				.reg = DRV_MODBUS_0_INPUT_REG_PUSH_BUTTON,
+				.period_ms = 0,
+				.on_change = true,
+				.timer_inst = HAL_TIMER_TIMER_INST_6
 		}
 };
 
+/* Master of the downstream bus */
+const drv_modbus_master_config_s config_modbus_master[DRV_MODBUS_MASTER_INST_MAX] =
+{
+		{
+				.inst = DRV_MODBUS_MASTER_INST_0,
+				.uart_inst = HAL_UART_USART_1,
+				.timer_inst = HAL_TIMER_TIMER_INST_6,
+				.response_timeout_ms = 100,
+				.turnaround_ms = 100,
+				.n_retries = 2
+		}
+};
+
+/* Cut-through repeater between the upstream and downstream buses */
+const drv_modbus_bridge_config_s config_modbus_bridge[DRV_MODBUS_BRIDGE_INST_MAX] =
+{
+		{
+				.inst = DRV_MODBUS_BRIDGE_INST_0,
+				.uart_a = HAL_UART_USART_2,
+				.uart_b = HAL_UART_USART_1,
+				.timer_inst = HAL_TIMER_TIMER_INST_6
+		}
+};
+
+/* Passive capture of the downstream bus, downloaded as files 2 and 3 of
+ * Modbus 0 */
+const drv_modbus_sniffer_config_s config_modbus_sniffer[DRV_MODBUS_SNIFFER_INST_MAX] =
+{
+		{
+				.inst = DRV_MODBUS_SNIFFER_INST_0,
+				.uart_inst = HAL_UART_USART_1,
+				.counter_timer_inst = CONFIG_US_COUNTER_TIMER_INST,
+				.modbus_inst = DRV_MODBUS_INST_0,
+				.file_num = 2
+		}
+};
+
+/* Poll schedule of the gateway. Unit id 0x12 of Modbus 0 serves the cache */
+const app_gateway_block_s config_gateway_blocks[] =
+{
+		{	.unit_id = 1,	.type = DRV_MODBUS_REGISTER_TYPE_INPUT,		.remote_addr = 0x0000,	.local_addr = 0x0000,	.n_regs = 8,	.period_ms = 1000,	.max_age_ms = 3000	},
+		{	.unit_id = 2,	.type = DRV_MODBUS_REGISTER_TYPE_INPUT,		.remote_addr = 0x0000,	.local_addr = 0x0008,	.n_regs = 8,	.period_ms = 1000,	.max_age_ms = 3000	},
+		{	.unit_id = 1,	.type = DRV_MODBUS_REGISTER_TYPE_HOLDING,	.remote_addr = 0x0000,	.local_addr = 0x0000,	.n_regs = 4,	.period_ms = 5000,	.max_age_ms = 15000	}
+};
+
+const app_comms_mng_config_s config_comms_mng =
+{
+		.process_image = CONFIG_PROCESS_IMAGE_MODE
+};
+
+const app_gateway_config_s config_gateway =
+{
+		.modbus_inst = DRV_MODBUS_INST_0,
+		.bank = DRV_MODBUS_0_BANK_GATEWAY,
+		.master_inst = DRV_MODBUS_MASTER_INST_0,
+		.blocks = config_gateway_blocks,
+		.n_blocks = sizeof(config_gateway_blocks) / sizeof(app_gateway_block_s),
+		.stale_exception = true
+};
+
+/* Tasks with no period are only run on events. The Modbus engine is also run
+ * on every tick, because frame delimiting and response delays rely on timers.
+ * The bridge and the sniffer are only attached in their mode */
 const config_task_s config_task[CONFIG_TASK_MAX] =
 {
-		{	.init = hal_pin_mat_init,		.start = hal_pin_mat_start,			.fxn = NULL					},	// CONFIG_TASK_PIN_MAT
-		{	.init = hal_uart_init,			.start = config_uart_start,			.fxn = NULL					},	// CONFIG_TASK_UART
-		{	.init = hal_gpio_init,			.start = hal_gpio_start,			.fxn = NULL					},	// CONFIG_TASK_GPIO
-		{	.init = hal_timer_init,			.start = config_timer_start,		.fxn = NULL					},	// CONFIG_TASK_TIMER
-		{	.init = drv_led_init,			.start = config_led_start,			.fxn = drv_led_fxn			},	// CONFIG_TASK_LED
-		{	.init = drv_push_button_init,	.start = config_push_button_start,	.fxn = drv_push_button_fxn	},	// CONFIG_TASK_PUSH_BUTTON
-		{	.init = drv_modbus_init,		.start = config_modbus_start,		.fxn = drv_modbus_fxn		},	// CONFIG_TASK_MODBUS
-		{	.init = app_comms_mng_init,		.start = app_comms_mng_start,		.fxn = app_comms_mng_fxn	},	// CONFIG_TASK_COMMS_MNG
+		{	.init = hal_pin_mat_init,		.start = hal_pin_mat_start,			.fxn = NULL,				.period_ms = 0,		.priority = 0							},	// CONFIG_TASK_PIN_MAT
+		{	.init = hal_uart_init,			.start = config_uart_start,			.fxn = NULL,				.period_ms = 0,		.priority = 0							},	// CONFIG_TASK_UART
+		{	.init = hal_gpio_init,			.start = hal_gpio_start,			.fxn = NULL,				.period_ms = 0,		.priority = 0							},	// CONFIG_TASK_GPIO
+		{	.init = hal_timer_init,			.start = config_timer_start,		.fxn = NULL,				.period_ms = 0,		.priority = 0							},	// CONFIG_TASK_TIMER
+		{	.init = hal_trace_init,			.start = config_trace_start,		.fxn = NULL,				.period_ms = 0,		.priority = 0							},	// CONFIG_TASK_TRACE
+		{	.init = drv_led_init,			.start = config_led_start,			.fxn = drv_led_fxn,			.period_ms = 10,	.priority = CONFIG_PRIORITY_LED			},	// CONFIG_TASK_LED
+		{	.init = drv_push_button_init,	.start = config_push_button_start,	.fxn = drv_push_button_fxn,	.period_ms = 10,	.priority = CONFIG_PRIORITY_PUSH_BUTTON	},	// CONFIG_TASK_PUSH_BUTTON
+		{	.init = drv_modbus_init,		.start = config_modbus_start,		.fxn = drv_modbus_fxn,		.period_ms = 1,		.priority = CONFIG_PRIORITY_MODBUS		},	// CONFIG_TASK_MODBUS
+		{	.init = drv_modbus_fifo_init,	.start = config_modbus_fifo_start,	.fxn = drv_modbus_fifo_fxn,	.period_ms = 10,	.priority = CONFIG_PRIORITY_MODBUS_FIFO	},	// CONFIG_TASK_MODBUS_FIFO
+		{	.init = drv_modbus_master_init,	.start = config_modbus_master_start,	.fxn = drv_modbus_master_fxn,	.period_ms = 1,	.priority = CONFIG_PRIORITY_MODBUS_MASTER	},	// CONFIG_TASK_MODBUS_MASTER
+		{	.init = drv_modbus_bridge_init,	.start = config_modbus_bridge_start,	.fxn = CONFIG_BRIDGE_MODE ? drv_modbus_bridge_fxn : NULL,	.period_ms = 1,	.priority = CONFIG_PRIORITY_MODBUS_BRIDGE	},	// CONFIG_TASK_MODBUS_BRIDGE
+		{	.init = drv_modbus_sniffer_init,	.start = config_modbus_sniffer_start,	.fxn = CONFIG_SNIFFER_MODE && !CONFIG_BRIDGE_MODE ? drv_modbus_sniffer_fxn : NULL,	.period_ms = 1,	.priority = CONFIG_PRIORITY_MODBUS_SNIFFER	},	// CONFIG_TASK_MODBUS_SNIFFER
+		{	.init = app_comms_mng_init,		.start = config_comms_mng_start,	.fxn = app_comms_mng_fxn,	.period_ms = CONFIG_SCAN_PERIOD_MS,	.priority = CONFIG_PRIORITY_COMMS_MNG	},	// CONFIG_TASK_COMMS_MNG
+		{	.init = app_gateway_init,		.start = config_gateway_start,		.fxn = app_gateway_fxn,		.period_ms = APP_GATEWAY_TICK_MS,	.priority = CONFIG_PRIORITY_GATEWAY	},	// CONFIG_TASK_GATEWAY
 };
 
 void config_init_tasks(void)
 {
+	for(config_tasks_e i = 0; i < CONFIG_TASK_MAX; i++)
+
+		vconfig_task_id[i] = HAL_OS_INVALID_TASK_ID;
+
 	for(config_tasks_e i = 0; i < CONFIG_TASK_MAX; i++)
 	{
 		config_task[i].init();
@@ -119,15 +300,22 @@ void config_init_tasks(void)
 
 		if(config_task[i].fxn != NULL)
 
-			hal_os_task_attach(config_task[i].fxn);
+			vconfig_task_id[i] = hal_os_task_attach(config_task[i].fxn,
+													config_task[i].period_ms / CONFIG_OS_TICK_MS,
+													config_task[i].priority);
 	}
+
+	config_modbus_notify_start();
 }
 
 void config_uart_start(void)
 {
 	for(int i = 0; i < HAL_UART_UART_MAX; i++)
-
+	{
 		hal_uart_start(config_uart[i]);
+
+		hal_uart_event_cb_attach(config_uart[i].uart_num, config_uart_event);
+	}
 }
 
 void config_timer_start(void)
@@ -135,6 +323,18 @@ void config_timer_start(void)
 	for(int i = 0; i < sizeof(config_timer) / sizeof(hal_timer_config_s); i++)
 
 		hal_timer_start(config_timer[i]);
+
+	hal_timer_tick_cb_attach(CONFIG_OS_TICK_TIMER_INST, hal_os_tick);
+
+	hal_timer_counter_start(CONFIG_US_COUNTER_TIMER_INST,
+							HAL_CLK_TARGET_FREQ_HZ,
+							CONFIG_US_COUNTER_FREQ_HZ);
+}
+
+/* Trace records are stamped in us */
+void config_trace_start(void)
+{
+	hal_trace_start(CONFIG_US_COUNTER_TIMER_INST, CONFIG_US_COUNTER_FREQ_HZ);
 }
 
 void config_led_start(void)
@@ -153,7 +353,113 @@ void config_push_button_start(void)
 
 void config_modbus_start(void)
 {
+	if(CONFIG_BRIDGE_MODE)
+
+		return;
+
 	for(int i = 0; i < DRV_MODBUS_INST_MAX; i++)
 
 		drv_modbus_start(config_modbus[i]);
 }
+
+void config_modbus_fifo_start(void)
+{
+	for(int i = 0; i < DRV_MODBUS_FIFO_INST_MAX; i++)
+
+		drv_modbus_fifo_start(config_modbus_fifo[i]);
+}
+
+void config_modbus_master_start(void)
+{
+	if(CONFIG_BRIDGE_MODE || CONFIG_SNIFFER_MODE)
+
+		return;
+
+	for(int i = 0; i < DRV_MODBUS_MASTER_INST_MAX; i++)
+
+		drv_modbus_master_start(config_modbus_master[i]);
+}
+
+void config_modbus_bridge_start(void)
+{
+	if(!CONFIG_BRIDGE_MODE)
+
+		return;
+
+	for(int i = 0; i < DRV_MODBUS_BRIDGE_INST_MAX; i++)
+
+		drv_modbus_bridge_start(config_modbus_bridge[i]);
+}
+
+void config_modbus_sniffer_start(void)
+{
+	if(!CONFIG_SNIFFER_MODE || CONFIG_BRIDGE_MODE)
+
+		return;
+
+	for(int i = 0; i < DRV_MODBUS_SNIFFER_INST_MAX; i++)
+
+		drv_modbus_sniffer_start(config_modbus_sniffer[i]);
+}
+
+void config_comms_mng_start(void)
+{
+	app_comms_mng_start(config_comms_mng);
+}
+
+/* The gateway relies on the master */
+void config_gateway_start(void)
+{
+	if(CONFIG_BRIDGE_MODE || CONFIG_SNIFFER_MODE)
+
+		return;
+
+	app_gateway_start(config_gateway);
+}
+
+/* Holding registers whose writes ready the task that owns them, once every
+ * task has an id. A scan in process image mode only runs on its period */
+static void config_modbus_notify_start(void)
+{
+	if(CONFIG_PROCESS_IMAGE_MODE)
+
+		return;
+
+	drv_modbus_change_notify_attach(DRV_MODBUS_INST_0,
+									DRV_MODBUS_0_BANK_MAIN,
+									DRV_MODBUS_0_HOLDING_REG_LED,
+									1,
+									vconfig_task_id[CONFIG_TASK_COMMS_MNG]);
+
+	drv_modbus_change_notify_attach(DRV_MODBUS_INST_0,
+									DRV_MODBUS_0_BANK_LEGACY_IO,
+									0x0000,
+									1,
+									vconfig_task_id[CONFIG_TASK_COMMS_MNG]);
+}
+
+/* Called from interrupt context. Each UART has a single user, whose task is
+ * readied on every event. In bridge mode, the bridge uses both. In sniffer
+ * mode, bytes are timestamped right here */
+static void config_uart_event(hal_uart_uart_num_e uart_num, hal_uart_event_e event)
+{
+	if(CONFIG_BRIDGE_MODE)
+
+		hal_os_task_ready_set(vconfig_task_id[CONFIG_TASK_MODBUS_BRIDGE]);
+
+	else if(CONFIG_SNIFFER_MODE && uart_num == HAL_UART_USART_1)
+	{
+		if(event == HAL_UART_EVENT_RX)
+
+			drv_modbus_sniffer_rx_isr(DRV_MODBUS_SNIFFER_INST_0);
+
+		hal_os_task_ready_set(vconfig_task_id[CONFIG_TASK_MODBUS_SNIFFER]);
+	}
+	else if(uart_num == HAL_UART_USART_1)
+
+		hal_os_task_ready_set(vconfig_task_id[CONFIG_TASK_MODBUS_MASTER]);
+
+	else
+
+		hal_os_task_ready_set(vconfig_task_id[CONFIG_TASK_MODBUS]);
+}
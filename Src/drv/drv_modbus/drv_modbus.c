@@ -5,60 +5,214 @@
  *      Author: ricard
  */
 #include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
 #include "drv_modbus.h"
 #include "drv_modbus_registers.h"
+#include "drv_modbus_fifo.h"
+#include "drv_modbus_file.h"
+#include "drv_modbus_dev_id.h"
+#include "drv_modbus_rtu.h"
+#include "hal_os/hal_os.h"
+#include "hal_clk/hal_clk.h"
+#include "hal_trace/hal_trace.h"
 #include "status.h"
 #include "error.h"
 
 /* Macros */
 
-#define DRV_MODBUS_BROADCAST_ADDRESS					0x00
-
 #define DRV_MODBUS_FUNCTION_CODE_READ_HOLDING_REGS		0x03
 #define DRV_MODBUS_FUNCTION_CODE_READ_INPUT_REGS		0x04
 #define DRV_MODBUS_FUNCTION_CODE_WRITE_SINGLE_REG		0x06
+#define DRV_MODBUS_FUNCTION_CODE_DIAGNOSTICS			0x08
+#define DRV_MODBUS_FUNCTION_CODE_GET_COMM_EVENT_CNT		0x0B
+#define DRV_MODBUS_FUNCTION_CODE_GET_COMM_EVENT_LOG		0x0C
 #define DRV_MODBUS_FUNCTION_CODE_WRITE_MULTIPLE_REGS	0x10
+#define DRV_MODBUS_FUNCTION_CODE_READ_FILE_RECORD		0x14
+#define DRV_MODBUS_FUNCTION_CODE_WRITE_FILE_RECORD		0x15
+#define DRV_MODBUS_FUNCTION_CODE_ENCAPSULATED			0x2B
+#define DRV_MODBUS_FUNCTION_CODE_READ_FIFO_QUEUE		0x18
+#define DRV_MODBUS_FUNCTION_CODE_REPORT_CHANGES			0x41	/* User defined */
 
 #define DRV_MODBUS_EXCEPTION_CODE_ILLEGAL_FUNCTION		0x01
 #define DRV_MODBUS_EXCEPTION_CODE_ILLEGAL_DATA_ADDRESS	0x02
 #define DRV_MODBUS_EXCEPTION_CODE_ILLEGAL_DATA_VALUE	0x03
-
-#define DRV_MODBUS_TIMEOUT_BETWEEN_BYTES_MS				2
-#define DRV_MODBUS_TIME_BETWEEN_FRAMES_MS				5
-
-#define DRV_MODBUS_MAX_FRAME_LEN_BYTES					100
+#define DRV_MODBUS_EXCEPTION_CODE_SERVER_FAILURE		0x04
+#define DRV_MODBUS_EXCEPTION_CODE_ACKNOWLEDGE			0x05
+#define DRV_MODBUS_EXCEPTION_CODE_SERVER_BUSY			0x06
+#define DRV_MODBUS_EXCEPTION_CODE_NAK					0x07
+#define DRV_MODBUS_EXCEPTION_CODE_GATEWAY_TARGET_FAILED	0x0B
+
+/* Not an actual exception code. Means the request can be served */
+#define DRV_MODBUS_EXCEPTION_CODE_NONE					0x00
+
+/* FC 0x08 sub-functions */
+#define DRV_MODBUS_DIAG_RETURN_QUERY_DATA				0x0000
+#define DRV_MODBUS_DIAG_RESTART_COMMS					0x0001
+#define DRV_MODBUS_DIAG_RETURN_DIAG_REGISTER			0x0002
+#define DRV_MODBUS_DIAG_FORCE_LISTEN_ONLY				0x0004
+#define DRV_MODBUS_DIAG_CLEAR_COUNTERS					0x000A
+#define DRV_MODBUS_DIAG_BUS_MSG_CNT						0x000B
+#define DRV_MODBUS_DIAG_BUS_COMM_ERR_CNT				0x000C
+#define DRV_MODBUS_DIAG_BUS_EXCEPTION_ERR_CNT			0x000D
+#define DRV_MODBUS_DIAG_SERVER_MSG_CNT					0x000E
+#define DRV_MODBUS_DIAG_SERVER_NO_RESPONSE_CNT			0x000F
+#define DRV_MODBUS_DIAG_SERVER_NAK_CNT					0x0010
+#define DRV_MODBUS_DIAG_SERVER_BUSY_CNT					0x0011
+#define DRV_MODBUS_DIAG_BUS_CHAR_OVERRUN_CNT			0x0012
+#define DRV_MODBUS_DIAG_CLEAR_OVERRUN					0x0014
+
+/* Restart Communications data that also clears the event log. 0x0000 keeps
+ * it */
+#define DRV_MODBUS_DIAG_RESTART_CLEAR_LOG				0xFF00
+
+/* Status word of FC 0x0B / 0x0C. Busy while a write to the addressed bank is
+ * pending */
+#define DRV_MODBUS_COMM_STATUS_READY					0x0000
+#define DRV_MODBUS_COMM_STATUS_BUSY						0xFFFF
+
+/* Holding ranges per bank that can have a write handler attached */
+#define DRV_MODBUS_MAX_HOLDING_RANGES					8
+
+/* Ranges per bank and register type that can have a provider attached */
+#define DRV_MODBUS_MAX_PROVIDED_RANGES					8
+
+/* Banks per instance, and the value of the unit id lookup table for unit ids
+ * that aren't answered */
+#define DRV_MODBUS_MAX_BANKS							4
+#define DRV_MODBUS_NO_BANK								0xFF
+
+/* Holding registers per bank whose writes are tracked, counted across its
+ * holding ranges in table order. Registers past them are not tracked */
+#define DRV_MODBUS_DIRTY_MAX_REGS						256
+#define DRV_MODBUS_DIRTY_WORDS							(DRV_MODBUS_DIRTY_MAX_REGS / 32)
+
+/* Most registers written by one request */
+#define DRV_MODBUS_MAX_WRITE_REGS						123
+
+/* Change notifications per instance */
+#define DRV_MODBUS_MAX_NOTIFY							8
+
+/* File record sub-requests. The reference type is always 6 */
+#define DRV_MODBUS_FILE_REF_TYPE						6
+#define DRV_MODBUS_FILE_READ_SUB_REQ_LEN				7
+#define DRV_MODBUS_FILE_READ_MIN_BYTE_COUNT				0x07
+#define DRV_MODBUS_FILE_READ_MAX_BYTE_COUNT				0xF5
+#define DRV_MODBUS_FILE_WRITE_MIN_BYTE_COUNT			0x09
+#define DRV_MODBUS_FILE_WRITE_MAX_BYTE_COUNT			0xFB
+
+/* Read Device Identification, MEI type 0x0E of FC 0x2B */
+#define DRV_MODBUS_MEI_TYPE_READ_DEV_ID					0x0E
+#define DRV_MODBUS_DEV_ID_CODE_BASIC					0x01
+#define DRV_MODBUS_DEV_ID_CODE_REGULAR					0x02
+#define DRV_MODBUS_DEV_ID_CODE_EXTENDED					0x03
+#define DRV_MODBUS_DEV_ID_CODE_INDIVIDUAL				0x04
+#define DRV_MODBUS_DEV_ID_MORE_FOLLOWS					0xFF
+
+/* Length of the communication event log. Must be a power of 2 */
+#define DRV_MODBUS_EVENT_LOG_LEN						64
+
+/* Event log entries. Receive events have bit 7 set, send events bit 6 */
+#define DRV_MODBUS_EVENT_RX								0x80
+#define DRV_MODBUS_EVENT_RX_BROADCAST					0x40
+#define DRV_MODBUS_EVENT_RX_LISTEN_ONLY					0x20
+#define DRV_MODBUS_EVENT_RX_CHAR_OVERRUN				0x10
+#define DRV_MODBUS_EVENT_RX_COMM_ERR					0x02
+
+#define DRV_MODBUS_EVENT_TX								0x40
+#define DRV_MODBUS_EVENT_TX_READ_EXCEPTION				0x01
+#define DRV_MODBUS_EVENT_TX_ABORT_EXCEPTION				0x02
+#define DRV_MODBUS_EVENT_TX_BUSY_EXCEPTION				0x04
+#define DRV_MODBUS_EVENT_TX_NAK_EXCEPTION				0x08
+#define DRV_MODBUS_EVENT_TX_WRITE_TIMEOUT				0x10
+#define DRV_MODBUS_EVENT_TX_LISTEN_ONLY					0x20
+
+#define DRV_MODBUS_EVENT_LISTEN_ONLY					0x04
+#define DRV_MODBUS_EVENT_RESTART						0x00
+
+/* Most (address, value) pairs in a Report Changes response, so that it fits
+ * in a frame */
+#define DRV_MODBUS_RBE_MAX_PAIRS						60
 
 /* Type definitions */
 
 typedef struct
 {
-	uint8_t num_holding_regs;
-	uint8_t num_input_regs;
-	uint16_t *holding_regs_val;
-	uint16_t *input_regs_val;
-	const uint16_t *holding_regs_addr;
-	const uint16_t *input_regs_addr;
+	const drv_modbus_bank_s *banks;
+	uint8_t n_banks;
+	uint16_t *latency_hist;
 } drv_modbus_regs_s;
 
+/* Timestamps of the transaction in progress, in CPU cycles */
+typedef struct
+{
+	uint32_t first_byte;
+	uint32_t end_of_frame;
+	uint32_t dispatch;
+	uint32_t response_ready;
+	drv_modbus_latency_fc_e fc;
+} drv_modbus_latency_s;
+
+/* Communication event counter and log. The log is a ring that overwrites the
+ * oldest entry, head being the next position to write */
+typedef struct
+{
+	uint8_t events[DRV_MODBUS_EVENT_LOG_LEN];
+	uint8_t head;
+	uint8_t n_events;
+	uint16_t event_cnt;
+} drv_modbus_event_log_s;
+
 typedef enum
 {
 	DRV_MODBUS_STATE_IDLE,
 	DRV_MODBUS_STATE_RECEIVING,
+	DRV_MODBUS_STATE_DISCARD,
 	DRV_MODBUS_STATE_CHECK_CRC,
 	DRV_MODBUS_STATE_CHECK_FC,
 	DRV_MODBUS_STATE_READ_HOLDING_REGS,
 	DRV_MODBUS_STATE_READ_INPUT_REGS,
 	DRV_MODBUS_STATE_WRITE_SINGLE_REG,
 	DRV_MODBUS_STATE_WRITE_MULTIPLE_REGS,
+	DRV_MODBUS_STATE_DIAGNOSTICS,
+	DRV_MODBUS_STATE_GET_COMM_EVENT_CNT,
+	DRV_MODBUS_STATE_GET_COMM_EVENT_LOG,
+	DRV_MODBUS_STATE_READ_FIFO_QUEUE,
+	DRV_MODBUS_STATE_READ_FILE_RECORD,
+	DRV_MODBUS_STATE_WRITE_FILE_RECORD,
+	DRV_MODBUS_STATE_READ_DEV_ID,
+	DRV_MODBUS_STATE_REPORT_CHANGES,
 	DRV_MODBUS_STATE_BUILD_EXCEPTION_RESPONSE,
 	DRV_MODBUS_STATE_DELAY_BEFORE_RESPONSE,
-	DRV_MODBUS_STATE_SEND_RESPONSE
+	DRV_MODBUS_STATE_SEND_RESPONSE,
+	DRV_MODBUS_STATE_WAIT_TX_COMPLETE
 } drv_modbus_state_e;
 
+/* Values of the last write request to a bank. When it is answered with
+ * Server Busy, they are kept here until its work is finished */
+typedef struct
+{
+	const drv_modbus_range_s *range;
+	uint16_t addr;
+	uint16_t n_regs;
+	uint16_t vals[DRV_MODBUS_MAX_WRITE_REGS];
+} drv_modbus_write_s;
+
+/* Holding registers whose writes ready a task */
+typedef struct
+{
+	uint8_t bank;
+	uint16_t addr;
+	uint16_t n_regs;
+	uint8_t task_id;
+} drv_modbus_notify_s;
+
 /* Local variables */
 
 static drv_modbus_regs_s vdrv_modbus_regs[DRV_MODBUS_INST_MAX];
-static uint8_t vdrv_modbus_addr[DRV_MODBUS_INST_MAX];
+static uint8_t vdrv_modbus_unit_bank[DRV_MODBUS_INST_MAX][256];
+static uint8_t vdrv_modbus_bank_idx[DRV_MODBUS_INST_MAX];
+static const drv_modbus_bank_s *vdrv_modbus_bank[DRV_MODBUS_INST_MAX];
 static status_e vdrv_modbus_status[DRV_MODBUS_INST_MAX] =
 {
 		STATUS_NOT_INIT
@@ -67,28 +221,136 @@ static hal_timer_timer_s vdrv_modbus_timer[DRV_MODBUS_INST_MAX];
 static hal_timer_timer_inst_e drv_modbus_timer_inst[DRV_MODBUS_INST_MAX];
 static drv_modbus_state_e vdrv_modbus_state[DRV_MODBUS_INST_MAX];
 static hal_uart_uart_num_e drv_modbus_uart_inst[DRV_MODBUS_INST_MAX];
-static uint8_t drv_modbus_frame_index[DRV_MODBUS_INST_MAX];
-static uint8_t drv_modbus_frame_buffer[DRV_MODBUS_INST_MAX][DRV_MODBUS_MAX_FRAME_LEN_BYTES];
+static uint16_t drv_modbus_frame_index[DRV_MODBUS_INST_MAX];
+static uint8_t drv_modbus_frame_buffer[DRV_MODBUS_INST_MAX][DRV_MODBUS_RTU_MAX_FRAME_LEN_BYTES];
+static drv_modbus_latency_s vdrv_modbus_latency[DRV_MODBUS_INST_MAX];
+static drv_modbus_diag_s vdrv_modbus_diag[DRV_MODBUS_INST_MAX];
+static bool vdrv_modbus_listen_only[DRV_MODBUS_INST_MAX];
+static bool vdrv_modbus_no_response[DRV_MODBUS_INST_MAX];
+static uint16_t vdrv_modbus_overrun_ref[DRV_MODBUS_INST_MAX];
+static drv_modbus_write_cb vdrv_modbus_write_cb[DRV_MODBUS_INST_MAX][DRV_MODBUS_MAX_BANKS][DRV_MODBUS_MAX_HOLDING_RANGES];
+static drv_modbus_read_cb vdrv_modbus_read_cb[DRV_MODBUS_INST_MAX][DRV_MODBUS_MAX_BANKS];
+static drv_modbus_provider_cb vdrv_modbus_provider[DRV_MODBUS_INST_MAX][DRV_MODBUS_MAX_BANKS][2][DRV_MODBUS_MAX_PROVIDED_RANGES];
+static uint8_t vdrv_modbus_pending_exception[DRV_MODBUS_INST_MAX];
+static bool vdrv_modbus_busy[DRV_MODBUS_INST_MAX][DRV_MODBUS_MAX_BANKS];
+static drv_modbus_write_s vdrv_modbus_write[DRV_MODBUS_INST_MAX][DRV_MODBUS_MAX_BANKS];
+static drv_modbus_event_log_s vdrv_modbus_event_log[DRV_MODBUS_INST_MAX];
+
+/* One bit per tracked holding register, set when a master writes it. Bit w
+ * of the summary is set while word w has any bit set, so that finding the
+ * changes takes as long as there are changes */
+static uint32_t vdrv_modbus_dirty[DRV_MODBUS_INST_MAX][DRV_MODBUS_MAX_BANKS][DRV_MODBUS_DIRTY_WORDS];
+static uint8_t vdrv_modbus_dirty_summary[DRV_MODBUS_INST_MAX][DRV_MODBUS_MAX_BANKS];
+static drv_modbus_notify_s vdrv_modbus_notify[DRV_MODBUS_INST_MAX][DRV_MODBUS_MAX_NOTIFY];
+static uint8_t vdrv_modbus_n_notify[DRV_MODBUS_INST_MAX];
+
+/* Input ranges with a snapshot are served from it */
+static bool vdrv_modbus_frozen[DRV_MODBUS_INST_MAX];
+
+/* Last version stamp given to a register reported by exception */
+static uint32_t vdrv_modbus_rbe_seq[DRV_MODBUS_INST_MAX];
+
+/* The stamps start over at every boot, so they are only meaningful along with
+ * the epoch, which changes at every boot. Not initialized by the startup: it
+ * is incremented across resets, and starts from whatever the RAM holds after
+ * a power cycle */
+static uint16_t vdrv_modbus_rbe_epoch[DRV_MODBUS_INST_MAX]
+	__attribute__((section(".noinit")));
+
+/* Scratch buffers for file record requests. The stack is too small for them,
+ * and requests are served one at a time */
+static uint8_t vdrv_modbus_file_req[DRV_MODBUS_RTU_MAX_FRAME_LEN_BYTES];
+static uint16_t vdrv_modbus_file_vals[DRV_MODBUS_RTU_MAX_FRAME_LEN_BYTES / 2];
+
+/* Copy of the registers of a Report Changes request, for the same reasons */
+static uint16_t vdrv_modbus_rbe_vals[125];
+
+/* Send event bits for each exception code */
+static const uint8_t cdrv_modbus_tx_event_exception[16] =
+{
+		[DRV_MODBUS_EXCEPTION_CODE_ILLEGAL_FUNCTION] = DRV_MODBUS_EVENT_TX_READ_EXCEPTION,
+		[DRV_MODBUS_EXCEPTION_CODE_ILLEGAL_DATA_ADDRESS] = DRV_MODBUS_EVENT_TX_READ_EXCEPTION,
+		[DRV_MODBUS_EXCEPTION_CODE_ILLEGAL_DATA_VALUE] = DRV_MODBUS_EVENT_TX_READ_EXCEPTION,
+		[DRV_MODBUS_EXCEPTION_CODE_SERVER_FAILURE] = DRV_MODBUS_EVENT_TX_ABORT_EXCEPTION,
+		[DRV_MODBUS_EXCEPTION_CODE_ACKNOWLEDGE] = DRV_MODBUS_EVENT_TX_BUSY_EXCEPTION,
+		[DRV_MODBUS_EXCEPTION_CODE_SERVER_BUSY] = DRV_MODBUS_EVENT_TX_BUSY_EXCEPTION,
+		[DRV_MODBUS_EXCEPTION_CODE_NAK] = DRV_MODBUS_EVENT_TX_NAK_EXCEPTION,
+		[DRV_MODBUS_EXCEPTION_CODE_GATEWAY_TARGET_FAILED] = DRV_MODBUS_EVENT_TX_ABORT_EXCEPTION
+};
 
 /* Local function declarations */
 
-static void drv_modbus_crc_calc(uint8_t *buff, uint16_t len, uint8_t crc_buff[2]);
+static const drv_modbus_range_s *drv_modbus_find_range(const drv_modbus_range_s *ranges,
+													   uint8_t n_ranges,
+													   uint16_t addr,
+													   uint16_t n_regs);
+static uint8_t drv_modbus_read_regs(drv_modbus_inst inst,
+									drv_modbus_register_type_s type,
+									const drv_modbus_range_s *ranges,
+									uint8_t n_ranges);
+static void drv_modbus_provide(drv_modbus_inst inst,
+							   drv_modbus_register_type_s type,
+							   const drv_modbus_range_s *ranges,
+							   const drv_modbus_range_s *range,
+							   uint16_t addr,
+							   uint16_t n_regs);
+static uint8_t drv_modbus_write_single_reg(drv_modbus_inst inst);
+static uint8_t drv_modbus_write_multiple_regs(drv_modbus_inst inst);
+static uint8_t drv_modbus_write_regs(drv_modbus_inst inst,
+									 const drv_modbus_range_s *range,
+									 uint16_t addr,
+									 uint16_t n_regs,
+									 const uint8_t *data);
+static void drv_modbus_store(drv_modbus_inst inst,
+							 uint8_t bank,
+							 const drv_modbus_range_s *range,
+							 uint16_t addr,
+							 uint16_t n_regs,
+							 const uint16_t *vals);
+static uint8_t drv_modbus_diagnostics(drv_modbus_inst inst);
+static void drv_modbus_prepare_response(drv_modbus_inst inst);
+static void drv_modbus_diag_clear(drv_modbus_inst inst);
+static uint8_t drv_modbus_get_comm_event_cnt(drv_modbus_inst inst);
+static uint8_t drv_modbus_get_comm_event_log(drv_modbus_inst inst);
+static uint8_t drv_modbus_read_fifo_queue(drv_modbus_inst inst);
+static uint8_t drv_modbus_read_file_record(drv_modbus_inst inst);
+static uint8_t drv_modbus_write_file_record(drv_modbus_inst inst);
+static uint8_t drv_modbus_read_dev_id(drv_modbus_inst inst);
+static uint8_t drv_modbus_report_changes(drv_modbus_inst inst);
+static int16_t drv_modbus_dirty_index(const drv_modbus_bank_s *bank,
+									  uint16_t addr,
+									  uint16_t *n_regs);
+static void drv_modbus_dirty_set(drv_modbus_inst inst,
+								 uint8_t bank,
+								 uint16_t addr,
+								 uint16_t n_regs);
+static uint16_t drv_modbus_comm_status(drv_modbus_inst inst);
+static bool drv_modbus_unit_id_valid(uint8_t unit_id);
+static void drv_modbus_event_add(drv_modbus_inst inst, uint8_t event);
+static void drv_modbus_event_rx(drv_modbus_inst inst, uint8_t flags);
+static void drv_modbus_event_log_clear(drv_modbus_inst inst);
+static void drv_modbus_latency_record(drv_modbus_inst inst, uint32_t tx_complete);
+static void drv_modbus_latency_add(uint16_t *hist, uint32_t cycles, uint32_t cycles_per_us);
 
 /* Initialize variables */
 
 void drv_modbus_init(void)
 {
-	vdrv_modbus_regs[DRV_MODBUS_INST_0].num_holding_regs = DRV_MODBUS_0_HOLDING_REG_MAX;
-	vdrv_modbus_regs[DRV_MODBUS_INST_0].num_input_regs = DRV_MODBUS_0_INPUT_REG_MAX;
-	vdrv_modbus_regs[DRV_MODBUS_INST_0].holding_regs_val = vdrv_modbus_0_holding_regs_val;
-	vdrv_modbus_regs[DRV_MODBUS_INST_0].input_regs_val = vdrv_modbus_0_input_regs_val;
-	vdrv_modbus_regs[DRV_MODBUS_INST_0].holding_regs_addr = vdrv_modbus_0_holding_regs_addr;
-	vdrv_modbus_regs[DRV_MODBUS_INST_0].input_regs_addr = vdrv_modbus_0_input_regs_addr;
+	vdrv_modbus_regs[DRV_MODBUS_INST_0].banks = cdrv_modbus_0_banks;
+	vdrv_modbus_regs[DRV_MODBUS_INST_0].n_banks = DRV_MODBUS_0_BANK_MAX;
+	vdrv_modbus_regs[DRV_MODBUS_INST_0].latency_hist = vdrv_modbus_0_latency_regs_val;
+
+	drv_modbus_file_init();
 
 	for(drv_modbus_inst i = 0; i < DRV_MODBUS_INST_MAX; i++)
 	{
-		/* Ensure that the default address is not a valid address */
-		vdrv_modbus_addr[i] = DRV_MODBUS_BROADCAST_ADDRESS;
+		for(uint16_t unit_id = 0; unit_id < 256; unit_id++)
+
+			vdrv_modbus_unit_bank[i][unit_id] = DRV_MODBUS_NO_BANK;
+
+		vdrv_modbus_bank_idx[i] = 0;
+
+		vdrv_modbus_bank[i] = &vdrv_modbus_regs[i].banks[0];
 
 		vdrv_modbus_status[i] = STATUS_NOT_STARTED;
 
@@ -97,6 +359,44 @@ void drv_modbus_init(void)
 		vdrv_modbus_state[i] = DRV_MODBUS_STATE_IDLE;
 
 		drv_modbus_frame_index[i] = 0;
+
+		drv_modbus_latency_reset(i);
+
+		drv_modbus_diag_clear(i);
+
+		drv_modbus_event_log_clear(i);
+
+		vdrv_modbus_listen_only[i] = false;
+
+		vdrv_modbus_no_response[i] = false;
+
+		memset(vdrv_modbus_busy[i], 0, sizeof(vdrv_modbus_busy[i]));
+
+		vdrv_modbus_pending_exception[i] = DRV_MODBUS_EXCEPTION_CODE_ACKNOWLEDGE;
+
+		vdrv_modbus_rbe_seq[i] = 0;
+
+		vdrv_modbus_rbe_epoch[i]++;
+
+		vdrv_modbus_frozen[i] = false;
+
+		for(uint8_t bank = 0; bank < DRV_MODBUS_MAX_BANKS; bank++)
+
+			for(uint8_t j = 0; j < DRV_MODBUS_MAX_HOLDING_RANGES; j++)
+
+				vdrv_modbus_write_cb[i][bank][j] = NULL;
+
+		for(uint8_t bank = 0; bank < DRV_MODBUS_MAX_BANKS; bank++)
+
+			vdrv_modbus_read_cb[i][bank] = NULL;
+
+		memset(vdrv_modbus_provider[i], 0, sizeof(vdrv_modbus_provider[i]));
+
+		memset(vdrv_modbus_dirty[i], 0, sizeof(vdrv_modbus_dirty[i]));
+
+		memset(vdrv_modbus_dirty_summary[i], 0, sizeof(vdrv_modbus_dirty_summary[i]));
+
+		vdrv_modbus_n_notify[i] = 0;
 	}
 }
 
@@ -106,12 +406,33 @@ void drv_modbus_start(const drv_modbus_config_s config)
 {
 	if((config.inst < DRV_MODBUS_INST_MAX) && (vdrv_modbus_status[config.inst] == STATUS_NOT_STARTED))
 	{
-		vdrv_modbus_addr[config.inst] = config.mb_addr;
+		/* Unit ids are resolved with a lookup table, so that matching takes
+		 * the same time whatever the number of units. The broadcast address
+		 * and the reserved addresses can't be unit ids */
+		if(drv_modbus_unit_id_valid(config.mb_addr))
+
+			vdrv_modbus_unit_bank[config.inst][config.mb_addr] = 0;
+
+		for(uint8_t j = 0; j < config.n_units; j++)
+
+			if(drv_modbus_unit_id_valid(config.units[j].unit_id)
+				&& config.units[j].bank < vdrv_modbus_regs[config.inst].n_banks
+				&& config.units[j].bank < DRV_MODBUS_MAX_BANKS)
+
+				vdrv_modbus_unit_bank[config.inst][config.units[j].unit_id] = config.units[j].bank;
 
 		drv_modbus_uart_inst[config.inst] = config.uart_inst;
 
 		drv_modbus_timer_inst[config.inst] = config.timer_inst;
 
+		if(config.pending_reply == DRV_MODBUS_PENDING_REPLY_BUSY)
+
+			vdrv_modbus_pending_exception[config.inst] = DRV_MODBUS_EXCEPTION_CODE_SERVER_BUSY;
+
+		else
+
+			vdrv_modbus_pending_exception[config.inst] = DRV_MODBUS_EXCEPTION_CODE_ACKNOWLEDGE;
+
 		vdrv_modbus_status[config.inst] = STATUS_STARTED;
 	}
 }
@@ -120,14 +441,9 @@ void drv_modbus_start(const drv_modbus_config_s config)
 
 void drv_modbus_fxn(void)
 {
-	uint8_t crc[2];
-	uint16_t reg_index;
-	uint16_t j;
-	uint16_t requested_address;
-	uint16_t n_words;
-	uint8_t byte_count;
-	bool valid_address_range;
 	static uint8_t exception_code;
+	drv_modbus_state_e prev_state;
+	bool byte_received;
 
 	for(drv_modbus_inst i = 0; i < DRV_MODBUS_INST_MAX; i++)
 	{
@@ -135,23 +451,29 @@ void drv_modbus_fxn(void)
 
 			continue;
 
+		prev_state = vdrv_modbus_state[i];
+
+		byte_received = false;
+
 		switch(vdrv_modbus_state[i])
 		{
 
 		case DRV_MODBUS_STATE_IDLE:
 
-			/* Discard every incoming byte until it matches the address */
+			/* Every frame on the bus is received, whatever its address, so that
+			 * the bus can be diagnosed */
 
-			if(
-				hal_uart_retrieve(drv_modbus_uart_inst[i],
-								  drv_modbus_frame_buffer[i],
-								  1)
-				  == ERROR_NONE
-				&&
-				drv_modbus_frame_buffer[i][0] == vdrv_modbus_addr[i]
-			  )
+			if(hal_uart_retrieve(drv_modbus_uart_inst[i],
+								 drv_modbus_frame_buffer[i],
+								 1)
+				  == ERROR_NONE)
 			{
-				/* The received byte matches the device address */
+				byte_received = true;
+
+				vdrv_modbus_latency[i].first_byte = hal_os_cycles_get();
+
+				/* Characters lost from now on corrupt this frame */
+				vdrv_modbus_overrun_ref[i] = hal_uart_overrun_cnt_get(drv_modbus_uart_inst[i]);
 
 				vdrv_modbus_state[i] = DRV_MODBUS_STATE_RECEIVING;
 
@@ -162,7 +484,7 @@ void drv_modbus_fxn(void)
 				/* The timeout is what delimits a frame */
 				hal_timer_attach(drv_modbus_timer_inst[i],
 								 &vdrv_modbus_timer[i],
-								 DRV_MODBUS_TIMEOUT_BETWEEN_BYTES_MS);
+								 DRV_MODBUS_RTU_TIMEOUT_BETWEEN_BYTES_MS);
 			}
 
 			break;
@@ -174,210 +496,233 @@ void drv_modbus_fxn(void)
 								 1)
 				  == ERROR_NONE)
 			{
-				if(++drv_modbus_frame_index[i] >= DRV_MODBUS_MAX_FRAME_LEN_BYTES)
+				byte_received = true;
 
-					/* Too many bytes are being received */
-					vdrv_modbus_state[i] = DRV_MODBUS_STATE_IDLE;
-
-				else
+				if(++drv_modbus_frame_index[i] >= DRV_MODBUS_RTU_MAX_FRAME_LEN_BYTES)
 
-					hal_timer_attach(drv_modbus_timer_inst[i],
-									 &vdrv_modbus_timer[i],
-									 DRV_MODBUS_TIMEOUT_BETWEEN_BYTES_MS);
+					/* Too many bytes are being received. Drop the rest of the
+					 * frame */
+					vdrv_modbus_state[i] = DRV_MODBUS_STATE_DISCARD;
 
+				hal_timer_attach(drv_modbus_timer_inst[i],
+								 &vdrv_modbus_timer[i],
+								 DRV_MODBUS_RTU_TIMEOUT_BETWEEN_BYTES_MS);
 			}
 			else if(hal_timer_status_get(&vdrv_modbus_timer[i])
 					!= HAL_TIMER_STATUS_TIMEOUT_NOT_REACHED)
 			{
+				vdrv_modbus_latency[i].end_of_frame = hal_os_cycles_get();
+
 				vdrv_modbus_state[i] = DRV_MODBUS_STATE_CHECK_CRC;
 			}
 
 			break;
 
-		case DRV_MODBUS_STATE_CHECK_CRC:
+		case DRV_MODBUS_STATE_DISCARD:
 
-			/* First of all, let's validate the CRC. Remember that the 2 last
-			 * received bytes contain to the CRC */
-			drv_modbus_crc_calc(drv_modbus_frame_buffer[i],
-								drv_modbus_frame_index[i] - 2,
-								crc);
+			/* Wait for the end of an oversize frame */
 
-			if(crc[0] == drv_modbus_frame_buffer[i][drv_modbus_frame_index[i] - 2]
-				&&
-			   crc[1] == drv_modbus_frame_buffer[i][drv_modbus_frame_index[i] - 1])
+			if(hal_uart_retrieve(drv_modbus_uart_inst[i],
+								 &drv_modbus_frame_buffer[i][DRV_MODBUS_RTU_MAX_FRAME_LEN_BYTES - 1],
+								 1)
+				  == ERROR_NONE)
 			{
-				/* CRC match */
-				vdrv_modbus_state[i] = DRV_MODBUS_STATE_CHECK_FC;
+				byte_received = true;
+
+				hal_timer_attach(drv_modbus_timer_inst[i],
+								 &vdrv_modbus_timer[i],
+								 DRV_MODBUS_RTU_TIMEOUT_BETWEEN_BYTES_MS);
 			}
-			else
+			else if(hal_timer_status_get(&vdrv_modbus_timer[i])
+					!= HAL_TIMER_STATUS_TIMEOUT_NOT_REACHED)
+			{
+				/* It couldn't be handled if it was addressed to this device */
+				if(vdrv_modbus_unit_bank[i][drv_modbus_frame_buffer[i][0]] != DRV_MODBUS_NO_BANK)
+				{
+					vdrv_modbus_diag[i].bus_char_overrun++;
+
+					drv_modbus_event_rx(i, DRV_MODBUS_EVENT_RX_CHAR_OVERRUN);
+				}
 
-				/* CRC doesn't match */
 				vdrv_modbus_state[i] = DRV_MODBUS_STATE_IDLE;
+			}
 
 			break;
 
-		case DRV_MODBUS_STATE_CHECK_FC:
+		case DRV_MODBUS_STATE_CHECK_CRC:
 
-			/* Byte 1 contains the Function Code */
-			if(drv_modbus_frame_buffer[i][1] == DRV_MODBUS_FUNCTION_CODE_READ_HOLDING_REGS)
+			/* The frame must at least contain address, function code and CRC */
+			if(drv_modbus_frame_index[i] < DRV_MODBUS_RTU_MIN_FRAME_LEN_BYTES)
+			{
+				vdrv_modbus_diag[i].bus_comm_err++;
 
-				vdrv_modbus_state[i] = DRV_MODBUS_STATE_READ_HOLDING_REGS;
+				/* The address can't be trusted, but it is the best guess */
+				if(vdrv_modbus_unit_bank[i][drv_modbus_frame_buffer[i][0]] != DRV_MODBUS_NO_BANK)
 
-			else if(drv_modbus_frame_buffer[i][1] == DRV_MODBUS_FUNCTION_CODE_READ_INPUT_REGS)
+					drv_modbus_event_rx(i, DRV_MODBUS_EVENT_RX_COMM_ERR);
 
-				vdrv_modbus_state[i] = DRV_MODBUS_STATE_READ_INPUT_REGS;
+				vdrv_modbus_state[i] = DRV_MODBUS_STATE_IDLE;
 
-			else if(drv_modbus_frame_buffer[i][1] == DRV_MODBUS_FUNCTION_CODE_WRITE_SINGLE_REG)
+				break;
+			}
 
-				vdrv_modbus_state[i] = DRV_MODBUS_STATE_WRITE_SINGLE_REG;
+			/* First of all, let's validate the CRC. Remember that the 2 last
+			 * received bytes contain to the CRC */
+			if(!drv_modbus_rtu_crc_check(drv_modbus_frame_buffer[i],
+										 drv_modbus_frame_index[i]))
+			{
+				/* CRC doesn't match */
+				vdrv_modbus_diag[i].bus_comm_err++;
 
-			else if(drv_modbus_frame_buffer[i][1] == DRV_MODBUS_FUNCTION_CODE_WRITE_MULTIPLE_REGS)
+				if(vdrv_modbus_unit_bank[i][drv_modbus_frame_buffer[i][0]] != DRV_MODBUS_NO_BANK)
 
-				vdrv_modbus_state[i] = DRV_MODBUS_STATE_WRITE_MULTIPLE_REGS;
+					drv_modbus_event_rx(i, DRV_MODBUS_EVENT_RX_COMM_ERR);
 
-			else
-			{
-				/* Unknown Function Code. Build exception response */
+				vdrv_modbus_state[i] = DRV_MODBUS_STATE_IDLE;
 
-				exception_code = DRV_MODBUS_EXCEPTION_CODE_ILLEGAL_FUNCTION;
+				break;
+			}
 
-				vdrv_modbus_state[i] = DRV_MODBUS_STATE_BUILD_EXCEPTION_RESPONSE;
+			vdrv_modbus_diag[i].bus_msg++;
+
+			/* Broadcast requests are served but never answered */
+			vdrv_modbus_no_response[i] =
+					drv_modbus_frame_buffer[i][0] == DRV_MODBUS_RTU_BROADCAST_ADDRESS;
+
+			/* Broadcast requests are served by the primary unit */
+			vdrv_modbus_bank_idx[i] = vdrv_modbus_no_response[i] ?
+					0 : vdrv_modbus_unit_bank[i][drv_modbus_frame_buffer[i][0]];
+
+			if(vdrv_modbus_bank_idx[i] == DRV_MODBUS_NO_BANK)
+			{
+				/* Addressed to another device */
+				vdrv_modbus_state[i] = DRV_MODBUS_STATE_IDLE;
+
+				break;
 			}
 
-			break;
+			vdrv_modbus_bank[i] = &vdrv_modbus_regs[i].banks[vdrv_modbus_bank_idx[i]];
 
-		case DRV_MODBUS_STATE_READ_HOLDING_REGS:
+			vdrv_modbus_diag[i].server_msg++;
 
-			/* We know that the whole request frame must be exactly 8 bytes
-			 * long. If it is not, then no response must be sent, and the frame
-			 * must be ignored */
+			if(hal_uart_overrun_cnt_get(drv_modbus_uart_inst[i]) != vdrv_modbus_overrun_ref[i])
+			{
+				/* Characters were lost while receiving the frame */
+				vdrv_modbus_diag[i].bus_char_overrun++;
 
-			if(drv_modbus_frame_index[i] != 8)
+				drv_modbus_event_rx(i, DRV_MODBUS_EVENT_RX_CHAR_OVERRUN);
 
 				vdrv_modbus_state[i] = DRV_MODBUS_STATE_IDLE;
 
-			else
-			{
-				/* The requested address is contained in bytes 2 and 3 */
+				break;
+			}
 
-				requested_address =
-						(uint16_t)drv_modbus_frame_buffer[i][2] << 8
-						| drv_modbus_frame_buffer[i][3];
+			drv_modbus_event_rx(i, vdrv_modbus_no_response[i] ? DRV_MODBUS_EVENT_RX_BROADCAST : 0);
 
-				/* Check if the requested address is implemented (i.e. if the
-				 * register exists) */
+			if(vdrv_modbus_listen_only[i]
+				&& (drv_modbus_frame_buffer[i][1] != DRV_MODBUS_FUNCTION_CODE_DIAGNOSTICS
+					|| drv_modbus_frame_index[i] < 8
+					|| drv_modbus_frame_buffer[i][2] != (DRV_MODBUS_DIAG_RESTART_COMMS >> 8)
+					|| drv_modbus_frame_buffer[i][3] != (DRV_MODBUS_DIAG_RESTART_COMMS & 0xFF)))
+			{
+				/* In listen only mode, only Restart Communications is acted
+				 * upon */
+				vdrv_modbus_diag[i].server_no_response++;
 
-				for(reg_index = 0;
-					reg_index < vdrv_modbus_regs[i].num_holding_regs;
-					reg_index++)
-				{
-					if(vdrv_modbus_regs[i].holding_regs_addr[reg_index]
-						 == requested_address)
+				vdrv_modbus_state[i] = DRV_MODBUS_STATE_IDLE;
+			}
+			else
 
-						/* Address found, meaning the client requested a valid
-						 * address */
-						break;
-				}
+				vdrv_modbus_state[i] = DRV_MODBUS_STATE_CHECK_FC;
+
+			break;
 
-				/* The number of registers is contained in bytes 4 and 5 */
+		case DRV_MODBUS_STATE_CHECK_FC:
 
-				n_words =
-						(uint16_t)drv_modbus_frame_buffer[i][4] << 8
-						| drv_modbus_frame_buffer[i][5];
+			vdrv_modbus_latency[i].dispatch = hal_os_cycles_get();
 
-				/* Check if the request leads to an inexistent address */
+			vdrv_modbus_latency[i].fc = DRV_MODBUS_LATENCY_FC_OTHER;
 
-				valid_address_range = true;
+			/* Byte 1 contains the Function Code */
+			if(vdrv_modbus_busy[i][vdrv_modbus_bank_idx[i]]
+				&& (drv_modbus_frame_buffer[i][1] == DRV_MODBUS_FUNCTION_CODE_WRITE_SINGLE_REG
+					|| drv_modbus_frame_buffer[i][1] == DRV_MODBUS_FUNCTION_CODE_WRITE_MULTIPLE_REGS
+					|| drv_modbus_frame_buffer[i][1] == DRV_MODBUS_FUNCTION_CODE_WRITE_FILE_RECORD))
+			{
+				/* A previous write to the bank is still being processed */
 
-				if(reg_index >= vdrv_modbus_regs[i].num_holding_regs)
+				exception_code = DRV_MODBUS_EXCEPTION_CODE_SERVER_BUSY;
 
-					/* The start address is not implemented */
-					valid_address_range = false;
+				vdrv_modbus_state[i] = DRV_MODBUS_STATE_BUILD_EXCEPTION_RESPONSE;
+			}
+			else if(drv_modbus_frame_buffer[i][1] == DRV_MODBUS_FUNCTION_CODE_READ_HOLDING_REGS)
+			{
+				vdrv_modbus_latency[i].fc = DRV_MODBUS_LATENCY_FC_READ_HOLDING_REGS;
 
-				/* Registers must be contiguous */
-				for(j = reg_index + 1; j < reg_index + n_words; j++)
+				vdrv_modbus_state[i] = DRV_MODBUS_STATE_READ_HOLDING_REGS;
+			}
+			else if(drv_modbus_frame_buffer[i][1] == DRV_MODBUS_FUNCTION_CODE_READ_INPUT_REGS)
+			{
+				vdrv_modbus_latency[i].fc = DRV_MODBUS_LATENCY_FC_READ_INPUT_REGS;
 
-					if(
-					   (vdrv_modbus_regs[i].holding_regs_addr[j]
-							  != vdrv_modbus_regs[i].holding_regs_addr[j - 1] + 1)
-						||
-						(j >= DRV_MODBUS_0_HOLDING_REG_MAX)
-					   )
+				vdrv_modbus_state[i] = DRV_MODBUS_STATE_READ_INPUT_REGS;
+			}
+			else if(drv_modbus_frame_buffer[i][1] == DRV_MODBUS_FUNCTION_CODE_WRITE_SINGLE_REG)
+			{
+				vdrv_modbus_latency[i].fc = DRV_MODBUS_LATENCY_FC_WRITE_SINGLE_REG;
 
-						/* The request leads to an unimplemented address */
-						valid_address_range = false;
+				vdrv_modbus_state[i] = DRV_MODBUS_STATE_WRITE_SINGLE_REG;
+			}
+			else if(drv_modbus_frame_buffer[i][1] == DRV_MODBUS_FUNCTION_CODE_WRITE_MULTIPLE_REGS)
+			{
+				vdrv_modbus_latency[i].fc = DRV_MODBUS_LATENCY_FC_WRITE_MULTIPLE_REGS;
 
-				/* Time to make a decision */
-				if(n_words < 1 || n_words > 125)
-				{
-					/* According to the protocol, the requested number of words
-					 * must be between 1 and 125 (both included). Illegal data
-					 * value */
+				vdrv_modbus_state[i] = DRV_MODBUS_STATE_WRITE_MULTIPLE_REGS;
+			}
+			else if(drv_modbus_frame_buffer[i][1] == DRV_MODBUS_FUNCTION_CODE_DIAGNOSTICS)
 
-					exception_code = DRV_MODBUS_EXCEPTION_CODE_ILLEGAL_DATA_VALUE;
+				vdrv_modbus_state[i] = DRV_MODBUS_STATE_DIAGNOSTICS;
 
-					vdrv_modbus_state[i] = DRV_MODBUS_STATE_BUILD_EXCEPTION_RESPONSE;
-				}
-				else if(valid_address_range == false)
-				{
-					/* Illegal address */
+			else if(drv_modbus_frame_buffer[i][1] == DRV_MODBUS_FUNCTION_CODE_GET_COMM_EVENT_CNT)
 
-					exception_code = DRV_MODBUS_EXCEPTION_CODE_ILLEGAL_DATA_ADDRESS;
+				vdrv_modbus_state[i] = DRV_MODBUS_STATE_GET_COMM_EVENT_CNT;
 
-					vdrv_modbus_state[i] = DRV_MODBUS_STATE_BUILD_EXCEPTION_RESPONSE;
-				}
-				else
-				{
-					/* Request OK. Build response */
+			else if(drv_modbus_frame_buffer[i][1] == DRV_MODBUS_FUNCTION_CODE_GET_COMM_EVENT_LOG)
 
-					/* Bytes 0 and 1 already contain the server address and the
-					 * function code respectively, and shall not be modified */
+				vdrv_modbus_state[i] = DRV_MODBUS_STATE_GET_COMM_EVENT_LOG;
 
-					/* Byte 2 contains the byte count */
-					drv_modbus_frame_buffer[i][2] = n_words << 1;
+			else if(drv_modbus_frame_buffer[i][1] == DRV_MODBUS_FUNCTION_CODE_READ_FIFO_QUEUE)
 
-					/* The next bytes contain the register values */
+				vdrv_modbus_state[i] = DRV_MODBUS_STATE_READ_FIFO_QUEUE;
 
-					drv_modbus_frame_index[i] = 3;
+			else if(drv_modbus_frame_buffer[i][1] == DRV_MODBUS_FUNCTION_CODE_READ_FILE_RECORD)
 
-					for(j = 0; j < n_words; j++)
-					{
-						/* High order byte first */
-						drv_modbus_frame_buffer[i][drv_modbus_frame_index[i] + (j << 1)]
-						   = (uint8_t)(vdrv_modbus_regs[i].holding_regs_val[reg_index + j] >> 8 & 0x00FF);
+				vdrv_modbus_state[i] = DRV_MODBUS_STATE_READ_FILE_RECORD;
 
-						/* Low order byte */
-						drv_modbus_frame_buffer[i][drv_modbus_frame_index[i] + (j << 1) + 1]
-						   = (uint8_t)(vdrv_modbus_regs[i].holding_regs_val[reg_index + j] & 0x00FF);
-					}
+			else if(drv_modbus_frame_buffer[i][1] == DRV_MODBUS_FUNCTION_CODE_WRITE_FILE_RECORD)
 
-					drv_modbus_frame_index[i] += n_words << 1;
+				vdrv_modbus_state[i] = DRV_MODBUS_STATE_WRITE_FILE_RECORD;
 
-					/* CRC */
+			else if(drv_modbus_frame_buffer[i][1] == DRV_MODBUS_FUNCTION_CODE_ENCAPSULATED)
 
-					drv_modbus_crc_calc(drv_modbus_frame_buffer[i],
-										drv_modbus_frame_index[i],
-										crc);
+				vdrv_modbus_state[i] = DRV_MODBUS_STATE_READ_DEV_ID;
 
-					drv_modbus_frame_buffer[i][drv_modbus_frame_index[i]++]
-					   = crc[0];
+			else if(drv_modbus_frame_buffer[i][1] == DRV_MODBUS_FUNCTION_CODE_REPORT_CHANGES)
 
-					drv_modbus_frame_buffer[i][drv_modbus_frame_index[i]++]
-					   = crc[1];
+				vdrv_modbus_state[i] = DRV_MODBUS_STATE_REPORT_CHANGES;
 
-					/* Delay before sending response */
-					hal_timer_attach(drv_modbus_timer_inst[i],
-									 &vdrv_modbus_timer[i],
-									 DRV_MODBUS_TIME_BETWEEN_FRAMES_MS);
+			else
+			{
+				/* Unknown Function Code. Build exception response */
 
+				exception_code = DRV_MODBUS_EXCEPTION_CODE_ILLEGAL_FUNCTION;
 
-					vdrv_modbus_state[i] = DRV_MODBUS_STATE_DELAY_BEFORE_RESPONSE;
-				}
+				vdrv_modbus_state[i] = DRV_MODBUS_STATE_BUILD_EXCEPTION_RESPONSE;
 			}
 
 			break;
 
-		case DRV_MODBUS_STATE_READ_INPUT_REGS:
+		case DRV_MODBUS_STATE_READ_HOLDING_REGS:
 
 			/* We know that the whole request frame must be exactly 8 bytes
 			 * long. If it is not, then no response must be sent, and the frame
@@ -389,120 +734,46 @@ void drv_modbus_fxn(void)
 
 			else
 			{
-				/* The requested address is contained in bytes 2 and 3 */
-
-				requested_address =
-						(uint16_t)drv_modbus_frame_buffer[i][2] << 8
-						| drv_modbus_frame_buffer[i][3];
-
-				/* Check if the requested address is implemented (i.e. if the
-				 * register exists) */
-
-				for(reg_index = 0;
-					reg_index < vdrv_modbus_regs[i].num_input_regs;
-					reg_index++)
-				{
-					if(vdrv_modbus_regs[i].input_regs_addr[reg_index]
-						 == requested_address)
-
-						/* Address found, meaning the client requested a valid
-						 * address */
-						break;
-				}
-
-				/* The number of registers is contained in bytes 4 and 5 */
-
-				n_words =
-						(uint16_t)drv_modbus_frame_buffer[i][4] << 8
-						| drv_modbus_frame_buffer[i][5];
-
-				/* Check if the request leads to an inexistent address */
+				exception_code = drv_modbus_read_regs(i,
+													  DRV_MODBUS_REGISTER_TYPE_HOLDING,
+													  vdrv_modbus_bank[i]->holding_ranges,
+													  vdrv_modbus_bank[i]->n_holding_ranges);
 
-				valid_address_range = true;
+				if(exception_code == DRV_MODBUS_EXCEPTION_CODE_NONE)
 
-				if(reg_index >= vdrv_modbus_regs[i].num_input_regs)
+					drv_modbus_prepare_response(i);
 
-					/* The start address is not implemented */
-					valid_address_range = false;
-
-				/* Registers must be contiguous */
-				for(j = reg_index + 1; j < reg_index + n_words; j++)
-
-					if(
-					   (vdrv_modbus_regs[i].input_regs_addr[j]
-							  != vdrv_modbus_regs[i].input_regs_addr[j - 1] + 1)
-						||
-						(j >= DRV_MODBUS_0_INPUT_REG_MAX)
-					   )
-
-						/* The request leads to an unimplemented address */
-						valid_address_range = false;
-
-				/* Time to make a decision */
-				if(n_words < 1 || n_words > 125)
-				{
-					/* According to the protocol, the requested number of words
-					 * must be between 1 and 125 (both included). Illegal data
-					 * value */
-
-					exception_code = DRV_MODBUS_EXCEPTION_CODE_ILLEGAL_DATA_VALUE;
-
-					vdrv_modbus_state[i] = DRV_MODBUS_STATE_BUILD_EXCEPTION_RESPONSE;
-				}
-				else if(valid_address_range == false)
-				{
-					/* Illegal address */
-
-					exception_code = DRV_MODBUS_EXCEPTION_CODE_ILLEGAL_DATA_ADDRESS;
-
-					vdrv_modbus_state[i] = DRV_MODBUS_STATE_BUILD_EXCEPTION_RESPONSE;
-				}
 				else
-				{
-					/* Request OK. Build response */
-
-					/* Bytes 0 and 1 already contain the server address and the
-					 * function code respectively, and shall not be modified */
 
-					/* Byte 2 contains the byte count */
-					drv_modbus_frame_buffer[i][2] = n_words << 1;
-
-					/* The next bytes contain the register values */
+					vdrv_modbus_state[i] = DRV_MODBUS_STATE_BUILD_EXCEPTION_RESPONSE;
+			}
 
-					drv_modbus_frame_index[i] = 3;
+			break;
 
-					for(j = 0; j < n_words; j++)
-					{
-						/* High order byte first */
-						drv_modbus_frame_buffer[i][drv_modbus_frame_index[i] + (j << 1)]
-						   = (uint8_t)(vdrv_modbus_regs[i].input_regs_val[reg_index + j] >> 8 & 0x00FF);
+		case DRV_MODBUS_STATE_READ_INPUT_REGS:
 
-						/* Low order byte */
-						drv_modbus_frame_buffer[i][drv_modbus_frame_index[i] + (j << 1) + 1]
-						   = (uint8_t)(vdrv_modbus_regs[i].input_regs_val[reg_index + j] & 0x00FF);
-					}
+			/* We know that the whole request frame must be exactly 8 bytes
+			 * long. If it is not, then no response must be sent, and the frame
+			 * must be ignored */
 
-					drv_modbus_frame_index[i] += n_words << 1;
+			if(drv_modbus_frame_index[i] != 8)
 
-					/* CRC */
+				vdrv_modbus_state[i] = DRV_MODBUS_STATE_IDLE;
 
-					drv_modbus_crc_calc(drv_modbus_frame_buffer[i],
-										drv_modbus_frame_index[i],
-										crc);
+			else
+			{
+				exception_code = drv_modbus_read_regs(i,
+													  DRV_MODBUS_REGISTER_TYPE_INPUT,
+													  vdrv_modbus_bank[i]->input_ranges,
+													  vdrv_modbus_bank[i]->n_input_ranges);
 
-					drv_modbus_frame_buffer[i][drv_modbus_frame_index[i]++]
-					   = crc[0];
+				if(exception_code == DRV_MODBUS_EXCEPTION_CODE_NONE)
 
-					drv_modbus_frame_buffer[i][drv_modbus_frame_index[i]++]
-					   = crc[1];
+					drv_modbus_prepare_response(i);
 
-					/* Delay before sending response */
-					hal_timer_attach(drv_modbus_timer_inst[i],
-									 &vdrv_modbus_timer[i],
-									 DRV_MODBUS_TIME_BETWEEN_FRAMES_MS);
+				else
 
-					vdrv_modbus_state[i] = DRV_MODBUS_STATE_DELAY_BEFORE_RESPONSE;
-				}
+					vdrv_modbus_state[i] = DRV_MODBUS_STATE_BUILD_EXCEPTION_RESPONSE;
 			}
 
 			break;
@@ -519,210 +790,217 @@ void drv_modbus_fxn(void)
 
 			else
 			{
-				/* The requested address is contained in bytes 2 and 3 */
+				exception_code = drv_modbus_write_single_reg(i);
 
-				requested_address =
-						(uint16_t)drv_modbus_frame_buffer[i][2] << 8
-						| drv_modbus_frame_buffer[i][3];
+				if(exception_code == DRV_MODBUS_EXCEPTION_CODE_NONE)
 
-				/* Check if the requested address is implemented (i.e. if the
-				 * register exists) */
+					drv_modbus_prepare_response(i);
 
-				for(reg_index = 0;
-					reg_index < vdrv_modbus_regs[i].num_holding_regs;
-					reg_index++)
-				{
-					if(vdrv_modbus_regs[i].holding_regs_addr[reg_index]
-						 == requested_address)
+				else
 
-						/* Address found, meaning the client requested a valid
-						 * address */
-						break;
-				}
+					vdrv_modbus_state[i] = DRV_MODBUS_STATE_BUILD_EXCEPTION_RESPONSE;
+			}
 
-				/* If the requested register has been found, then the request
-				 * can be processed */
-				if(reg_index < vdrv_modbus_regs[i].num_holding_regs)
-				{
-					/* Register found */
+			break;
+
+		case DRV_MODBUS_STATE_WRITE_MULTIPLE_REGS:
 
-					/* Bytes 4 and 5 contain the register value */
+			/* Byte count is specified in byte 6. Knowing it, the correct frame
+			 * length can be calculated. If the frame exceeds the length or
+			 * lacks bytes, then it must be ignored */
 
-					vdrv_modbus_regs[i].holding_regs_val[reg_index]
-						  = (uint16_t)(drv_modbus_frame_buffer[i][4]) << 8
-							| drv_modbus_frame_buffer[i][5];
+			if(drv_modbus_frame_index[i] < 9
+				|| drv_modbus_frame_index[i] != 9 + drv_modbus_frame_buffer[i][6])
 
-					/* The response is exactly the same as the request, so no
-					 * need to modify drv_modbus_frame_buffer[i] */
+				vdrv_modbus_state[i] = DRV_MODBUS_STATE_IDLE;
 
-					/* Delay before sending response */
-					hal_timer_attach(drv_modbus_timer_inst[i],
-									 &vdrv_modbus_timer[i],
-									 DRV_MODBUS_TIME_BETWEEN_FRAMES_MS);
+			else
+			{
+				exception_code = drv_modbus_write_multiple_regs(i);
 
-					vdrv_modbus_state[i] = DRV_MODBUS_STATE_DELAY_BEFORE_RESPONSE;
-				}
-				else
-				{
-					/* Illegal address */
+				if(exception_code == DRV_MODBUS_EXCEPTION_CODE_NONE)
 
-					exception_code = DRV_MODBUS_EXCEPTION_CODE_ILLEGAL_DATA_ADDRESS;
+					drv_modbus_prepare_response(i);
+
+				else
 
 					vdrv_modbus_state[i] = DRV_MODBUS_STATE_BUILD_EXCEPTION_RESPONSE;
-				}
 			}
 
 			break;
 
-		case DRV_MODBUS_STATE_WRITE_MULTIPLE_REGS:
-
-			/* Quantity of registers is specified in bytes 4 and 5 */
-			n_words =
-					(uint16_t)drv_modbus_frame_buffer[i][4] << 8
-					| drv_modbus_frame_buffer[i][5];
-
-			/* Byte count is specified in byte 6 */
-			byte_count = drv_modbus_frame_buffer[i][6];
+		case DRV_MODBUS_STATE_DIAGNOSTICS:
 
-			/* Knowing the quantity of registers, the correct frame length can
-			 * be calculated. If the frame exceeds the length or lacks bytes,
-			 * then it must be ignored */
+			/* Sub-function and data take 2 bytes each. Only Return Query Data
+			 * may carry more data */
 
-			if(drv_modbus_frame_index[i] != 9 + byte_count)
+			if(drv_modbus_frame_index[i] < 8)
 
 				vdrv_modbus_state[i] = DRV_MODBUS_STATE_IDLE;
 
 			else
 			{
-				/* The requested address is contained in bytes 2 and 3 */
+				exception_code = drv_modbus_diagnostics(i);
 
-				requested_address =
-						(uint16_t)drv_modbus_frame_buffer[i][2] << 8
-						| drv_modbus_frame_buffer[i][3];
+				if(exception_code == DRV_MODBUS_EXCEPTION_CODE_NONE)
 
-				/* Check if the requested address is implemented (i.e. if the
-				 * register exists) */
+					drv_modbus_prepare_response(i);
 
-				for(reg_index = 0;
-					reg_index < vdrv_modbus_regs[i].num_holding_regs;
-					reg_index++)
-				{
-					if(vdrv_modbus_regs[i].holding_regs_addr[reg_index]
-						 == requested_address)
+				else
 
-						/* Address found, meaning the client requested a valid
-						 * address */
-						break;
-				}
+					vdrv_modbus_state[i] = DRV_MODBUS_STATE_BUILD_EXCEPTION_RESPONSE;
+			}
 
-				/* Check if the request leads to an inexistent address */
+			break;
 
-				valid_address_range = true;
+		case DRV_MODBUS_STATE_GET_COMM_EVENT_CNT:
+		case DRV_MODBUS_STATE_GET_COMM_EVENT_LOG:
 
-				if(reg_index >= vdrv_modbus_regs[i].num_holding_regs)
+			/* These requests only carry address, function code and CRC. If
+			 * the length is wrong, no response is sent */
 
-					/* The start address is not implemented */
-					valid_address_range = false;
+			if(drv_modbus_frame_index[i] != DRV_MODBUS_RTU_MIN_FRAME_LEN_BYTES)
 
-				/* Registers must be contiguous */
-				for(j = reg_index + 1; j < reg_index + n_words; j++)
+				vdrv_modbus_state[i] = DRV_MODBUS_STATE_IDLE;
 
-					if(
-					   (vdrv_modbus_regs[i].holding_regs_addr[j]
-							  != vdrv_modbus_regs[i].holding_regs_addr[j - 1] + 1)
-						||
-						(j >= DRV_MODBUS_0_HOLDING_REG_MAX)
-					   )
+			else
+			{
+				if(vdrv_modbus_state[i] == DRV_MODBUS_STATE_GET_COMM_EVENT_CNT)
 
-						/* The request leads to an unimplemented address */
-						valid_address_range = false;
+					exception_code = drv_modbus_get_comm_event_cnt(i);
 
-				/* Time to make a decision */
-				if(n_words < 1 || n_words > 123)
-				{
-					/* According to the protocol, the requested number of words
-					 * must be between 1 and 123 (both included). Illegal data
-					 * value */
+				else
 
-					exception_code = DRV_MODBUS_EXCEPTION_CODE_ILLEGAL_DATA_VALUE;
+					exception_code = drv_modbus_get_comm_event_log(i);
 
-					vdrv_modbus_state[i] = DRV_MODBUS_STATE_BUILD_EXCEPTION_RESPONSE;
-				}
-				else if(valid_address_range == false)
-				{
-					/* Illegal address */
+				if(exception_code == DRV_MODBUS_EXCEPTION_CODE_NONE)
 
-					exception_code = DRV_MODBUS_EXCEPTION_CODE_ILLEGAL_DATA_ADDRESS;
+					drv_modbus_prepare_response(i);
 
-					vdrv_modbus_state[i] = DRV_MODBUS_STATE_BUILD_EXCEPTION_RESPONSE;
-				}
 				else
-				{
-					/* Request OK */
 
-					/* Perform the write */
+					vdrv_modbus_state[i] = DRV_MODBUS_STATE_BUILD_EXCEPTION_RESPONSE;
+			}
 
-					for(j = reg_index; j < reg_index + n_words; j++)
-					{
-						vdrv_modbus_regs[i].holding_regs_val[j]
-							 = (uint16_t)drv_modbus_frame_buffer[i][7 + ((j - reg_index) << 1)]
-								|  drv_modbus_frame_buffer[i][7 + ((j - reg_index) << 1) + 1];
-					}
+			break;
 
-					/* Build response */
+		case DRV_MODBUS_STATE_READ_FIFO_QUEUE:
 
-					/* The first 6 bytes of the response are the first 6 bytes
-					 * of the request */
+			/* The whole request frame must be exactly 6 bytes long. It is
+			 * a read, so it is ignored when broadcast */
 
-					drv_modbus_frame_index[i] = 6;
+			if(drv_modbus_frame_index[i] != 6
+				|| drv_modbus_frame_buffer[i][0] == DRV_MODBUS_RTU_BROADCAST_ADDRESS)
 
-					/* CRC */
+				vdrv_modbus_state[i] = DRV_MODBUS_STATE_IDLE;
 
-					drv_modbus_crc_calc(drv_modbus_frame_buffer[i],
-										drv_modbus_frame_index[i],
-										crc);
+			else
+			{
+				exception_code = drv_modbus_read_fifo_queue(i);
 
-					drv_modbus_frame_buffer[i][drv_modbus_frame_index[i]++]
-					   = crc[0];
+				if(exception_code == DRV_MODBUS_EXCEPTION_CODE_NONE)
 
-					drv_modbus_frame_buffer[i][drv_modbus_frame_index[i]++]
-					   = crc[1];
+					drv_modbus_prepare_response(i);
 
-					/* Delay before sending response */
-					hal_timer_attach(drv_modbus_timer_inst[i],
-									 &vdrv_modbus_timer[i],
-									 DRV_MODBUS_TIME_BETWEEN_FRAMES_MS);
+				else
 
-					vdrv_modbus_state[i] = DRV_MODBUS_STATE_DELAY_BEFORE_RESPONSE;
-				}
+					vdrv_modbus_state[i] = DRV_MODBUS_STATE_BUILD_EXCEPTION_RESPONSE;
 			}
 
 			break;
 
-		case DRV_MODBUS_STATE_BUILD_EXCEPTION_RESPONSE:
+		case DRV_MODBUS_STATE_READ_FILE_RECORD:
+		case DRV_MODBUS_STATE_WRITE_FILE_RECORD:
 
-			/* Byte 0 already contains the device address. Byte 1 needs to
+			/* Byte count is specified in byte 2. The frame must contain
+			 * exactly that many bytes plus address, function code, byte count
+			 * and CRC */
+
+			if(drv_modbus_frame_index[i] < 5
+				|| drv_modbus_frame_index[i] != 5 + drv_modbus_frame_buffer[i][2])
+
+				vdrv_modbus_state[i] = DRV_MODBUS_STATE_IDLE;
+
+			else
+			{
+				if(vdrv_modbus_state[i] == DRV_MODBUS_STATE_READ_FILE_RECORD)
+
+					exception_code = drv_modbus_read_file_record(i);
+
+				else
+
+					exception_code = drv_modbus_write_file_record(i);
+
+				if(exception_code == DRV_MODBUS_EXCEPTION_CODE_NONE)
+
+					drv_modbus_prepare_response(i);
+
+				else
+
+					vdrv_modbus_state[i] = DRV_MODBUS_STATE_BUILD_EXCEPTION_RESPONSE;
+			}
+
+			break;
+
+		case DRV_MODBUS_STATE_READ_DEV_ID:
+
+			/* The whole request frame must be exactly 7 bytes long */
+
+			if(drv_modbus_frame_index[i] != 7)
+
+				vdrv_modbus_state[i] = DRV_MODBUS_STATE_IDLE;
+
+			else
+			{
+				exception_code = drv_modbus_read_dev_id(i);
+
+				if(exception_code == DRV_MODBUS_EXCEPTION_CODE_NONE)
+
+					drv_modbus_prepare_response(i);
+
+				else
+
+					vdrv_modbus_state[i] = DRV_MODBUS_STATE_BUILD_EXCEPTION_RESPONSE;
+			}
+
+			break;
+
+		case DRV_MODBUS_STATE_REPORT_CHANGES:
+
+			/* The whole request frame must be exactly 13 bytes long */
+
+			if(drv_modbus_frame_index[i] != 13)
+
+				vdrv_modbus_state[i] = DRV_MODBUS_STATE_IDLE;
+
+			else
+			{
+				exception_code = drv_modbus_report_changes(i);
+
+				if(exception_code == DRV_MODBUS_EXCEPTION_CODE_NONE)
+
+					drv_modbus_prepare_response(i);
+
+				else
+
+					vdrv_modbus_state[i] = DRV_MODBUS_STATE_BUILD_EXCEPTION_RESPONSE;
+			}
+
+			break;
+
+		case DRV_MODBUS_STATE_BUILD_EXCEPTION_RESPONSE:
+
+			/* Byte 0 already contains the device address. Byte 1 needs to
 			 * be OR'ed with 0x80 */
 			drv_modbus_frame_buffer[i][1] |= 0x80;
 
 			/* Byte 2 must contain the exception code */
 			drv_modbus_frame_buffer[i][2] = exception_code;
 
-			/* Bytes 3 and 4 must contain the CRC */
-			drv_modbus_crc_calc(drv_modbus_frame_buffer[i],
-								3,
-								&drv_modbus_frame_buffer[i][3]);
-
-			/* Set drv_modbus_frame_index to the total number of bytes to send */
-			drv_modbus_frame_index[i] = 5;
-
-			/* Delay before sending response */
-			hal_timer_attach(drv_modbus_timer_inst[i],
-							 &vdrv_modbus_timer[i],
-							 DRV_MODBUS_TIME_BETWEEN_FRAMES_MS);
+			drv_modbus_frame_index[i] = 3;
 
 			/* Exception response built. Send it */
-			vdrv_modbus_state[i] = DRV_MODBUS_STATE_DELAY_BEFORE_RESPONSE;
+			drv_modbus_prepare_response(i);
 
 			break;
 
@@ -742,6 +1020,33 @@ void drv_modbus_fxn(void)
 							 drv_modbus_frame_buffer[i],
 							 drv_modbus_frame_index[i])
 				== ERROR_NONE)
+			{
+				/* The response has only been queued. The bus can't be
+				 * listened to until the last stop bit has left the wire */
+				hal_timer_attach(drv_modbus_timer_inst[i],
+								 &vdrv_modbus_timer[i],
+								 DRV_MODBUS_RTU_TX_COMPLETE_TIMEOUT_MS);
+
+				vdrv_modbus_state[i] = DRV_MODBUS_STATE_WAIT_TX_COMPLETE;
+			}
+
+			break;
+
+		case DRV_MODBUS_STATE_WAIT_TX_COMPLETE:
+
+			/* As soon as the line is released (and so is DE), start listening
+			 * again. This is the minimum safe turnaround on a half-duplex
+			 * bus */
+			if(hal_uart_tx_complete_get(drv_modbus_uart_inst[i]))
+			{
+				drv_modbus_latency_record(i, hal_os_cycles_get());
+
+				hal_timer_detach(&vdrv_modbus_timer[i]);
+
+				vdrv_modbus_state[i] = DRV_MODBUS_STATE_IDLE;
+			}
+			else if(hal_timer_status_get(&vdrv_modbus_timer[i])
+					!= HAL_TIMER_STATUS_TIMEOUT_NOT_REACHED)
 
 				vdrv_modbus_state[i] = DRV_MODBUS_STATE_IDLE;
 
@@ -753,36 +1058,1490 @@ void drv_modbus_fxn(void)
 
 			break;
 		}
+
+		/* The state machine advances one step per call. If something
+		 * happened, there may be more to do right away (more received bytes
+		 * or a state that doesn't wait for any event), so ask to be run
+		 * again. Otherwise, wait for a UART event or the next tick */
+		if(vdrv_modbus_state[i] != prev_state)
+
+			HAL_TRACE(HAL_TRACE_ID_MODBUS_STATE, i, ((uint16_t)prev_state << 8) | vdrv_modbus_state[i]);
+
+		if(byte_received || vdrv_modbus_state[i] != prev_state)
+
+			hal_os_task_yield();
 	}
 }
 
-static void drv_modbus_crc_calc(uint8_t *buff, uint16_t len, uint8_t crc_buff[2])
+/* Clears the latency histograms */
+void drv_modbus_latency_reset(drv_modbus_inst inst)
+{
+	if(inst >= DRV_MODBUS_INST_MAX || vdrv_modbus_regs[inst].latency_hist == NULL)
+
+		return;
+
+	for(uint16_t j = 0; j < DRV_MODBUS_LATENCY_REG_MAX; j++)
+
+		vdrv_modbus_regs[inst].latency_hist[j] = 0;
+}
+
+void drv_modbus_diag_get(drv_modbus_inst inst, drv_modbus_diag_s *diag)
+{
+	if(inst < DRV_MODBUS_INST_MAX)
+
+		*diag = vdrv_modbus_diag[inst];
+}
+
+/* Attaches the handler called after writes to a holding range, the index of
+ * the range in the holding range table of the bank */
+void drv_modbus_write_cb_attach(drv_modbus_inst inst,
+								uint8_t bank,
+								uint8_t holding_range,
+								drv_modbus_write_cb cb)
+{
+	if(inst < DRV_MODBUS_INST_MAX
+		&& bank < DRV_MODBUS_MAX_BANKS
+		&& holding_range < DRV_MODBUS_MAX_HOLDING_RANGES)
+
+		vdrv_modbus_write_cb[inst][bank][holding_range] = cb;
+}
+
+/* Returns the register map of a bank, NULL if there is no such bank */
+const drv_modbus_bank_s *drv_modbus_bank_get(drv_modbus_inst inst, uint8_t bank)
+{
+	if(inst >= DRV_MODBUS_INST_MAX || bank >= vdrv_modbus_regs[inst].n_banks)
+
+		return NULL;
+
+	return &vdrv_modbus_regs[inst].banks[bank];
+}
+
+/* Looks for a holding register of the bank written by a master since it was
+ * last returned, among the n_regs starting at addr, which must be in the same
+ * range. Its flag is cleared. Returns false if there is none. Called until it
+ * returns false, it gives every change once, in address order */
+bool drv_modbus_changed_get(drv_modbus_inst inst,
+							uint8_t bank,
+							uint16_t addr,
+							uint16_t n_regs,
+							uint16_t *changed_addr)
 {
-	const uint16_t poly = 0xA001;
-	uint16_t crc = 0xFFFF;
+	const drv_modbus_bank_s *regs_bank = drv_modbus_bank_get(inst, bank);
+	uint32_t *dirty;
+	uint32_t bits;
+	uint32_t summary;
+	int16_t first;
+	uint16_t last;
+	uint8_t word;
+
+	if(regs_bank == NULL || bank >= DRV_MODBUS_MAX_BANKS || n_regs == 0)
+
+		return false;
+
+	first = drv_modbus_dirty_index(regs_bank, addr, &n_regs);
+
+	if(first < 0)
+
+		return false;
+
+	last = (uint16_t)first + n_regs - 1;
 
-	for(uint16_t i = 0; i < len; i++)
+	dirty = vdrv_modbus_dirty[inst][bank];
+
+	/* Only the words that hold the span and have changes are looked at */
+	summary = vdrv_modbus_dirty_summary[inst][bank]
+			  & (0xFFFFFFFFUL << (first >> 5))
+			  & (0xFFFFFFFFUL >> (31U - (last >> 5)));
+
+	while(summary != 0)
 	{
-		crc ^= buff[i];
+		word = (uint8_t)__builtin_ctz(summary);
+
+		summary &= summary - 1;
+
+		bits = dirty[word];
+
+		if(word == (first >> 5))
+
+			bits &= 0xFFFFFFFFUL << (first & 31);
+
+		if(word == (last >> 5))
+
+			bits &= 0xFFFFFFFFUL >> (31U - (last & 31U));
 
-		for(uint8_t i = 0; i < 8; i++)
+		if(bits != 0)
 		{
-			if((crc & 1U) == 0)
-			{
-				crc >>= 1;
-			}
-			else
+			bits = (uint32_t)__builtin_ctz(bits);
+
+			dirty[word] &= ~(1UL << bits);
+
+			if(dirty[word] == 0)
+
+				vdrv_modbus_dirty_summary[inst][bank] &= ~(1U << word);
+
+			*changed_addr = addr + (word * 32U + bits) - (uint16_t)first;
+
+			return true;
+		}
+	}
+
+	return false;
+}
+
+/* Readies task_id whenever a master writes any of the n_regs holding
+ * registers of the bank starting at addr. The task then asks what changed
+ * with drv_modbus_changed_get */
+error_e drv_modbus_change_notify_attach(drv_modbus_inst inst,
+										uint8_t bank,
+										uint16_t addr,
+										uint16_t n_regs,
+										uint8_t task_id)
+{
+	drv_modbus_notify_s *notify;
+
+	if(inst >= DRV_MODBUS_INST_MAX || vdrv_modbus_n_notify[inst] >= DRV_MODBUS_MAX_NOTIFY)
+
+		return ERROR_MODBUS_NOTIFY_TABLE_FULL;
+
+	notify = &vdrv_modbus_notify[inst][vdrv_modbus_n_notify[inst]];
+
+	notify->bank = bank;
+	notify->addr = addr;
+	notify->n_regs = n_regs;
+	notify->task_id = task_id;
+
+	vdrv_modbus_n_notify[inst]++;
+
+	return ERROR_NONE;
+}
+
+/* Attaches the handler called before registers of the bank are read */
+void drv_modbus_read_cb_attach(drv_modbus_inst inst,
+							   uint8_t bank,
+							   drv_modbus_read_cb cb)
+{
+	if(inst < DRV_MODBUS_INST_MAX && bank < DRV_MODBUS_MAX_BANKS)
+
+		vdrv_modbus_read_cb[inst][bank] = cb;
+}
+
+/* Makes a range of the bank read through: cb fills it each time it is read */
+void drv_modbus_provider_attach(drv_modbus_inst inst,
+								uint8_t bank,
+								drv_modbus_register_type_s type,
+								uint8_t range,
+								drv_modbus_provider_cb cb)
+{
+	if(inst < DRV_MODBUS_INST_MAX
+		&& bank < DRV_MODBUS_MAX_BANKS
+		&& type <= DRV_MODBUS_REGISTER_TYPE_HOLDING
+		&& range < DRV_MODBUS_MAX_PROVIDED_RANGES)
+
+		vdrv_modbus_provider[inst][bank][type][range] = cb;
+}
+
+/* With freeze, snapshots every input range of the instance that can be
+ * frozen, and serves them from the snapshot from then on. Without it, serves
+ * them live again */
+void drv_modbus_freeze(drv_modbus_inst inst, bool freeze)
+{
+	const drv_modbus_bank_s *bank;
+	const drv_modbus_range_s *range;
+	drv_modbus_provider_cb cb;
+	uint32_t seq = 0;
+
+	if(inst >= DRV_MODBUS_INST_MAX)
+
+		return;
+
+	vdrv_modbus_frozen[inst] = freeze;
+
+	if(!freeze)
+
+		return;
+
+	for(uint8_t b = 0; b < vdrv_modbus_regs[inst].n_banks; b++)
+	{
+		bank = &vdrv_modbus_regs[inst].banks[b];
+
+		for(uint8_t r = 0; r < bank->n_input_ranges; r++)
+		{
+			range = &bank->input_ranges[r];
+
+			if(range->frozen == NULL)
+
+				continue;
+
+			cb = b < DRV_MODBUS_MAX_BANKS && r < DRV_MODBUS_MAX_PROVIDED_RANGES ?
+					vdrv_modbus_provider[inst][b][DRV_MODBUS_REGISTER_TYPE_INPUT][r] : NULL;
+
+			if(cb != NULL)
+
+				cb(inst, range->start_addr, range->n_regs);
+
+			/* Copied again if updated meanwhile, as when read */
+			do
 			{
-				crc >>= 1;
+				if(range->seq != NULL)
+				{
+					seq = *range->seq;
 
-				crc ^= poly;
-			}
+					DRV_MODBUS_BARRIER();
+				}
+
+				memcpy(range->frozen, range->val, range->n_regs * sizeof(uint16_t));
+
+				DRV_MODBUS_BARRIER();
+			} while(range->seq != NULL && ((seq & 1U) != 0 || *range->seq != seq));
 		}
 	}
+}
+
+/* Called once the work left pending by a write handler of the bank is
+ * finished. A write answered with Server Busy is only stored now, and not at
+ * all if the work failed */
+void drv_modbus_complete(drv_modbus_inst inst, uint8_t bank, bool ok)
+{
+	drv_modbus_write_s *write;
+
+	if(inst >= DRV_MODBUS_INST_MAX || bank >= DRV_MODBUS_MAX_BANKS || !vdrv_modbus_busy[inst][bank])
+
+		return;
+
+	write = &vdrv_modbus_write[inst][bank];
+
+	if(ok && write->range != NULL)
+
+		drv_modbus_store(inst, bank, write->range, write->addr, write->n_regs, write->vals);
+
+	vdrv_modbus_busy[inst][bank] = false;
+}
+
+bool drv_modbus_busy_get(drv_modbus_inst inst, uint8_t bank)
+{
+	return inst < DRV_MODBUS_INST_MAX && bank < DRV_MODBUS_MAX_BANKS && vdrv_modbus_busy[inst][bank];
+}
+
+/* True when no frame is being received or answered, e.g. after the response
+ * to a pending write has left the wire */
+bool drv_modbus_bus_idle_get(drv_modbus_inst inst)
+{
+	return inst < DRV_MODBUS_INST_MAX && vdrv_modbus_state[inst] == DRV_MODBUS_STATE_IDLE;
+}
+
+error_e drv_modbus_update_baudrate(drv_modbus_inst inst,
+								   uint32_t clk_freq_hz,
+								   uint32_t baudrate)
+{
+	if(inst >= DRV_MODBUS_INST_MAX)
+
+		return ERROR_INCORRECT_FREQ;
+
+	return hal_uart_update_baudrate(drv_modbus_uart_inst[inst], clk_freq_hz, baudrate);
+}
+
+uint32_t drv_modbus_baudrate_get(drv_modbus_inst inst)
+{
+	if(inst >= DRV_MODBUS_INST_MAX)
+
+		return 0;
+
+	return hal_uart_baudrate_get(drv_modbus_uart_inst[inst]);
+}
+
+/* Finds the range containing all the n_regs registers starting at addr.
+ * Returns NULL if any of them is not implemented */
+static const drv_modbus_range_s *drv_modbus_find_range(const drv_modbus_range_s *ranges,
+													   uint8_t n_ranges,
+													   uint16_t addr,
+													   uint16_t n_regs)
+{
+	for(uint8_t r = 0; r < n_ranges; r++)
+	{
+		if(addr >= ranges[r].start_addr
+			&& (uint32_t)addr + n_regs <= (uint32_t)ranges[r].start_addr + ranges[r].n_regs)
+
+			return &ranges[r];
+	}
+
+	return NULL;
+}
+
+/* Serves a Read Holding/Input Registers request. On success, the response is
+ * left in the frame buffer (without CRC) */
+static uint8_t drv_modbus_read_regs(drv_modbus_inst inst,
+									drv_modbus_register_type_s type,
+									const drv_modbus_range_s *ranges,
+									uint8_t n_ranges)
+{
+	drv_modbus_read_cb cb = vdrv_modbus_read_cb[inst][vdrv_modbus_bank_idx[inst]];
+	uint8_t *frame = drv_modbus_frame_buffer[inst];
+	const drv_modbus_range_s *range;
+	uint16_t requested_address;
+	uint16_t n_words;
+	const uint16_t *val;
+	volatile uint32_t *range_seq;
+	uint32_t seq = 0;
+
+	/* The requested address is contained in bytes 2 and 3, and the number of
+	 * registers in bytes 4 and 5 */
+
+	requested_address = (uint16_t)frame[2] << 8 | frame[3];
+
+	n_words = (uint16_t)frame[4] << 8 | frame[5];
+
+	/* According to the protocol, the requested number of words must be
+	 * between 1 and 125 (both included). It must also fit in the frame buffer
+	 * together with address, function code, byte count and CRC */
+	if(n_words < 1 || n_words > 125
+		|| 5 + (n_words << 1) > DRV_MODBUS_RTU_MAX_FRAME_LEN_BYTES)
+
+		return DRV_MODBUS_EXCEPTION_CODE_ILLEGAL_DATA_VALUE;
+
+	range = drv_modbus_find_range(ranges, n_ranges, requested_address, n_words);
+
+	if(range == NULL)
+
+		return DRV_MODBUS_EXCEPTION_CODE_ILLEGAL_DATA_ADDRESS;
+
+	/* Values that are not available can't be served */
+	if(cb != NULL && cb(inst, type, requested_address, n_words) == DRV_MODBUS_READ_UNAVAILABLE)
+
+		return DRV_MODBUS_EXCEPTION_CODE_GATEWAY_TARGET_FAILED;
+
+	drv_modbus_provide(inst, type, ranges, range, requested_address, n_words);
+
+	/* Request OK. Build response */
+
+	/* Bytes 0 and 1 already contain the server address and the function code
+	 * respectively, and shall not be modified */
+
+	/* Byte 2 contains the byte count */
+	frame[2] = n_words << 1;
+
+	/* The next bytes contain the register values, high order byte first */
+
+	/* A frozen range is served from its snapshot, which doesn't change while
+	 * it is copied */
+	if(vdrv_modbus_frozen[inst] && range->frozen != NULL)
+	{
+		val = &range->frozen[requested_address - range->start_addr];
+
+		range_seq = NULL;
+	}
+	else
+	{
+		val = &range->val[requested_address - range->start_addr];
+
+		range_seq = range->seq;
+	}
+
+	/* If the range was updated meanwhile, the values are copied again, so
+	 * that multi-word values are never torn */
+	do
+	{
+		if(range_seq != NULL)
+		{
+			seq = *range_seq;
+
+			DRV_MODBUS_BARRIER();
+		}
+
+		for(uint16_t j = 0; j < n_words; j++)
+		{
+			frame[3 + (j << 1)] = (uint8_t)(val[j] >> 8);
+			frame[3 + (j << 1) + 1] = (uint8_t)(val[j] & 0x00FF);
+		}
+
+		DRV_MODBUS_BARRIER();
+	} while(range_seq != NULL && ((seq & 1U) != 0 || *range_seq != seq));
+
+	drv_modbus_frame_index[inst] = 3 + (n_words << 1);
+
+	return DRV_MODBUS_EXCEPTION_CODE_NONE;
+}
+
+/* Runs the provider of the range, if any, so that the registers about to be
+ * served are up to date */
+static void drv_modbus_provide(drv_modbus_inst inst,
+							   drv_modbus_register_type_s type,
+							   const drv_modbus_range_s *ranges,
+							   const drv_modbus_range_s *range,
+							   uint16_t addr,
+							   uint16_t n_regs)
+{
+	uint8_t bank = vdrv_modbus_bank_idx[inst];
+	uint8_t range_idx = range - ranges;
+	drv_modbus_provider_cb cb;
+
+	if(bank >= DRV_MODBUS_MAX_BANKS || range_idx >= DRV_MODBUS_MAX_PROVIDED_RANGES)
+
+		return;
+
+	cb = vdrv_modbus_provider[inst][bank][type][range_idx];
+
+	if(cb != NULL)
+
+		cb(inst, addr, n_regs);
+}
+
+/* Serves a Write Single Register request. The response is exactly the same as
+ * the request, so the frame buffer is not modified */
+static uint8_t drv_modbus_write_single_reg(drv_modbus_inst inst)
+{
+	uint8_t *frame = drv_modbus_frame_buffer[inst];
+	const drv_modbus_range_s *range;
+	uint16_t requested_address;
+
+	/* The requested address is contained in bytes 2 and 3 */
+	requested_address = (uint16_t)frame[2] << 8 | frame[3];
+
+	range = drv_modbus_find_range(vdrv_modbus_bank[inst]->holding_ranges,
+								  vdrv_modbus_bank[inst]->n_holding_ranges,
+								  requested_address,
+								  1);
+
+	if(range == NULL)
+
+		return DRV_MODBUS_EXCEPTION_CODE_ILLEGAL_DATA_ADDRESS;
+
+	/* Exclude the CRC from the response length */
+	drv_modbus_frame_index[inst] = 6;
+
+	/* Bytes 4 and 5 contain the register value */
+	return drv_modbus_write_regs(inst, range, requested_address, 1, &frame[4]);
+}
+
+/* Serves a Write Multiple Registers request. The response is the first 6
+ * bytes of the request */
+static uint8_t drv_modbus_write_multiple_regs(drv_modbus_inst inst)
+{
+	uint8_t *frame = drv_modbus_frame_buffer[inst];
+	const drv_modbus_range_s *range;
+	uint16_t requested_address;
+	uint16_t n_words;
 
-	/* CRC low */
-	crc_buff[0] = (uint8_t)(crc & 0x00FFU);
+	/* The requested address is contained in bytes 2 and 3, the quantity of
+	 * registers in bytes 4 and 5 and the byte count in byte 6 */
 
-	/* CRC high */
-	crc_buff[1] = (uint8_t)((crc & 0xFF00U) >> 8U);
+	requested_address = (uint16_t)frame[2] << 8 | frame[3];
+
+	n_words = (uint16_t)frame[4] << 8 | frame[5];
+
+	/* According to the protocol, the requested number of words must be
+	 * between 1 and 123 (both included), and match the byte count */
+	if(n_words < 1 || n_words > DRV_MODBUS_MAX_WRITE_REGS || frame[6] != n_words << 1)
+
+		return DRV_MODBUS_EXCEPTION_CODE_ILLEGAL_DATA_VALUE;
+
+	range = drv_modbus_find_range(vdrv_modbus_bank[inst]->holding_ranges,
+								  vdrv_modbus_bank[inst]->n_holding_ranges,
+								  requested_address,
+								  n_words);
+
+	if(range == NULL)
+
+		return DRV_MODBUS_EXCEPTION_CODE_ILLEGAL_DATA_ADDRESS;
+
+	drv_modbus_frame_index[inst] = 6;
+
+	/* Perform the write. Values start at byte 7 */
+	return drv_modbus_write_regs(inst, range, requested_address, n_words, &frame[7]);
+}
+
+/* Writes n_regs values, high order byte first in data, to the holding
+ * registers of range starting at addr. If the range has validators, nothing
+ * is written if any value is refused. Then the write handler of the range, if
+ * any, is run. If it leaves work pending, the request is answered with the
+ * configured exception. Acknowledge means the request has been processed, so
+ * the values are stored right away. Server Busy means it has not, so they are
+ * only stored once the work is finished */
+static uint8_t drv_modbus_write_regs(drv_modbus_inst inst,
+									 const drv_modbus_range_s *range,
+									 uint16_t addr,
+									 uint16_t n_regs,
+									 const uint8_t *data)
+{
+	uint8_t bank = vdrv_modbus_bank_idx[inst];
+	uint8_t range_idx = range - vdrv_modbus_bank[inst]->holding_ranges;
+	drv_modbus_write_s *write = &vdrv_modbus_write[inst][bank];
+	const drv_modbus_write_hooks_s *hooks;
+	drv_modbus_write_cb cb = NULL;
+	drv_modbus_write_result_e result;
+	bool deferred;
+
+	for(uint16_t j = 0; j < n_regs; j++)
+
+		write->vals[j] = (uint16_t)data[j << 1] << 8 | data[(j << 1) + 1];
+
+	for(uint16_t j = 0; range->hooks != NULL && j < n_regs; j++)
+	{
+		hooks = range->hooks[addr - range->start_addr + j];
+
+		if(hooks != NULL && hooks->validate != NULL
+			&& !hooks->validate(inst, addr + j, write->vals[j]))
+
+			return DRV_MODBUS_EXCEPTION_CODE_ILLEGAL_DATA_VALUE;
+	}
+
+	if(range_idx < DRV_MODBUS_MAX_HOLDING_RANGES)
+
+		cb = vdrv_modbus_write_cb[inst][bank][range_idx];
+
+	result = cb != NULL ? cb(inst, addr, n_regs, write->vals) : DRV_MODBUS_WRITE_DONE;
+
+	if(result == DRV_MODBUS_WRITE_UNAVAILABLE)
+
+		return DRV_MODBUS_EXCEPTION_CODE_GATEWAY_TARGET_FAILED;
+
+	if(result == DRV_MODBUS_WRITE_DONE)
+	{
+		drv_modbus_store(inst, bank, range, addr, n_regs, write->vals);
+
+		return DRV_MODBUS_EXCEPTION_CODE_NONE;
+	}
+
+	deferred = vdrv_modbus_pending_exception[inst] == DRV_MODBUS_EXCEPTION_CODE_SERVER_BUSY;
+
+	if(!deferred)
+
+		drv_modbus_store(inst, bank, range, addr, n_regs, write->vals);
+
+	write->range = deferred ? range : NULL;
+	write->addr = addr;
+	write->n_regs = n_regs;
+
+	vdrv_modbus_busy[inst][bank] = true;
+
+	return vdrv_modbus_pending_exception[inst];
+}
+
+/* Stores n_regs values in the holding registers of range starting at addr,
+ * runs the post write hooks and flags the registers as written */
+static void drv_modbus_store(drv_modbus_inst inst,
+							 uint8_t bank,
+							 const drv_modbus_range_s *range,
+							 uint16_t addr,
+							 uint16_t n_regs,
+							 const uint16_t *vals)
+{
+	const drv_modbus_write_hooks_s *hooks;
+	uint16_t first = addr - range->start_addr;
+
+	for(uint16_t j = 0; j < n_regs; j++)
+
+		range->val[first + j] = vals[j];
+
+	for(uint16_t j = 0; range->hooks != NULL && j < n_regs; j++)
+	{
+		hooks = range->hooks[first + j];
+
+		if(hooks != NULL && hooks->written != NULL)
+
+			hooks->written(inst, addr + j, vals[j]);
+	}
+
+	drv_modbus_dirty_set(inst, bank, addr, n_regs);
+}
+
+/* Index of a holding register among the tracked ones of the bank, -1 if it
+ * isn't tracked. n_regs is cut down to the registers that follow it in the
+ * same range */
+static int16_t drv_modbus_dirty_index(const drv_modbus_bank_s *bank,
+									  uint16_t addr,
+									  uint16_t *n_regs)
+{
+	const drv_modbus_range_s *range;
+	uint16_t base = 0;
+
+	for(uint8_t j = 0; j < bank->n_holding_ranges; j++)
+	{
+		range = &bank->holding_ranges[j];
+
+		if(addr >= range->start_addr && addr < range->start_addr + range->n_regs)
+		{
+			if(*n_regs > range->start_addr + range->n_regs - addr)
+
+				*n_regs = range->start_addr + range->n_regs - addr;
+
+			base += addr - range->start_addr;
+
+			if(base >= DRV_MODBUS_DIRTY_MAX_REGS)
+
+				return -1;
+
+			if(*n_regs > DRV_MODBUS_DIRTY_MAX_REGS - base)
+
+				*n_regs = DRV_MODBUS_DIRTY_MAX_REGS - base;
+
+			return (int16_t)base;
+		}
+
+		base += range->n_regs;
+	}
+
+	return -1;
+}
+
+/* Flags holding registers of a bank written by a master, and readies the
+ * tasks that asked to be told */
+static void drv_modbus_dirty_set(drv_modbus_inst inst,
+								 uint8_t bank,
+								 uint16_t addr,
+								 uint16_t n_regs)
+{
+	drv_modbus_notify_s *notify;
+	int16_t first;
+	uint16_t idx;
+
+	if(bank >= DRV_MODBUS_MAX_BANKS)
+
+		return;
+
+	first = drv_modbus_dirty_index(&vdrv_modbus_regs[inst].banks[bank], addr, &n_regs);
+
+	if(first < 0)
+
+		return;
+
+	for(uint16_t j = 0; j < n_regs; j++)
+	{
+		idx = (uint16_t)first + j;
+
+		vdrv_modbus_dirty[inst][bank][idx >> 5] |= 1UL << (idx & 31U);
+
+		vdrv_modbus_dirty_summary[inst][bank] |= 1U << (idx >> 5);
+	}
+
+	for(uint8_t j = 0; j < vdrv_modbus_n_notify[inst]; j++)
+	{
+		notify = &vdrv_modbus_notify[inst][j];
+
+		if(notify->bank == bank
+			&& addr < notify->addr + notify->n_regs
+			&& notify->addr < addr + n_regs)
+
+			hal_os_task_ready_set(notify->task_id);
+	}
+}
+
+/* Serves a Diagnostics request. The response echoes the sub-function, and
+ * either echoes the data or replaces it with the requested counter */
+static uint8_t drv_modbus_diagnostics(drv_modbus_inst inst)
+{
+	uint8_t *frame = drv_modbus_frame_buffer[inst];
+	drv_modbus_diag_s *diag = &vdrv_modbus_diag[inst];
+	uint16_t sub_function;
+	uint16_t data;
+	uint16_t val;
+
+	/* Sub-function in bytes 2 and 3, data in bytes 4 and 5 */
+
+	sub_function = (uint16_t)frame[2] << 8 | frame[3];
+
+	data = (uint16_t)frame[4] << 8 | frame[5];
+
+	if(sub_function == DRV_MODBUS_DIAG_RETURN_QUERY_DATA)
+	{
+		/* Echo the whole request, whatever its length */
+		drv_modbus_frame_index[inst] -= 2;
+
+		return DRV_MODBUS_EXCEPTION_CODE_NONE;
+	}
+
+	/* The rest of the sub-functions carry exactly one data word */
+	if(drv_modbus_frame_index[inst] != 8)
+
+		return DRV_MODBUS_EXCEPTION_CODE_ILLEGAL_DATA_VALUE;
+
+	drv_modbus_frame_index[inst] = 6;
+
+	switch(sub_function)
+	{
+	case DRV_MODBUS_DIAG_RESTART_COMMS:
+
+		if(data != 0x0000 && data != DRV_MODBUS_DIAG_RESTART_CLEAR_LOG)
+
+			return DRV_MODBUS_EXCEPTION_CODE_ILLEGAL_DATA_VALUE;
+
+		drv_modbus_diag_clear(inst);
+
+		if(data == DRV_MODBUS_DIAG_RESTART_CLEAR_LOG)
+
+			drv_modbus_event_log_clear(inst);
+
+		drv_modbus_event_add(inst, DRV_MODBUS_EVENT_RESTART);
+
+		/* If the port was in listen only mode, it leaves it silently */
+		if(vdrv_modbus_listen_only[inst])
+		{
+			vdrv_modbus_listen_only[inst] = false;
+
+			vdrv_modbus_no_response[inst] = true;
+		}
+
+		return DRV_MODBUS_EXCEPTION_CODE_NONE;
+
+	case DRV_MODBUS_DIAG_FORCE_LISTEN_ONLY:
+
+		/* No response is sent */
+		vdrv_modbus_listen_only[inst] = true;
+
+		drv_modbus_event_add(inst, DRV_MODBUS_EVENT_LISTEN_ONLY);
+
+		return DRV_MODBUS_EXCEPTION_CODE_NONE;
+
+	case DRV_MODBUS_DIAG_CLEAR_COUNTERS:
+
+		drv_modbus_diag_clear(inst);
+
+		return DRV_MODBUS_EXCEPTION_CODE_NONE;
+
+	case DRV_MODBUS_DIAG_CLEAR_OVERRUN:
+
+		diag->bus_char_overrun = 0;
+
+		return DRV_MODBUS_EXCEPTION_CODE_NONE;
+
+	case DRV_MODBUS_DIAG_RETURN_DIAG_REGISTER:	val = 0;							break;
+	case DRV_MODBUS_DIAG_BUS_MSG_CNT:			val = diag->bus_msg;				break;
+	case DRV_MODBUS_DIAG_BUS_COMM_ERR_CNT:		val = diag->bus_comm_err;			break;
+	case DRV_MODBUS_DIAG_BUS_EXCEPTION_ERR_CNT:	val = diag->exception_err;			break;
+	case DRV_MODBUS_DIAG_SERVER_MSG_CNT:		val = diag->server_msg;				break;
+	case DRV_MODBUS_DIAG_SERVER_NO_RESPONSE_CNT:	val = diag->server_no_response;	break;
+	case DRV_MODBUS_DIAG_SERVER_NAK_CNT:		val = diag->server_nak;				break;
+	case DRV_MODBUS_DIAG_SERVER_BUSY_CNT:		val = diag->server_busy;			break;
+	case DRV_MODBUS_DIAG_BUS_CHAR_OVERRUN_CNT:	val = diag->bus_char_overrun;		break;
+
+	default:
+
+		return DRV_MODBUS_EXCEPTION_CODE_ILLEGAL_FUNCTION;
+	}
+
+	/* Counters must be 0 in the request */
+	if(data != 0)
+
+		return DRV_MODBUS_EXCEPTION_CODE_ILLEGAL_DATA_VALUE;
+
+	frame[4] = (uint8_t)(val >> 8);
+	frame[5] = (uint8_t)(val & 0x00FF);
+
+	return DRV_MODBUS_EXCEPTION_CODE_NONE;
+}
+
+/* Appends the CRC to the response in the frame buffer and waits for the
+ * inter-frame delay before sending it */
+static void drv_modbus_prepare_response(drv_modbus_inst inst)
+{
+	uint8_t crc[2];
+	uint8_t fc = drv_modbus_frame_buffer[inst][1];
+
+	/* The event counter counts successfully completed requests, except the
+	 * ones that fetch it */
+	if((fc & 0x80) == 0
+		&& fc != DRV_MODBUS_FUNCTION_CODE_GET_COMM_EVENT_CNT
+		&& fc != DRV_MODBUS_FUNCTION_CODE_GET_COMM_EVENT_LOG)
+
+		vdrv_modbus_event_log[inst].event_cnt++;
+
+	/* The send event is logged once the request is processed, whether or not
+	 * the response is actually sent */
+	drv_modbus_event_add(inst,
+						 DRV_MODBUS_EVENT_TX
+						 | ((fc & 0x80) ? cdrv_modbus_tx_event_exception[drv_modbus_frame_buffer[inst][2] & 0x0F] : 0)
+						 | (vdrv_modbus_listen_only[inst] * DRV_MODBUS_EVENT_TX_LISTEN_ONLY));
+
+	/* Nothing is sent for broadcast requests or in listen only mode */
+	if(vdrv_modbus_no_response[inst] || vdrv_modbus_listen_only[inst])
+	{
+		vdrv_modbus_diag[inst].server_no_response++;
+
+		vdrv_modbus_state[inst] = DRV_MODBUS_STATE_IDLE;
+
+		return;
+	}
+
+	if(fc & 0x80)
+	{
+		vdrv_modbus_diag[inst].exception_err++;
+
+		if(drv_modbus_frame_buffer[inst][2] == DRV_MODBUS_EXCEPTION_CODE_NAK)
+
+			vdrv_modbus_diag[inst].server_nak++;
+
+		else if(drv_modbus_frame_buffer[inst][2] == DRV_MODBUS_EXCEPTION_CODE_SERVER_BUSY)
+
+			vdrv_modbus_diag[inst].server_busy++;
+	}
+
+	drv_modbus_rtu_crc_calc(drv_modbus_frame_buffer[inst],
+							drv_modbus_frame_index[inst],
+							crc);
+
+	drv_modbus_frame_buffer[inst][drv_modbus_frame_index[inst]++] = crc[0];
+
+	drv_modbus_frame_buffer[inst][drv_modbus_frame_index[inst]++] = crc[1];
+
+	vdrv_modbus_latency[inst].response_ready = hal_os_cycles_get();
+
+	/* Delay before sending response */
+	hal_timer_attach(drv_modbus_timer_inst[inst],
+					 &vdrv_modbus_timer[inst],
+					 DRV_MODBUS_RTU_TIME_BETWEEN_FRAMES_MS);
+
+	vdrv_modbus_state[inst] = DRV_MODBUS_STATE_DELAY_BEFORE_RESPONSE;
+}
+
+/* Adds the transaction that has just been completed to the histograms of its
+ * function code */
+static void drv_modbus_latency_record(drv_modbus_inst inst, uint32_t tx_complete)
+{
+	drv_modbus_latency_s *lat = &vdrv_modbus_latency[inst];
+	uint16_t *hist = vdrv_modbus_regs[inst].latency_hist;
+	uint32_t cycles_per_us;
+
+	if(hist == NULL)
+
+		return;
+
+	cycles_per_us = hal_clk_get_freq_hz() / 1000000;
+
+	if(cycles_per_us == 0)
+
+		cycles_per_us = 1;
+
+	hist += lat->fc * DRV_MODBUS_LATENCY_METRIC_MAX * DRV_MODBUS_LATENCY_N_BUCKETS;
+
+	drv_modbus_latency_add(&hist[DRV_MODBUS_LATENCY_METRIC_RECEIVE * DRV_MODBUS_LATENCY_N_BUCKETS],
+						   lat->end_of_frame - lat->first_byte,
+						   cycles_per_us);
+
+	drv_modbus_latency_add(&hist[DRV_MODBUS_LATENCY_METRIC_PROCESSING * DRV_MODBUS_LATENCY_N_BUCKETS],
+						   lat->response_ready - lat->dispatch,
+						   cycles_per_us);
+
+	drv_modbus_latency_add(&hist[DRV_MODBUS_LATENCY_METRIC_TURNAROUND * DRV_MODBUS_LATENCY_N_BUCKETS],
+						   tx_complete - lat->response_ready,
+						   cycles_per_us);
+
+	drv_modbus_latency_add(&hist[DRV_MODBUS_LATENCY_METRIC_TOTAL * DRV_MODBUS_LATENCY_N_BUCKETS],
+						   tx_complete - lat->first_byte,
+						   cycles_per_us);
+}
+
+/* Increments the bucket of a logarithmic histogram. See drv_modbus_registers.h
+ * for the bucket limits */
+static void drv_modbus_latency_add(uint16_t *hist, uint32_t cycles, uint32_t cycles_per_us)
+{
+	uint32_t us = cycles / cycles_per_us;
+	uint8_t bucket;
+
+	if(us < 128)
+
+		bucket = 0;
+
+	else
+	{
+		/* Position of the most significant bit, minus 6 */
+		bucket = 31 - __builtin_clz(us) - 6;
+
+		if(bucket >= DRV_MODBUS_LATENCY_N_BUCKETS)
+
+			bucket = DRV_MODBUS_LATENCY_N_BUCKETS - 1;
+	}
+
+	if(hist[bucket] < UINT16_MAX)
+
+		hist[bucket]++;
+}
+
+static void drv_modbus_diag_clear(drv_modbus_inst inst)
+{
+	vdrv_modbus_diag[inst].bus_msg = 0;
+	vdrv_modbus_diag[inst].bus_comm_err = 0;
+	vdrv_modbus_diag[inst].exception_err = 0;
+	vdrv_modbus_diag[inst].server_msg = 0;
+	vdrv_modbus_diag[inst].server_no_response = 0;
+	vdrv_modbus_diag[inst].server_nak = 0;
+	vdrv_modbus_diag[inst].server_busy = 0;
+	vdrv_modbus_diag[inst].bus_char_overrun = 0;
+	vdrv_modbus_event_log[inst].event_cnt = 0;
+}
+
+/* Get Comm Event Counter response: status and event counter */
+static uint8_t drv_modbus_get_comm_event_cnt(drv_modbus_inst inst)
+{
+	uint8_t *frame = drv_modbus_frame_buffer[inst];
+	uint16_t event_cnt = vdrv_modbus_event_log[inst].event_cnt;
+
+	frame[2] = (uint8_t)(drv_modbus_comm_status(inst) >> 8);
+	frame[3] = (uint8_t)(drv_modbus_comm_status(inst) & 0x00FF);
+	frame[4] = (uint8_t)(event_cnt >> 8);
+	frame[5] = (uint8_t)(event_cnt & 0x00FF);
+
+	drv_modbus_frame_index[inst] = 6;
+
+	return DRV_MODBUS_EXCEPTION_CODE_NONE;
+}
+
+/* Get Comm Event Log response: status, event counter, message counter and the
+ * events, most recent first */
+static uint8_t drv_modbus_get_comm_event_log(drv_modbus_inst inst)
+{
+	uint8_t *frame = drv_modbus_frame_buffer[inst];
+	drv_modbus_event_log_s *log = &vdrv_modbus_event_log[inst];
+	uint16_t msg_cnt = vdrv_modbus_diag[inst].bus_msg;
+	uint8_t n_events = log->n_events;
+
+	frame[2] = 6 + n_events;
+	frame[3] = (uint8_t)(drv_modbus_comm_status(inst) >> 8);
+	frame[4] = (uint8_t)(drv_modbus_comm_status(inst) & 0x00FF);
+	frame[5] = (uint8_t)(log->event_cnt >> 8);
+	frame[6] = (uint8_t)(log->event_cnt & 0x00FF);
+	frame[7] = (uint8_t)(msg_cnt >> 8);
+	frame[8] = (uint8_t)(msg_cnt & 0x00FF);
+
+	for(uint8_t j = 0; j < n_events; j++)
+
+		frame[9 + j] = log->events[(uint8_t)(log->head - 1 - j) & (DRV_MODBUS_EVENT_LOG_LEN - 1)];
+
+	drv_modbus_frame_index[inst] = 9 + n_events;
+
+	return DRV_MODBUS_EXCEPTION_CODE_NONE;
+}
+
+/* Read FIFO Queue response: byte count, FIFO count and the samples, oldest
+ * first. Unlike the standard, which rejects queues of more than 31 samples,
+ * the 31 oldest are returned. Reading does not remove them: the master
+ * acknowledges what it got through the FIFO acknowledge register, so that a
+ * longer queue is read over several requests */
+static uint8_t drv_modbus_read_fifo_queue(drv_modbus_inst inst)
+{
+	uint8_t *frame = drv_modbus_frame_buffer[inst];
+	uint16_t vals[DRV_MODBUS_FIFO_MAX_READ];
+	uint16_t ptr_addr;
+	uint8_t n_vals;
+
+	ptr_addr = (uint16_t)frame[2] << 8 | frame[3];
+
+	if(drv_modbus_fifo_read(inst, ptr_addr, vals, DRV_MODBUS_FIFO_MAX_READ, &n_vals)
+		!= ERROR_NONE)
+
+		return DRV_MODBUS_EXCEPTION_CODE_ILLEGAL_DATA_ADDRESS;
+
+	/* The byte count includes the FIFO count */
+	frame[2] = 0;
+	frame[3] = 2 + 2 * n_vals;
+	frame[4] = 0;
+	frame[5] = n_vals;
+
+	for(uint8_t j = 0; j < n_vals; j++)
+	{
+		frame[6 + 2 * j] = (uint8_t)(vals[j] >> 8);
+		frame[7 + 2 * j] = (uint8_t)(vals[j] & 0x00FF);
+	}
+
+	drv_modbus_frame_index[inst] = 6 + 2 * n_vals;
+
+	return DRV_MODBUS_EXCEPTION_CODE_NONE;
+}
+
+/* Read File Record. Every sub-request is answered in order, with its length,
+ * the reference type and the records, high order byte first */
+static uint8_t drv_modbus_read_file_record(drv_modbus_inst inst)
+{
+	uint8_t *frame = drv_modbus_frame_buffer[inst];
+	uint8_t *req = vdrv_modbus_file_req;
+	uint16_t *vals = vdrv_modbus_file_vals;
+	const drv_modbus_file_s *file;
+	uint8_t byte_count;
+	uint16_t resp_len;
+	uint16_t record;
+	uint16_t n_records;
+
+	byte_count = frame[2];
+
+	if(byte_count < DRV_MODBUS_FILE_READ_MIN_BYTE_COUNT
+		|| byte_count > DRV_MODBUS_FILE_READ_MAX_BYTE_COUNT
+		|| byte_count % DRV_MODBUS_FILE_READ_SUB_REQ_LEN != 0)
+
+		return DRV_MODBUS_EXCEPTION_CODE_ILLEGAL_DATA_VALUE;
+
+	/* The response is written over the request, and it is longer */
+	memcpy(req, &frame[3], byte_count);
+
+	resp_len = 0;
+
+	for(uint8_t k = 0; k < byte_count; k += DRV_MODBUS_FILE_READ_SUB_REQ_LEN)
+	{
+		/* Reference type, file number, record number and record length */
+
+		if(req[k] != DRV_MODBUS_FILE_REF_TYPE)
+
+			return DRV_MODBUS_EXCEPTION_CODE_ILLEGAL_DATA_VALUE;
+
+		file = drv_modbus_file_find(inst, (uint16_t)req[k + 1] << 8 | req[k + 2]);
+
+		record = (uint16_t)req[k + 3] << 8 | req[k + 4];
+
+		n_records = (uint16_t)req[k + 5] << 8 | req[k + 6];
+
+		if(file == NULL || file->read == NULL
+			|| n_records == 0
+			|| (uint32_t)record + n_records > file->n_records)
+
+			return DRV_MODBUS_EXCEPTION_CODE_ILLEGAL_DATA_ADDRESS;
+
+		/* Address, function code, length, sub-responses and CRC must fit */
+		if(3 + resp_len + 2 + 2 * (uint32_t)n_records + 2 > DRV_MODBUS_RTU_MAX_FRAME_LEN_BYTES)
+
+			return DRV_MODBUS_EXCEPTION_CODE_ILLEGAL_DATA_VALUE;
+
+		if(file->read(file->ctx, record, n_records, vals) != ERROR_NONE)
+
+			return DRV_MODBUS_EXCEPTION_CODE_SERVER_FAILURE;
+
+		frame[3 + resp_len] = 1 + 2 * n_records;
+		frame[4 + resp_len] = DRV_MODBUS_FILE_REF_TYPE;
+
+		for(uint16_t j = 0; j < n_records; j++)
+		{
+			frame[5 + resp_len + 2 * j] = (uint8_t)(vals[j] >> 8);
+			frame[6 + resp_len + 2 * j] = (uint8_t)(vals[j] & 0x00FF);
+		}
+
+		resp_len += 2 + 2 * n_records;
+	}
+
+	frame[2] = resp_len;
+
+	drv_modbus_frame_index[inst] = 3 + resp_len;
+
+	return DRV_MODBUS_EXCEPTION_CODE_NONE;
+}
+
+/* Write File Record. Every sub-request is checked before anything is written,
+ * so that a bad request leaves all files untouched. The response echoes the
+ * request */
+static uint8_t drv_modbus_write_file_record(drv_modbus_inst inst)
+{
+	uint8_t *frame = drv_modbus_frame_buffer[inst];
+	uint16_t *vals = vdrv_modbus_file_vals;
+	const drv_modbus_file_s *file;
+	uint8_t byte_count;
+	uint16_t k;
+	uint16_t left;
+	uint16_t record;
+	uint16_t n_records;
+
+	byte_count = frame[2];
+
+	if(byte_count < DRV_MODBUS_FILE_WRITE_MIN_BYTE_COUNT
+		|| byte_count > DRV_MODBUS_FILE_WRITE_MAX_BYTE_COUNT)
+
+		return DRV_MODBUS_EXCEPTION_CODE_ILLEGAL_DATA_VALUE;
+
+	/* First pass: validate */
+
+	for(k = 3; k < 3 + byte_count; k += 7 + 2 * n_records)
+	{
+		/* Reference type, file number, record number, record length and
+		 * the records. k never goes past the end of the request here */
+
+		left = 3 + byte_count - k;
+
+		if(left < 7 || frame[k] != DRV_MODBUS_FILE_REF_TYPE)
+
+			return DRV_MODBUS_EXCEPTION_CODE_ILLEGAL_DATA_VALUE;
+
+		n_records = (uint16_t)frame[k + 5] << 8 | frame[k + 6];
+
+		if(left < 7 + 2 * (uint32_t)n_records)
+
+			return DRV_MODBUS_EXCEPTION_CODE_ILLEGAL_DATA_VALUE;
+
+		file = drv_modbus_file_find(inst, (uint16_t)frame[k + 1] << 8 | frame[k + 2]);
+
+		record = (uint16_t)frame[k + 3] << 8 | frame[k + 4];
+
+		if(file == NULL || file->write == NULL
+			|| n_records == 0
+			|| (uint32_t)record + n_records > file->n_records
+			|| record < file->write_record
+			|| (uint32_t)record + n_records > (uint32_t)file->write_record + file->n_write_records)
+
+			return DRV_MODBUS_EXCEPTION_CODE_ILLEGAL_DATA_ADDRESS;
+	}
+
+	/* Second pass: write */
+
+	for(k = 3; k < 3 + byte_count; k += 7 + 2 * n_records)
+	{
+		file = drv_modbus_file_find(inst, (uint16_t)frame[k + 1] << 8 | frame[k + 2]);
+
+		record = (uint16_t)frame[k + 3] << 8 | frame[k + 4];
+
+		n_records = (uint16_t)frame[k + 5] << 8 | frame[k + 6];
+
+		for(uint16_t j = 0; j < n_records; j++)
+
+			vals[j] = (uint16_t)frame[k + 7 + 2 * j] << 8 | frame[k + 8 + 2 * j];
+
+		if(file->write(file->ctx, record, n_records, vals) != ERROR_NONE)
+
+			return DRV_MODBUS_EXCEPTION_CODE_SERVER_FAILURE;
+	}
+
+	/* Echo the request */
+	drv_modbus_frame_index[inst] = 3 + byte_count;
+
+	return DRV_MODBUS_EXCEPTION_CODE_NONE;
+}
+
+/* Read Device Identification. The objects are stored as they are sent, so the
+ * response is a single copy of consecutive objects. In stream access, as many
+ * objects of the category as fit are sent, and the rest are announced with
+ * more follows and the next object id */
+static uint8_t drv_modbus_read_dev_id(drv_modbus_inst inst)
+{
+	uint8_t *frame = drv_modbus_frame_buffer[inst];
+	const uint8_t *objs = cdrv_modbus_dev_id_objs;
+	const uint16_t *offset = cdrv_modbus_dev_id_offset;
+	uint8_t n_objs = cdrv_modbus_dev_id_n_objs;
+	uint8_t last_id;
+	uint8_t first;
+	uint8_t end;
+	uint16_t len;
+
+	/* MEI type in byte 2, read device id code in byte 3, object id in
+	 * byte 4 */
+
+	if(frame[2] != DRV_MODBUS_MEI_TYPE_READ_DEV_ID)
+
+		return DRV_MODBUS_EXCEPTION_CODE_ILLEGAL_FUNCTION;
+
+	if(frame[3] == DRV_MODBUS_DEV_ID_CODE_BASIC)
+
+		last_id = DRV_MODBUS_DEV_ID_LAST_BASIC;
+
+	else if(frame[3] == DRV_MODBUS_DEV_ID_CODE_REGULAR)
+
+		last_id = DRV_MODBUS_DEV_ID_LAST_REGULAR;
+
+	else if(frame[3] == DRV_MODBUS_DEV_ID_CODE_EXTENDED
+			|| frame[3] == DRV_MODBUS_DEV_ID_CODE_INDIVIDUAL)
+
+		last_id = DRV_MODBUS_DEV_ID_LAST_EXTENDED;
+
+	else
+
+		return DRV_MODBUS_EXCEPTION_CODE_ILLEGAL_DATA_VALUE;
+
+	/* The id of an object is its first byte */
+	for(first = 0; first < n_objs; first++)
+
+		if(objs[offset[first]] == frame[4])
+
+			break;
+
+	if(frame[3] == DRV_MODBUS_DEV_ID_CODE_INDIVIDUAL)
+	{
+		if(first >= n_objs)
+
+			return DRV_MODBUS_EXCEPTION_CODE_ILLEGAL_DATA_ADDRESS;
+
+		end = first + 1;
+	}
+	else
+	{
+		/* An unknown object id restarts the stream from the beginning */
+		if(first >= n_objs || objs[offset[first]] > last_id)
+
+			first = 0;
+
+		/* Address, function code, MEI type, code, conformity level, more
+		 * follows, next object id, number of objects and CRC take 10 bytes */
+		for(end = first;
+			end < n_objs
+				&& objs[offset[end]] <= last_id
+				&& offset[end + 1] - offset[first] <= DRV_MODBUS_RTU_MAX_FRAME_LEN_BYTES - 10;
+			end++);
+	}
+
+	len = offset[end] - offset[first];
+
+	frame[4] = DRV_MODBUS_DEV_ID_CONFORMITY_LEVEL;
+
+	if(frame[3] != DRV_MODBUS_DEV_ID_CODE_INDIVIDUAL
+		&& end < n_objs
+		&& objs[offset[end]] <= last_id)
+	{
+		frame[5] = DRV_MODBUS_DEV_ID_MORE_FOLLOWS;
+		frame[6] = objs[offset[end]];
+	}
+	else
+	{
+		frame[5] = 0x00;
+		frame[6] = 0x00;
+	}
+
+	frame[7] = end - first;
+
+	memcpy(&frame[8], &objs[offset[first]], len);
+
+	drv_modbus_frame_index[inst] = 8 + len;
+
+	return DRV_MODBUS_EXCEPTION_CODE_NONE;
+}
+
+/* Report Changes (user defined FC 0x41). The master asks for the registers of
+ * a block that changed after the version stamp it last acknowledged, and gets
+ * (address, value) pairs plus the stamp to acknowledge next time. Registers
+ * are stamped here, by comparing them with the value last reported, so that
+ * changes made through any path are caught. If more registers changed than
+ * fit in a response, the oldest changes are sent and more is set: asking
+ * again with the returned stamp gets the rest. Stamps start over when the
+ * server boots, so every response carries the boot epoch: a master that sees
+ * it change has to read everything again, starting over from stamp 0.
+ *
+ * Request: type (0x03 holding, 0x04 input), address, quantity, stamp (4
+ * bytes). Response: type, epoch (2 bytes), stamp (4 bytes), more, count, and
+ * count pairs of address and value */
+static uint8_t drv_modbus_report_changes(drv_modbus_inst inst)
+{
+	drv_modbus_read_cb cb = vdrv_modbus_read_cb[inst][vdrv_modbus_bank_idx[inst]];
+	const drv_modbus_bank_s *bank = vdrv_modbus_bank[inst];
+	uint8_t *frame = drv_modbus_frame_buffer[inst];
+	const drv_modbus_rbe_block_s *block = NULL;
+	const drv_modbus_range_s *range;
+	drv_modbus_register_type_s type;
+	uint16_t requested_address;
+	uint16_t n_words;
+	uint16_t first;
+	uint16_t diff;
+	uint16_t n_changed = 0;
+	uint16_t count = 0;
+	uint32_t acked;
+	uint32_t last;
+	uint32_t next;
+	const uint16_t *val;
+	uint16_t *vals = vdrv_modbus_rbe_vals;
+	volatile uint32_t *range_seq;
+	uint32_t seq = 0;
+
+	if(frame[2] == DRV_MODBUS_FUNCTION_CODE_READ_HOLDING_REGS)
+
+		type = DRV_MODBUS_REGISTER_TYPE_HOLDING;
+
+	else if(frame[2] == DRV_MODBUS_FUNCTION_CODE_READ_INPUT_REGS)
+
+		type = DRV_MODBUS_REGISTER_TYPE_INPUT;
+
+	else
+
+		return DRV_MODBUS_EXCEPTION_CODE_ILLEGAL_DATA_VALUE;
+
+	requested_address = (uint16_t)frame[3] << 8 | frame[4];
+
+	n_words = (uint16_t)frame[5] << 8 | frame[6];
+
+	acked = (uint32_t)frame[7] << 24 | (uint32_t)frame[8] << 16 | (uint32_t)frame[9] << 8 | frame[10];
+
+	if(n_words < 1 || n_words > 125)
+
+		return DRV_MODBUS_EXCEPTION_CODE_ILLEGAL_DATA_VALUE;
+
+	/* A stamp that was never given means that the master is out of sync,
+	 * e.g. after a reset of the server. It has to read everything again and
+	 * start over from stamp 0 */
+	if(acked > vdrv_modbus_rbe_seq[inst])
+
+		return DRV_MODBUS_EXCEPTION_CODE_ILLEGAL_DATA_VALUE;
+
+	for(uint8_t b = 0; b < bank->n_rbe_blocks; b++)
+	{
+		if(bank->rbe_blocks[b].type == type
+			&& requested_address >= bank->rbe_blocks[b].start_addr
+			&& (uint32_t)requested_address + n_words
+				<= (uint32_t)bank->rbe_blocks[b].start_addr + bank->rbe_blocks[b].n_regs)
+		{
+			block = &bank->rbe_blocks[b];
+
+			break;
+		}
+	}
+
+	if(block == NULL)
+
+		return DRV_MODBUS_EXCEPTION_CODE_ILLEGAL_DATA_ADDRESS;
+
+	if(type == DRV_MODBUS_REGISTER_TYPE_HOLDING)
+
+		range = drv_modbus_find_range(bank->holding_ranges, bank->n_holding_ranges, requested_address, n_words);
+
+	else
+
+		range = drv_modbus_find_range(bank->input_ranges, bank->n_input_ranges, requested_address, n_words);
+
+	if(range == NULL)
+
+		return DRV_MODBUS_EXCEPTION_CODE_ILLEGAL_DATA_ADDRESS;
+
+	if(cb != NULL && cb(inst, type, requested_address, n_words) == DRV_MODBUS_READ_UNAVAILABLE)
+
+		return DRV_MODBUS_EXCEPTION_CODE_GATEWAY_TARGET_FAILED;
+
+	drv_modbus_provide(inst,
+					   type,
+					   type == DRV_MODBUS_REGISTER_TYPE_HOLDING ? bank->holding_ranges : bank->input_ranges,
+					   range,
+					   requested_address,
+					   n_words);
+
+	/* A frozen range reports changes of its snapshot, as it is read */
+	if(vdrv_modbus_frozen[inst] && range->frozen != NULL)
+	{
+		val = &range->frozen[requested_address - range->start_addr];
+
+		range_seq = NULL;
+	}
+	else
+	{
+		val = &range->val[requested_address - range->start_addr];
+
+		range_seq = range->seq;
+	}
+
+	/* The registers are copied first, again if the range was updated
+	 * meanwhile as when read, so that a multi-word value is never stamped or
+	 * reported torn */
+	do
+	{
+		if(range_seq != NULL)
+		{
+			seq = *range_seq;
+
+			DRV_MODBUS_BARRIER();
+		}
+
+		memcpy(vals, val, n_words * sizeof(uint16_t));
+
+		DRV_MODBUS_BARRIER();
+	} while(range_seq != NULL && ((seq & 1U) != 0 || *range_seq != seq));
+
+	first = requested_address - block->start_addr;
+
+	/* Stamp the registers that moved past the deadband, and the ones never
+	 * stamped, so that asking from stamp 0 gets every register */
+	for(uint16_t j = 0; j < n_words; j++)
+	{
+		diff = vals[j] > block->reported[first + j] ?
+				vals[j] - block->reported[first + j] : block->reported[first + j] - vals[j];
+
+		if(block->version[first + j] == 0 || diff > block->deadband)
+		{
+			block->reported[first + j] = vals[j];
+
+			block->version[first + j] = ++vdrv_modbus_rbe_seq[inst];
+		}
+
+		if(block->version[first + j] > acked)
+
+			n_changed++;
+	}
+
+	/* The stamps are unique, so the oldest changes that fit are the ones up
+	 * to the DRV_MODBUS_RBE_MAX_PAIRS-th smallest stamp */
+	last = vdrv_modbus_rbe_seq[inst];
+
+	if(n_changed > DRV_MODBUS_RBE_MAX_PAIRS)
+	{
+		last = acked;
+
+		for(uint8_t k = 0; k < DRV_MODBUS_RBE_MAX_PAIRS; k++)
+		{
+			next = UINT32_MAX;
+
+			for(uint16_t j = 0; j < n_words; j++)
+			{
+				if(block->version[first + j] > last && block->version[first + j] < next)
+
+					next = block->version[first + j];
+			}
+
+			last = next;
+		}
+	}
+
+	/* Bytes 0 and 1 already contain the server address and the function code,
+	 * and byte 2 the type */
+
+	for(uint16_t j = 0; j < n_words; j++)
+	{
+		if(block->version[first + j] > acked && block->version[first + j] <= last)
+		{
+			frame[11 + (count << 2)] = (uint8_t)((requested_address + j) >> 8);
+			frame[11 + (count << 2) + 1] = (uint8_t)((requested_address + j) & 0x00FF);
+			frame[11 + (count << 2) + 2] = (uint8_t)(block->reported[first + j] >> 8);
+			frame[11 + (count << 2) + 3] = (uint8_t)(block->reported[first + j] & 0x00FF);
+
+			count++;
+		}
+	}
+
+	frame[3] = (uint8_t)(vdrv_modbus_rbe_epoch[inst] >> 8);
+	frame[4] = (uint8_t)(vdrv_modbus_rbe_epoch[inst] & 0xFF);
+
+	frame[5] = (uint8_t)(last >> 24);
+	frame[6] = (uint8_t)(last >> 16);
+	frame[7] = (uint8_t)(last >> 8);
+	frame[8] = (uint8_t)(last & 0xFF);
+
+	frame[9] = n_changed > DRV_MODBUS_RBE_MAX_PAIRS ? 1 : 0;
+
+	frame[10] = (uint8_t)count;
+
+	drv_modbus_frame_index[inst] = 11 + (count << 2);
+
+	return DRV_MODBUS_EXCEPTION_CODE_NONE;
+}
+
+static uint16_t drv_modbus_comm_status(drv_modbus_inst inst)
+{
+	return vdrv_modbus_busy[inst][vdrv_modbus_bank_idx[inst]] ?
+			DRV_MODBUS_COMM_STATUS_BUSY : DRV_MODBUS_COMM_STATUS_READY;
+}
+
+static bool drv_modbus_unit_id_valid(uint8_t unit_id)
+{
+	return unit_id != DRV_MODBUS_RTU_BROADCAST_ADDRESS && unit_id <= DRV_MODBUS_RTU_MAX_SERVER_ADDRESS;
+}
+
+/* Adds an event to the log. It is called for every frame, so it doesn't
+ * branch: the head wraps around with a mask and the number of events
+ * saturates with a comparison */
+static void drv_modbus_event_add(drv_modbus_inst inst, uint8_t event)
+{
+	drv_modbus_event_log_s *log = &vdrv_modbus_event_log[inst];
+
+	log->events[log->head & (DRV_MODBUS_EVENT_LOG_LEN - 1)] = event;
+
+	log->head++;
+
+	log->n_events += (log->n_events < DRV_MODBUS_EVENT_LOG_LEN);
+}
+
+/* Adds a receive event. The listen only bit is taken from the current mode */
+static void drv_modbus_event_rx(drv_modbus_inst inst, uint8_t flags)
+{
+	drv_modbus_event_add(inst,
+						 DRV_MODBUS_EVENT_RX
+						 | flags
+						 | (vdrv_modbus_listen_only[inst] * DRV_MODBUS_EVENT_RX_LISTEN_ONLY));
+}
+
+static void drv_modbus_event_log_clear(drv_modbus_inst inst)
+{
+	vdrv_modbus_event_log[inst].head = 0;
+	vdrv_modbus_event_log[inst].n_events = 0;
 }
@@ -8,22 +8,136 @@
 #ifndef DRV_DRV_MODBUS_DRV_MODBUS_H_
 #define DRV_DRV_MODBUS_DRV_MODBUS_H_
 
+#include <stdbool.h>
 #include <stdint.h>
 #include "drv_modbus_common.h"
+#include "drv_modbus_registers.h"
 #include "../../hal/hal_uart/hal_uart.h"
 #include "../../hal/hal_timer/hal_timer.h"
 
+/* How a request is answered when its write handler leaves work pending */
+typedef enum
+{
+	DRV_MODBUS_PENDING_REPLY_ACK,	/* Exception 0x05, Acknowledge. Stored now */
+	DRV_MODBUS_PENDING_REPLY_BUSY,	/* Exception 0x06, Server Busy. Stored once done */
+	DRV_MODBUS_PENDING_REPLY_MAX
+} drv_modbus_pending_reply_e;
+
+/* An additional unit id answered by an instance, and its register bank */
+typedef struct
+{
+	uint8_t unit_id;
+	uint8_t bank;
+} drv_modbus_unit_s;
+
+/* mb_addr is the primary unit id, mapped to bank 0, which also serves
+ * broadcast requests. units may be NULL if n_units is 0. Unit ids must be
+ * from 1 to 247: the others are ignored */
 typedef struct
 {
 	drv_modbus_inst inst;
 	hal_uart_uart_num_e uart_inst;
 	hal_timer_timer_inst_e timer_inst;
 	uint8_t mb_addr;
+	drv_modbus_pending_reply_e pending_reply;
+	const drv_modbus_unit_s *units;
+	uint8_t n_units;
 } drv_modbus_config_s;
 
+/* Result of a write handler */
+typedef enum
+{
+	DRV_MODBUS_WRITE_DONE,
+	DRV_MODBUS_WRITE_PENDING,		/* Finished later with drv_modbus_complete */
+	DRV_MODBUS_WRITE_UNAVAILABLE	/* Answered with exception 0x0B, not stored */
+} drv_modbus_write_result_e;
+
+/* Called when a master writes vals to n_regs holding registers starting at
+ * addr, once they have been validated and before they are stored. Work that
+ * takes long must not be done here: the handler returns
+ * DRV_MODBUS_WRITE_PENDING and the work is done in the background. Until
+ * drv_modbus_complete is called, write requests to the bank are answered with
+ * Server Busy, while reads are still served. With DRV_MODBUS_PENDING_REPLY_ACK
+ * the values are stored right after the handler returns. With
+ * DRV_MODBUS_PENDING_REPLY_BUSY they are stored by drv_modbus_complete, and
+ * the master repeats the request until it is answered normally, so handlers
+ * must return DRV_MODBUS_WRITE_DONE when the request is already in effect */
+typedef drv_modbus_write_result_e (*drv_modbus_write_cb)(drv_modbus_inst inst,
+														 uint16_t addr,
+														 uint16_t n_regs,
+														 const uint16_t *vals);
+
+/* Result of a read handler */
+typedef enum
+{
+	DRV_MODBUS_READ_OK,
+	DRV_MODBUS_READ_UNAVAILABLE		/* Answered with exception 0x0B */
+} drv_modbus_read_result_e;
+
+/* Called before n_regs registers of the given type starting at addr are
+ * served, e.g. to refuse values that are too old. It must not take long */
+typedef drv_modbus_read_result_e (*drv_modbus_read_cb)(drv_modbus_inst inst,
+													   drv_modbus_register_type_s type,
+													   uint16_t addr,
+													   uint16_t n_regs);
+
+/* Fills n_regs registers starting at addr, in the storage of their range,
+ * right before they are served. Values that are costly to keep up to date
+ * are computed only when a master reads them. It runs while the response is
+ * built, so it must not take long */
+typedef void (*drv_modbus_provider_cb)(drv_modbus_inst inst,
+									   uint16_t addr,
+									   uint16_t n_regs);
+
+/* Diagnostic counters, as returned by FC 0x08. They wrap around */
+typedef struct
+{
+	uint16_t bus_msg;				/* Frames with a correct CRC on the bus */
+	uint16_t bus_comm_err;			/* CRC errors and too short frames */
+	uint16_t exception_err;			/* Exception responses sent */
+	uint16_t server_msg;			/* Frames addressed to this device */
+	uint16_t server_no_response;	/* Addressed frames not answered */
+	uint16_t server_nak;			/* Negative Acknowledge exceptions sent */
+	uint16_t server_busy;			/* Server Busy exceptions sent */
+	uint16_t bus_char_overrun;		/* Addressed frames lost to an overrun */
+} drv_modbus_diag_s;
+
 
 void drv_modbus_init(void);
 void drv_modbus_start(const drv_modbus_config_s config);
 void drv_modbus_fxn(void);
+void drv_modbus_latency_reset(drv_modbus_inst inst);
+void drv_modbus_diag_get(drv_modbus_inst inst, drv_modbus_diag_s *diag);
+void drv_modbus_write_cb_attach(drv_modbus_inst inst,
+								uint8_t bank,
+								uint8_t holding_range,
+								drv_modbus_write_cb cb);
+const drv_modbus_bank_s *drv_modbus_bank_get(drv_modbus_inst inst, uint8_t bank);
+void drv_modbus_read_cb_attach(drv_modbus_inst inst,
+							   uint8_t bank,
+							   drv_modbus_read_cb cb);
+void drv_modbus_provider_attach(drv_modbus_inst inst,
+								uint8_t bank,
+								drv_modbus_register_type_s type,
+								uint8_t range,
+								drv_modbus_provider_cb cb);
+bool drv_modbus_changed_get(drv_modbus_inst inst,
+							uint8_t bank,
+							uint16_t addr,
+							uint16_t n_regs,
+							uint16_t *changed_addr);
+error_e drv_modbus_change_notify_attach(drv_modbus_inst inst,
+										uint8_t bank,
+										uint16_t addr,
+										uint16_t n_regs,
+										uint8_t task_id);
+void drv_modbus_freeze(drv_modbus_inst inst, bool freeze);
+void drv_modbus_complete(drv_modbus_inst inst, uint8_t bank, bool ok);
+bool drv_modbus_busy_get(drv_modbus_inst inst, uint8_t bank);
+bool drv_modbus_bus_idle_get(drv_modbus_inst inst);
+error_e drv_modbus_update_baudrate(drv_modbus_inst inst,
+								   uint32_t clk_freq_hz,
+								   uint32_t baudrate);
+uint32_t drv_modbus_baudrate_get(drv_modbus_inst inst);
 
 #endif /* DRV_DRV_MODBUS_DRV_MODBUS_H_ */
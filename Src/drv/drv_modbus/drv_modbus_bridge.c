@@ -0,0 +1,341 @@
+/*
+ * drv_modbus_bridge.c
+ *
+ *  Created on: Oct 19, 2026
+ *      Author: ricard
+ */
+#include <stdbool.h>
+#include <stdlib.h>
+#include "drv_modbus_bridge.h"
+#include "drv_modbus_rtu.h"
+#include "hal_os/hal_os.h"
+#include "hal_clk/hal_clk.h"
+#include "status.h"
+
+/* Type definitions */
+
+typedef enum
+{
+	DRV_MODBUS_BRIDGE_STATE_IDLE,
+	DRV_MODBUS_BRIDGE_STATE_FORWARDING,
+	DRV_MODBUS_BRIDGE_STATE_DISCARD,
+	DRV_MODBUS_BRIDGE_STATE_TURNAROUND
+} drv_modbus_bridge_state_e;
+
+/* Frame being forwarded */
+typedef struct
+{
+	drv_modbus_bridge_dir_e dir;
+	hal_uart_uart_num_e in;
+	hal_uart_uart_num_e out;
+	uint16_t len;
+	uint16_t crc;
+	uint16_t overrun_ref;
+} drv_modbus_bridge_frame_s;
+
+/* Local variables */
+
+static status_e vdrv_modbus_bridge_status[DRV_MODBUS_BRIDGE_INST_MAX] =
+{
+		STATUS_NOT_INIT
+};
+static drv_modbus_bridge_config_s vdrv_modbus_bridge_config[DRV_MODBUS_BRIDGE_INST_MAX];
+static drv_modbus_bridge_state_e vdrv_modbus_bridge_state[DRV_MODBUS_BRIDGE_INST_MAX];
+static hal_timer_timer_s vdrv_modbus_bridge_timer[DRV_MODBUS_BRIDGE_INST_MAX];
+static drv_modbus_bridge_frame_s vdrv_modbus_bridge_frame[DRV_MODBUS_BRIDGE_INST_MAX];
+static drv_modbus_bridge_stats_s vdrv_modbus_bridge_stats[DRV_MODBUS_BRIDGE_INST_MAX];
+
+/* Local function declarations */
+
+static bool drv_modbus_bridge_frame_start(drv_modbus_bridge_inst_e inst, uint8_t *byte);
+static bool drv_modbus_bridge_forward(drv_modbus_bridge_inst_e inst, uint8_t byte);
+static void drv_modbus_bridge_abort(drv_modbus_bridge_inst_e inst);
+static uint8_t drv_modbus_bridge_drain(hal_uart_uart_num_e uart_num);
+
+/* Initialize variables */
+
+void drv_modbus_bridge_init(void)
+{
+	for(drv_modbus_bridge_inst_e i = 0; i < DRV_MODBUS_BRIDGE_INST_MAX; i++)
+	{
+		vdrv_modbus_bridge_status[i] = STATUS_NOT_STARTED;
+
+		vdrv_modbus_bridge_state[i] = DRV_MODBUS_BRIDGE_STATE_IDLE;
+
+		hal_timer_detach(&vdrv_modbus_bridge_timer[i]);
+
+		vdrv_modbus_bridge_stats[i] = (drv_modbus_bridge_stats_s){ 0 };
+	}
+}
+
+/* Configure */
+
+void drv_modbus_bridge_start(const drv_modbus_bridge_config_s config)
+{
+	if((config.inst < DRV_MODBUS_BRIDGE_INST_MAX)
+		&& (vdrv_modbus_bridge_status[config.inst] == STATUS_NOT_STARTED)
+		&& (config.uart_a != config.uart_b))
+	{
+		vdrv_modbus_bridge_config[config.inst] = config;
+
+		(void)hal_uart_update_baudrate(config.uart_b,
+									   hal_clk_get_freq_hz(),
+									   hal_uart_baudrate_get(config.uart_a));
+
+		vdrv_modbus_bridge_status[config.inst] = STATUS_STARTED;
+	}
+}
+
+/* Fxn */
+
+void drv_modbus_bridge_fxn(void)
+{
+	drv_modbus_bridge_config_s *config;
+	drv_modbus_bridge_frame_s *frame;
+	drv_modbus_bridge_state_e prev_state;
+	uint8_t byte;
+	bool byte_received;
+
+	for(drv_modbus_bridge_inst_e i = 0; i < DRV_MODBUS_BRIDGE_INST_MAX; i++)
+	{
+		if(vdrv_modbus_bridge_status[i] != STATUS_STARTED)
+
+			continue;
+
+		config = &vdrv_modbus_bridge_config[i];
+
+		frame = &vdrv_modbus_bridge_frame[i];
+
+		prev_state = vdrv_modbus_bridge_state[i];
+
+		byte_received = false;
+
+		switch(vdrv_modbus_bridge_state[i])
+		{
+
+		case DRV_MODBUS_BRIDGE_STATE_IDLE:
+
+			if(drv_modbus_bridge_frame_start(i, &byte))
+			{
+				byte_received = true;
+
+				hal_timer_attach(config->timer_inst,
+								 &vdrv_modbus_bridge_timer[i],
+								 DRV_MODBUS_RTU_TIMEOUT_BETWEEN_BYTES_MS);
+
+				vdrv_modbus_bridge_state[i] = DRV_MODBUS_BRIDGE_STATE_FORWARDING;
+
+				if(!drv_modbus_bridge_forward(i, byte))
+
+					drv_modbus_bridge_abort(i);
+			}
+
+			break;
+
+		case DRV_MODBUS_BRIDGE_STATE_FORWARDING:
+
+			/* Everything received is sent on right away, so that the delay
+			 * added by the bridge is only what it takes to run this task */
+			while(hal_uart_retrieve(frame->in, &byte, 1) == ERROR_NONE)
+			{
+				byte_received = true;
+
+				if(!drv_modbus_bridge_forward(i, byte))
+				{
+					drv_modbus_bridge_abort(i);
+
+					break;
+				}
+			}
+
+			/* The output port should be quiet while it is driven */
+			vdrv_modbus_bridge_stats[i].collisions += drv_modbus_bridge_drain(frame->out);
+
+			if(vdrv_modbus_bridge_state[i] != DRV_MODBUS_BRIDGE_STATE_FORWARDING)
+
+				break;
+
+			if(byte_received)
+
+				hal_timer_attach(config->timer_inst,
+								 &vdrv_modbus_bridge_timer[i],
+								 DRV_MODBUS_RTU_TIMEOUT_BETWEEN_BYTES_MS);
+
+			else if(hal_timer_status_get(&vdrv_modbus_bridge_timer[i])
+					!= HAL_TIMER_STATUS_TIMEOUT_NOT_REACHED)
+			{
+				/* End of frame. It has already been forwarded whole, so a
+				 * wrong CRC is only counted: the receivers drop it anyway */
+				if(frame->len >= DRV_MODBUS_RTU_MIN_FRAME_LEN_BYTES && frame->crc == 0)
+
+					vdrv_modbus_bridge_stats[i].frames[frame->dir]++;
+
+				else
+
+					vdrv_modbus_bridge_stats[i].crc_errors[frame->dir]++;
+
+				hal_timer_attach(config->timer_inst,
+								 &vdrv_modbus_bridge_timer[i],
+								 DRV_MODBUS_RTU_TX_COMPLETE_TIMEOUT_MS);
+
+				vdrv_modbus_bridge_state[i] = DRV_MODBUS_BRIDGE_STATE_TURNAROUND;
+			}
+
+			break;
+
+		case DRV_MODBUS_BRIDGE_STATE_DISCARD:
+
+			/* Wait for the end of an aborted frame */
+
+			if(drv_modbus_bridge_drain(frame->in) > 0)
+			{
+				byte_received = true;
+
+				hal_timer_attach(config->timer_inst,
+								 &vdrv_modbus_bridge_timer[i],
+								 DRV_MODBUS_RTU_TIMEOUT_BETWEEN_BYTES_MS);
+			}
+			else if(hal_timer_status_get(&vdrv_modbus_bridge_timer[i])
+					!= HAL_TIMER_STATUS_TIMEOUT_NOT_REACHED)
+			{
+				hal_timer_attach(config->timer_inst,
+								 &vdrv_modbus_bridge_timer[i],
+								 DRV_MODBUS_RTU_TX_COMPLETE_TIMEOUT_MS);
+
+				vdrv_modbus_bridge_state[i] = DRV_MODBUS_BRIDGE_STATE_TURNAROUND;
+			}
+
+			break;
+
+		case DRV_MODBUS_BRIDGE_STATE_TURNAROUND:
+
+			/* Once the output port has released the line, whatever it has
+			 * received so far is the echo of the frame. Its next frame, the
+			 * response, can't start earlier than T3.5 later */
+			if(hal_uart_tx_complete_get(frame->out)
+				|| hal_timer_status_get(&vdrv_modbus_bridge_timer[i])
+				   != HAL_TIMER_STATUS_TIMEOUT_NOT_REACHED)
+			{
+				(void)drv_modbus_bridge_drain(frame->out);
+
+				hal_timer_detach(&vdrv_modbus_bridge_timer[i]);
+
+				vdrv_modbus_bridge_state[i] = DRV_MODBUS_BRIDGE_STATE_IDLE;
+			}
+
+			break;
+
+		default:
+
+			vdrv_modbus_bridge_state[i] = DRV_MODBUS_BRIDGE_STATE_IDLE;
+
+			break;
+		}
+
+		/* Same as the Modbus engines: run again right away while there is
+		 * progress */
+		if(byte_received || vdrv_modbus_bridge_state[i] != prev_state)
+
+			hal_os_task_yield();
+	}
+}
+
+void drv_modbus_bridge_stats_get(drv_modbus_bridge_inst_e inst, drv_modbus_bridge_stats_s *stats)
+{
+	if(inst < DRV_MODBUS_BRIDGE_INST_MAX && stats != NULL)
+
+		*stats = vdrv_modbus_bridge_stats[inst];
+}
+
+/* The first port to receive a byte sets the direction of the frame. Returns
+ * that first byte */
+static bool drv_modbus_bridge_frame_start(drv_modbus_bridge_inst_e inst, uint8_t *byte)
+{
+	drv_modbus_bridge_config_s *config = &vdrv_modbus_bridge_config[inst];
+	drv_modbus_bridge_frame_s *frame = &vdrv_modbus_bridge_frame[inst];
+
+	if(hal_uart_retrieve(config->uart_a, byte, 1) == ERROR_NONE)
+	{
+		frame->dir = DRV_MODBUS_BRIDGE_DIR_A_TO_B;
+		frame->in = config->uart_a;
+		frame->out = config->uart_b;
+	}
+	else if(hal_uart_retrieve(config->uart_b, byte, 1) == ERROR_NONE)
+	{
+		frame->dir = DRV_MODBUS_BRIDGE_DIR_B_TO_A;
+		frame->in = config->uart_b;
+		frame->out = config->uart_a;
+	}
+	else
+
+		return false;
+
+	frame->len = 0;
+
+	frame->crc = DRV_MODBUS_RTU_CRC_INIT;
+
+	/* Characters lost from now on corrupt the frame */
+	frame->overrun_ref = hal_uart_overrun_cnt_get(frame->in);
+
+	return true;
+}
+
+/* Sends one byte of the frame on. Returns false if the frame is known to be
+ * corrupt, in which case the byte is not sent */
+static bool drv_modbus_bridge_forward(drv_modbus_bridge_inst_e inst, uint8_t byte)
+{
+	drv_modbus_bridge_frame_s *frame = &vdrv_modbus_bridge_frame[inst];
+
+	if(frame->len >= DRV_MODBUS_RTU_MAX_FRAME_LEN_BYTES
+		|| hal_uart_overrun_cnt_get(frame->in) != frame->overrun_ref)
+
+		return false;
+
+	if(hal_uart_send(frame->out, &byte, 1) != ERROR_NONE)
+
+		return false;
+
+	frame->crc = drv_modbus_rtu_crc_update(frame->crc, byte);
+
+	frame->len++;
+
+	return true;
+}
+
+/* Whatever has been sent of the frame can't be recalled. It is ended with the
+ * complement of its CRC, so that every receiver is certain to drop it */
+static void drv_modbus_bridge_abort(drv_modbus_bridge_inst_e inst)
+{
+	drv_modbus_bridge_frame_s *frame = &vdrv_modbus_bridge_frame[inst];
+	uint8_t tail[2];
+
+	tail[0] = (uint8_t)~(frame->crc & 0x00FFU);
+
+	tail[1] = (uint8_t)~((frame->crc & 0xFF00U) >> 8U);
+
+	(void)hal_uart_send(frame->out, tail, 2);
+
+	vdrv_modbus_bridge_stats[inst].aborted[frame->dir]++;
+
+	hal_timer_attach(vdrv_modbus_bridge_config[inst].timer_inst,
+					 &vdrv_modbus_bridge_timer[inst],
+					 DRV_MODBUS_RTU_TIMEOUT_BETWEEN_BYTES_MS);
+
+	vdrv_modbus_bridge_state[inst] = DRV_MODBUS_BRIDGE_STATE_DISCARD;
+}
+
+/* Empties the receive buffer of a port. Returns the bytes thrown away,
+ * saturated at 255 */
+static uint8_t drv_modbus_bridge_drain(hal_uart_uart_num_e uart_num)
+{
+	uint8_t byte;
+	uint8_t n_bytes = 0;
+
+	while(hal_uart_retrieve(uart_num, &byte, 1) == ERROR_NONE)
+
+		if(n_bytes < 0xFF)
+
+			n_bytes++;
+
+	return n_bytes;
+}
@@ -0,0 +1,54 @@
+/*
+ * drv_modbus_bridge.h
+ *
+ *  Created on: Oct 19, 2026
+ *      Author: ricard
+ */
+
+#ifndef DRV_DRV_MODBUS_DRV_MODBUS_BRIDGE_H_
+#define DRV_DRV_MODBUS_DRV_MODBUS_BRIDGE_H_
+
+#include <stdint.h>
+#include "hal_uart/hal_uart.h"
+#include "hal_timer/hal_timer.h"
+
+typedef enum
+{
+	DRV_MODBUS_BRIDGE_INST_0,
+	DRV_MODBUS_BRIDGE_INST_MAX
+} drv_modbus_bridge_inst_e;
+
+typedef enum
+{
+	DRV_MODBUS_BRIDGE_DIR_A_TO_B,
+	DRV_MODBUS_BRIDGE_DIR_B_TO_A,
+	DRV_MODBUS_BRIDGE_DIR_MAX
+} drv_modbus_bridge_dir_e;
+
+/* Counters of a bridge. They wrap around */
+typedef struct
+{
+	uint16_t frames[DRV_MODBUS_BRIDGE_DIR_MAX];		/* Forwarded with a correct CRC */
+	uint16_t crc_errors[DRV_MODBUS_BRIDGE_DIR_MAX];	/* Forwarded, but with a wrong CRC */
+	uint16_t aborted[DRV_MODBUS_BRIDGE_DIR_MAX];	/* Cut short by an overrun or an oversize frame */
+	uint16_t collisions;							/* Bytes received on the output port */
+} drv_modbus_bridge_stats_s;
+
+/* Repeats every frame received on one port to the other one as it arrives.
+ * Whichever port starts a frame while both are quiet drives the other one
+ * until the frame ends. uart_b is set to the baud rate of uart_a, because
+ * slower output would split frames at the other side */
+typedef struct
+{
+	drv_modbus_bridge_inst_e inst;
+	hal_uart_uart_num_e uart_a;
+	hal_uart_uart_num_e uart_b;
+	hal_timer_timer_inst_e timer_inst;
+} drv_modbus_bridge_config_s;
+
+void drv_modbus_bridge_init(void);
+void drv_modbus_bridge_start(const drv_modbus_bridge_config_s config);
+void drv_modbus_bridge_fxn(void);
+void drv_modbus_bridge_stats_get(drv_modbus_bridge_inst_e inst, drv_modbus_bridge_stats_s *stats);
+
+#endif /* DRV_DRV_MODBUS_DRV_MODBUS_BRIDGE_H_ */
@@ -0,0 +1,76 @@
+/*
+ * drv_modbus_dev_id.c
+ *
+ *  Created on: Oct 19, 2026
+ *      Author: ricard
+ */
+
+#include <stddef.h>
+#include "drv_modbus_dev_id.h"
+#include "drv_modbus_registers.h"
+
+/* Identification strings */
+
+#define DRV_MODBUS_DEV_ID_VENDOR_NAME			"ricard"
+#define DRV_MODBUS_DEV_ID_PRODUCT_CODE			"MBC-L476"
+#define DRV_MODBUS_DEV_ID_REVISION				"1.0"
+#define DRV_MODBUS_DEV_ID_VENDOR_URL			"https://github.com/Ricardgs/modbus_commands"
+#define DRV_MODBUS_DEV_ID_PRODUCT_NAME			"modbus_commands"
+#define DRV_MODBUS_DEV_ID_MODEL_NAME			"NUCLEO-L476RG"
+#define DRV_MODBUS_DEV_ID_USER_APP_NAME			"modbus_commands"
+#define DRV_MODBUS_DEV_ID_BUILD					__DATE__ " " __TIME__
+
+/* An object as it is sent: id, length and the string without terminator */
+#define DRV_MODBUS_DEV_ID_OBJ(name, str)		uint8_t name##_id; \
+												uint8_t name##_len; \
+												char name[sizeof(str) - 1]
+
+#define DRV_MODBUS_DEV_ID_OBJ_INIT(id, str)		id, sizeof(str) - 1, str
+
+typedef struct __attribute__((packed))
+{
+	/* Basic */
+	DRV_MODBUS_DEV_ID_OBJ(vendor_name, DRV_MODBUS_DEV_ID_VENDOR_NAME);
+	DRV_MODBUS_DEV_ID_OBJ(product_code, DRV_MODBUS_DEV_ID_PRODUCT_CODE);
+	DRV_MODBUS_DEV_ID_OBJ(revision, DRV_MODBUS_DEV_ID_REVISION);
+	/* Regular */
+	DRV_MODBUS_DEV_ID_OBJ(vendor_url, DRV_MODBUS_DEV_ID_VENDOR_URL);
+	DRV_MODBUS_DEV_ID_OBJ(product_name, DRV_MODBUS_DEV_ID_PRODUCT_NAME);
+	DRV_MODBUS_DEV_ID_OBJ(model_name, DRV_MODBUS_DEV_ID_MODEL_NAME);
+	DRV_MODBUS_DEV_ID_OBJ(user_app_name, DRV_MODBUS_DEV_ID_USER_APP_NAME);
+	/* Extended */
+	DRV_MODBUS_DEV_ID_OBJ(register_map, DRV_MODBUS_0_REGISTER_MAP_VERSION);
+	DRV_MODBUS_DEV_ID_OBJ(build, DRV_MODBUS_DEV_ID_BUILD);
+} drv_modbus_dev_id_objs_s;
+
+static const drv_modbus_dev_id_objs_s cdrv_modbus_dev_id_table =
+{
+		DRV_MODBUS_DEV_ID_OBJ_INIT(0x00, DRV_MODBUS_DEV_ID_VENDOR_NAME),
+		DRV_MODBUS_DEV_ID_OBJ_INIT(0x01, DRV_MODBUS_DEV_ID_PRODUCT_CODE),
+		DRV_MODBUS_DEV_ID_OBJ_INIT(0x02, DRV_MODBUS_DEV_ID_REVISION),
+		DRV_MODBUS_DEV_ID_OBJ_INIT(0x03, DRV_MODBUS_DEV_ID_VENDOR_URL),
+		DRV_MODBUS_DEV_ID_OBJ_INIT(0x04, DRV_MODBUS_DEV_ID_PRODUCT_NAME),
+		DRV_MODBUS_DEV_ID_OBJ_INIT(0x05, DRV_MODBUS_DEV_ID_MODEL_NAME),
+		DRV_MODBUS_DEV_ID_OBJ_INIT(0x06, DRV_MODBUS_DEV_ID_USER_APP_NAME),
+		DRV_MODBUS_DEV_ID_OBJ_INIT(0x80, DRV_MODBUS_0_REGISTER_MAP_VERSION),
+		DRV_MODBUS_DEV_ID_OBJ_INIT(0x81, DRV_MODBUS_DEV_ID_BUILD)
+};
+
+const uint8_t *const cdrv_modbus_dev_id_objs = (const uint8_t *)&cdrv_modbus_dev_id_table;
+
+const uint16_t cdrv_modbus_dev_id_offset[] =
+{
+		offsetof(drv_modbus_dev_id_objs_s, vendor_name_id),
+		offsetof(drv_modbus_dev_id_objs_s, product_code_id),
+		offsetof(drv_modbus_dev_id_objs_s, revision_id),
+		offsetof(drv_modbus_dev_id_objs_s, vendor_url_id),
+		offsetof(drv_modbus_dev_id_objs_s, product_name_id),
+		offsetof(drv_modbus_dev_id_objs_s, model_name_id),
+		offsetof(drv_modbus_dev_id_objs_s, user_app_name_id),
+		offsetof(drv_modbus_dev_id_objs_s, register_map_id),
+		offsetof(drv_modbus_dev_id_objs_s, build_id),
+		sizeof(drv_modbus_dev_id_objs_s)
+};
+
+const uint8_t cdrv_modbus_dev_id_n_objs =
+		sizeof(cdrv_modbus_dev_id_offset) / sizeof(cdrv_modbus_dev_id_offset[0]) - 1;
@@ -0,0 +1,33 @@
+/*
+ * drv_modbus_dev_id.h
+ *
+ *  Created on: Oct 19, 2026
+ *      Author: ricard
+ */
+
+#ifndef DRV_DRV_MODBUS_DRV_MODBUS_DEV_ID_H_
+#define DRV_DRV_MODBUS_DRV_MODBUS_DEV_ID_H_
+
+#include <stdint.h>
+
+/* Device identification objects, as read with FC 0x2B / MEI 0x0E. They are
+ * stored back to back, each one as object id, length and value, exactly as
+ * they are sent, so that any run of consecutive objects is a single block */
+
+/* Conformity level: basic, regular and extended identification, both stream
+ * and individual access */
+#define DRV_MODBUS_DEV_ID_CONFORMITY_LEVEL	0x83
+
+/* Last object id of each category */
+#define DRV_MODBUS_DEV_ID_LAST_BASIC		0x02
+#define DRV_MODBUS_DEV_ID_LAST_REGULAR		0x7F
+#define DRV_MODBUS_DEV_ID_LAST_EXTENDED		0xFF
+
+/* The objects, in ascending id order, and the offset of each one in
+ * cdrv_modbus_dev_id_objs. cdrv_modbus_dev_id_offset has one more entry
+ * holding the size of the whole table */
+extern const uint8_t *const cdrv_modbus_dev_id_objs;
+extern const uint16_t cdrv_modbus_dev_id_offset[];
+extern const uint8_t cdrv_modbus_dev_id_n_objs;
+
+#endif /* DRV_DRV_MODBUS_DRV_MODBUS_DEV_ID_H_ */
@@ -0,0 +1,189 @@
+/*
+ * drv_modbus_fifo.c
+ *
+ *  Created on: Oct 19, 2026
+ *      Author: ricard
+ */
+
+#include "drv_modbus_fifo.h"
+#include "status.h"
+
+/* Type definitions */
+
+typedef struct
+{
+	uint16_t vals[DRV_MODBUS_FIFO_LEN];
+	uint8_t head;		/* Next position to write */
+	uint8_t n_vals;
+	uint16_t last_val;
+	bool sampled;		/* last_val is valid */
+} drv_modbus_fifo_s;
+
+/* Local variables */
+
+static drv_modbus_fifo_config_s vdrv_modbus_fifo_config[DRV_MODBUS_FIFO_INST_MAX];
+static status_e vdrv_modbus_fifo_status[DRV_MODBUS_FIFO_INST_MAX];
+static drv_modbus_fifo_s vdrv_modbus_fifo[DRV_MODBUS_FIFO_INST_MAX];
+static hal_timer_timer_s vdrv_modbus_fifo_timer[DRV_MODBUS_FIFO_INST_MAX];
+
+/* Local function declarations */
+
+static void drv_modbus_fifo_push(drv_modbus_fifo_s *fifo, uint16_t val);
+
+/* Initialize variables */
+
+void drv_modbus_fifo_init(void)
+{
+	for(drv_modbus_fifo_inst_e i = 0; i < DRV_MODBUS_FIFO_INST_MAX; i++)
+	{
+		vdrv_modbus_fifo_status[i] = STATUS_NOT_STARTED;
+
+		vdrv_modbus_fifo[i].head = 0;
+
+		vdrv_modbus_fifo[i].n_vals = 0;
+
+		vdrv_modbus_fifo[i].sampled = false;
+
+		hal_timer_detach(&vdrv_modbus_fifo_timer[i]);
+	}
+}
+
+/* Configure */
+
+void drv_modbus_fifo_start(const drv_modbus_fifo_config_s config)
+{
+	if((config.fifo_inst < DRV_MODBUS_FIFO_INST_MAX)
+		&& (vdrv_modbus_fifo_status[config.fifo_inst] == STATUS_NOT_STARTED))
+	{
+		vdrv_modbus_fifo_config[config.fifo_inst] = config;
+
+		if(config.period_ms != 0)
+
+			hal_timer_attach(config.timer_inst,
+							 &vdrv_modbus_fifo_timer[config.fifo_inst],
+							 config.period_ms);
+
+		vdrv_modbus_fifo_status[config.fifo_inst] = STATUS_STARTED;
+	}
+}
+
+/* Fxn */
+
+void drv_modbus_fifo_fxn(void)
+{
+	drv_modbus_fifo_config_s *config;
+	drv_modbus_fifo_s *fifo;
+	uint16_t val;
+	bool sample;
+
+	for(drv_modbus_fifo_inst_e i = 0; i < DRV_MODBUS_FIFO_INST_MAX; i++)
+	{
+		if(vdrv_modbus_fifo_status[i] != STATUS_STARTED)
+
+			continue;
+
+		config = &vdrv_modbus_fifo_config[i];
+
+		fifo = &vdrv_modbus_fifo[i];
+
+		if(drv_modbus_read_register(config->modbus_inst,
+									config->reg_type,
+									config->reg,
+									&val)
+			!= ERROR_NONE)
+
+			continue;
+
+		sample = config->on_change
+				 && (fifo->sampled == false || val != fifo->last_val);
+
+		if(config->period_ms != 0
+			&& hal_timer_status_get(&vdrv_modbus_fifo_timer[i])
+				!= HAL_TIMER_STATUS_TIMEOUT_NOT_REACHED)
+		{
+			sample = true;
+
+			hal_timer_attach(config->timer_inst,
+							 &vdrv_modbus_fifo_timer[i],
+							 config->period_ms);
+		}
+
+		if(sample)
+		{
+			drv_modbus_fifo_push(fifo, val);
+
+			fifo->last_val = val;
+
+			fifo->sampled = true;
+		}
+	}
+}
+
+/* Copies up to max_vals samples, oldest first, from the FIFO at ptr_addr.
+ * They stay in the FIFO until acknowledged, so a lost response is simply
+ * read again */
+error_e drv_modbus_fifo_read(drv_modbus_inst modbus_inst,
+							 uint16_t ptr_addr,
+							 uint16_t *vals,
+							 uint8_t max_vals,
+							 uint8_t *n_vals)
+{
+	drv_modbus_fifo_s *fifo;
+	uint8_t tail;
+
+	for(drv_modbus_fifo_inst_e i = 0; i < DRV_MODBUS_FIFO_INST_MAX; i++)
+	{
+		if(vdrv_modbus_fifo_status[i] != STATUS_STARTED
+			|| vdrv_modbus_fifo_config[i].modbus_inst != modbus_inst
+			|| vdrv_modbus_fifo_config[i].ptr_addr != ptr_addr)
+
+			continue;
+
+		fifo = &vdrv_modbus_fifo[i];
+
+		*n_vals = fifo->n_vals < max_vals ? fifo->n_vals : max_vals;
+
+		tail = fifo->head - fifo->n_vals;
+
+		for(uint8_t j = 0; j < *n_vals; j++)
+
+			vals[j] = fifo->vals[(uint8_t)(tail + j) & (DRV_MODBUS_FIFO_LEN - 1)];
+
+		return ERROR_NONE;
+	}
+
+	return ERROR_MODBUS_INEXISTENT_REGISTER;
+}
+
+/* Removes the n_vals oldest samples of the FIFO acknowledged at ack_reg. More
+ * than the FIFO holds empties it */
+void drv_modbus_fifo_ack(drv_modbus_inst modbus_inst, uint16_t ack_reg, uint16_t n_vals)
+{
+	drv_modbus_fifo_s *fifo;
+
+	for(drv_modbus_fifo_inst_e i = 0; i < DRV_MODBUS_FIFO_INST_MAX; i++)
+	{
+		if(vdrv_modbus_fifo_status[i] != STATUS_STARTED
+			|| vdrv_modbus_fifo_config[i].modbus_inst != modbus_inst
+			|| vdrv_modbus_fifo_config[i].ack_reg != ack_reg)
+
+			continue;
+
+		fifo = &vdrv_modbus_fifo[i];
+
+		fifo->n_vals -= n_vals < fifo->n_vals ? n_vals : fifo->n_vals;
+	}
+}
+
+static void drv_modbus_fifo_push(drv_modbus_fifo_s *fifo, uint16_t val)
+{
+	if(fifo->n_vals == DRV_MODBUS_FIFO_LEN)
+
+		return;
+
+	fifo->vals[fifo->head & (DRV_MODBUS_FIFO_LEN - 1)] = val;
+
+	fifo->head++;
+
+	fifo->n_vals++;
+}
@@ -0,0 +1,59 @@
+/*
+ * drv_modbus_fifo.h
+ *
+ *  Created on: Oct 19, 2026
+ *      Author: ricard
+ */
+
+#ifndef DRV_DRV_MODBUS_DRV_MODBUS_FIFO_H_
+#define DRV_DRV_MODBUS_DRV_MODBUS_FIFO_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+#include "drv_modbus_common.h"
+#include "drv_modbus_registers.h"
+#include "hal_timer/hal_timer.h"
+#include "error.h"
+
+/* Samples kept per FIFO. Must be a power of 2. When full, new samples are
+ * dropped until the master acknowledges some, so that an acknowledge never
+ * removes samples it has not read */
+#define DRV_MODBUS_FIFO_LEN			64
+
+/* Most samples returned by one Read FIFO Queue request */
+#define DRV_MODBUS_FIFO_MAX_READ	31
+
+typedef enum
+{
+	DRV_MODBUS_FIFO_INST_0,
+	DRV_MODBUS_FIFO_INST_MAX
+} drv_modbus_fifo_inst_e;
+
+/* A FIFO samples one register of a Modbus instance, every period_ms and/or
+ * whenever its value changes. The master reads it with FC 0x18 at ptr_addr,
+ * which leaves the samples in place, and then writes the number of samples
+ * it got to the holding register ack_reg to remove them */
+typedef struct
+{
+	drv_modbus_fifo_inst_e fifo_inst;
+	drv_modbus_inst modbus_inst;
+	uint16_t ptr_addr;
+	uint16_t ack_reg;
+	drv_modbus_register_type_s reg_type;
+	uint16_t reg;
+	uint16_t period_ms;		/* 0 to disable periodic sampling */
+	bool on_change;
+	hal_timer_timer_inst_e timer_inst;
+} drv_modbus_fifo_config_s;
+
+void drv_modbus_fifo_init(void);
+void drv_modbus_fifo_start(const drv_modbus_fifo_config_s config);
+void drv_modbus_fifo_fxn(void);
+error_e drv_modbus_fifo_read(drv_modbus_inst modbus_inst,
+							 uint16_t ptr_addr,
+							 uint16_t *vals,
+							 uint8_t max_vals,
+							 uint8_t *n_vals);
+void drv_modbus_fifo_ack(drv_modbus_inst modbus_inst, uint16_t ack_reg, uint16_t n_vals);
+
+#endif /* DRV_DRV_MODBUS_DRV_MODBUS_FIFO_H_ */
@@ -0,0 +1,96 @@
+/*
+ * drv_modbus_file.c
+ *
+ *  Created on: Oct 19, 2026
+ *      Author: ricard
+ */
+
+#include <stdlib.h>
+#include "drv_modbus_file.h"
+
+/* Local variables */
+
+static drv_modbus_file_s vdrv_modbus_file[DRV_MODBUS_INST_MAX][DRV_MODBUS_FILE_MAX];
+static uint8_t vdrv_modbus_n_files[DRV_MODBUS_INST_MAX];
+
+/* Initialize variables */
+
+void drv_modbus_file_init(void)
+{
+	for(drv_modbus_inst i = 0; i < DRV_MODBUS_INST_MAX; i++)
+
+		vdrv_modbus_n_files[i] = 0;
+}
+
+/* Makes a file available to the master. The descriptor is copied. Registering
+ * a file number again replaces the previous provider */
+error_e drv_modbus_file_register(drv_modbus_inst inst, const drv_modbus_file_s *file)
+{
+	uint8_t j;
+
+	if(inst >= DRV_MODBUS_INST_MAX
+		|| file->n_records > DRV_MODBUS_FILE_MAX_RECORDS)
+
+		return ERROR_MODBUS_FILE_ACCESS;
+
+	for(j = 0; j < vdrv_modbus_n_files[inst]; j++)
+
+		if(vdrv_modbus_file[inst][j].file_num == file->file_num)
+
+			break;
+
+	if(j >= DRV_MODBUS_FILE_MAX)
+
+		return ERROR_MODBUS_FILE_TABLE_FULL;
+
+	vdrv_modbus_file[inst][j] = *file;
+
+	if(j == vdrv_modbus_n_files[inst])
+
+		vdrv_modbus_n_files[inst]++;
+
+	return ERROR_NONE;
+}
+
+const drv_modbus_file_s *drv_modbus_file_find(drv_modbus_inst inst, uint16_t file_num)
+{
+	if(inst >= DRV_MODBUS_INST_MAX)
+
+		return NULL;
+
+	for(uint8_t j = 0; j < vdrv_modbus_n_files[inst]; j++)
+
+		if(vdrv_modbus_file[inst][j].file_num == file_num)
+
+			return &vdrv_modbus_file[inst][j];
+
+	return NULL;
+}
+
+error_e drv_modbus_file_mem_read(void *ctx,
+								 uint16_t record,
+								 uint16_t n_records,
+								 uint16_t *vals)
+{
+	const uint16_t *mem = (const uint16_t *)ctx;
+
+	for(uint16_t j = 0; j < n_records; j++)
+
+		vals[j] = mem[record + j];
+
+	return ERROR_NONE;
+}
+
+error_e drv_modbus_file_mem_write(void *ctx,
+								  uint16_t record,
+								  uint16_t n_records,
+								  const uint16_t *vals)
+{
+	uint16_t *mem = (uint16_t *)ctx;
+
+	for(uint16_t j = 0; j < n_records; j++)
+
+		mem[record + j] = vals[j];
+
+	return ERROR_NONE;
+}
@@ -0,0 +1,62 @@
+/*
+ * drv_modbus_file.h
+ *
+ *  Created on: Oct 19, 2026
+ *      Author: ricard
+ */
+
+#ifndef DRV_DRV_MODBUS_DRV_MODBUS_FILE_H_
+#define DRV_DRV_MODBUS_DRV_MODBUS_FILE_H_
+
+#include <stdint.h>
+#include "drv_modbus_common.h"
+#include "error.h"
+
+/* Files that can be registered per Modbus instance */
+#define DRV_MODBUS_FILE_MAX				8
+
+/* The protocol limits record numbers to 0x0000 - 0x270F */
+#define DRV_MODBUS_FILE_MAX_RECORDS		10000
+
+/* A file is an array of 16-bit records, accessed with FC 0x14 / 0x15. The
+ * provider copies n_records records starting at record to or from vals. The
+ * range is checked against n_records before the provider is called, and for
+ * writes against the n_write_records records from write_record. read or write
+ * may be NULL if the file can't be read or written. ctx is passed back to the
+ * provider untouched */
+typedef error_e (*drv_modbus_file_read_fxn)(void *ctx,
+											uint16_t record,
+											uint16_t n_records,
+											uint16_t *vals);
+typedef error_e (*drv_modbus_file_write_fxn)(void *ctx,
+											 uint16_t record,
+											 uint16_t n_records,
+											 const uint16_t *vals);
+
+typedef struct
+{
+	uint16_t file_num;
+	uint16_t n_records;
+	drv_modbus_file_read_fxn read;
+	drv_modbus_file_write_fxn write;
+	uint16_t write_record;
+	uint16_t n_write_records;
+	void *ctx;
+} drv_modbus_file_s;
+
+void drv_modbus_file_init(void);
+error_e drv_modbus_file_register(drv_modbus_inst inst, const drv_modbus_file_s *file);
+const drv_modbus_file_s *drv_modbus_file_find(drv_modbus_inst inst, uint16_t file_num);
+
+/* Providers for files that are plain memory, ctx being the address of the
+ * first record. Flash regions are read with drv_modbus_file_mem_read too */
+error_e drv_modbus_file_mem_read(void *ctx,
+								 uint16_t record,
+								 uint16_t n_records,
+								 uint16_t *vals);
+error_e drv_modbus_file_mem_write(void *ctx,
+								  uint16_t record,
+								  uint16_t n_records,
+								  const uint16_t *vals);
+
+#endif /* DRV_DRV_MODBUS_DRV_MODBUS_FILE_H_ */
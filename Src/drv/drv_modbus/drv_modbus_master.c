@@ -0,0 +1,622 @@
+/*
+ * drv_modbus_master.c
+ *
+ *  Created on: Oct 19, 2026
+ *      Author: ricard
+ */
+#include <stdbool.h>
+#include <stdlib.h>
+#include "drv_modbus_master.h"
+#include "drv_modbus_rtu.h"
+#include "hal_os/hal_os.h"
+#include "status.h"
+
+/* Macros */
+
+#define DRV_MODBUS_MASTER_FC_READ_HOLDING_REGS			0x03
+#define DRV_MODBUS_MASTER_FC_READ_INPUT_REGS			0x04
+#define DRV_MODBUS_MASTER_FC_WRITE_SINGLE_REG			0x06
+#define DRV_MODBUS_MASTER_FC_WRITE_MULTIPLE_REGS		0x10
+#define DRV_MODBUS_MASTER_FC_READ_WRITE_MULTIPLE_REGS	0x17
+
+/* Quantity limits of the protocol, so that every frame fits in 256 bytes */
+#define DRV_MODBUS_MASTER_MAX_READ_REGS					125
+#define DRV_MODBUS_MASTER_MAX_WRITE_REGS				123
+#define DRV_MODBUS_MASTER_MAX_READ_WRITE_REGS			121
+
+/* Address, function code, exception code and CRC */
+#define DRV_MODBUS_MASTER_EXCEPTION_LEN_BYTES			5
+
+/* Type definitions */
+
+typedef enum
+{
+	DRV_MODBUS_MASTER_STATE_IDLE,
+	DRV_MODBUS_MASTER_STATE_SEND_REQUEST,
+	DRV_MODBUS_MASTER_STATE_WAIT_TX_COMPLETE,
+	DRV_MODBUS_MASTER_STATE_WAIT_RESPONSE,
+	DRV_MODBUS_MASTER_STATE_RECEIVING,
+	DRV_MODBUS_MASTER_STATE_DISCARD,
+	DRV_MODBUS_MASTER_STATE_CHECK_RESPONSE,
+	DRV_MODBUS_MASTER_STATE_TURNAROUND
+} drv_modbus_master_state_e;
+
+/* Local variables */
+
+static status_e vdrv_modbus_master_status[DRV_MODBUS_MASTER_INST_MAX] =
+{
+		STATUS_NOT_INIT
+};
+static drv_modbus_master_config_s vdrv_modbus_master_config[DRV_MODBUS_MASTER_INST_MAX];
+static drv_modbus_master_state_e vdrv_modbus_master_state[DRV_MODBUS_MASTER_INST_MAX];
+static hal_timer_timer_s vdrv_modbus_master_timer[DRV_MODBUS_MASTER_INST_MAX];
+static drv_modbus_master_trans_s *vdrv_modbus_master_queue[DRV_MODBUS_MASTER_INST_MAX][DRV_MODBUS_MASTER_QUEUE_LEN];
+static uint8_t vdrv_modbus_master_queue_head[DRV_MODBUS_MASTER_INST_MAX];
+static uint8_t vdrv_modbus_master_queue_len[DRV_MODBUS_MASTER_INST_MAX];
+static drv_modbus_master_trans_s *vdrv_modbus_master_trans[DRV_MODBUS_MASTER_INST_MAX];
+static uint8_t vdrv_modbus_master_attempts[DRV_MODBUS_MASTER_INST_MAX];
+static uint16_t vdrv_modbus_master_overrun_ref[DRV_MODBUS_MASTER_INST_MAX];
+static uint16_t vdrv_modbus_master_frame_index[DRV_MODBUS_MASTER_INST_MAX];
+static uint8_t vdrv_modbus_master_frame[DRV_MODBUS_MASTER_INST_MAX][DRV_MODBUS_RTU_MAX_FRAME_LEN_BYTES];
+
+/* Local function declarations */
+
+static bool drv_modbus_master_request_valid(const drv_modbus_master_trans_s *trans);
+static void drv_modbus_master_build_request(drv_modbus_master_inst_e inst);
+static drv_modbus_master_result_e drv_modbus_master_check_response(drv_modbus_master_inst_e inst);
+static void drv_modbus_master_end_attempt(drv_modbus_master_inst_e inst,
+										  drv_modbus_master_result_e result);
+static void drv_modbus_master_turnaround(drv_modbus_master_inst_e inst, uint16_t delay_ms);
+static uint16_t drv_modbus_master_t35_left_ms(drv_modbus_master_inst_e inst);
+static void drv_modbus_master_put_u16(uint8_t *buf, uint16_t val);
+static uint16_t drv_modbus_master_get_u16(const uint8_t *buf);
+
+/* Initialize variables */
+
+void drv_modbus_master_init(void)
+{
+	for(drv_modbus_master_inst_e i = 0; i < DRV_MODBUS_MASTER_INST_MAX; i++)
+	{
+		vdrv_modbus_master_status[i] = STATUS_NOT_STARTED;
+
+		vdrv_modbus_master_state[i] = DRV_MODBUS_MASTER_STATE_IDLE;
+
+		hal_timer_detach(&vdrv_modbus_master_timer[i]);
+
+		vdrv_modbus_master_queue_head[i] = 0;
+
+		vdrv_modbus_master_queue_len[i] = 0;
+
+		vdrv_modbus_master_trans[i] = NULL;
+
+		vdrv_modbus_master_attempts[i] = 0;
+
+		vdrv_modbus_master_frame_index[i] = 0;
+	}
+}
+
+/* Configure */
+
+void drv_modbus_master_start(const drv_modbus_master_config_s config)
+{
+	if((config.inst < DRV_MODBUS_MASTER_INST_MAX)
+		&& (vdrv_modbus_master_status[config.inst] == STATUS_NOT_STARTED))
+	{
+		vdrv_modbus_master_config[config.inst] = config;
+
+		vdrv_modbus_master_status[config.inst] = STATUS_STARTED;
+	}
+}
+
+/* Fxn */
+
+void drv_modbus_master_fxn(void)
+{
+	drv_modbus_master_config_s *config;
+	drv_modbus_master_state_e prev_state;
+	drv_modbus_master_result_e result;
+	uint8_t byte;
+	bool byte_received;
+
+	for(drv_modbus_master_inst_e i = 0; i < DRV_MODBUS_MASTER_INST_MAX; i++)
+	{
+		if(vdrv_modbus_master_status[i] != STATUS_STARTED)
+
+			continue;
+
+		config = &vdrv_modbus_master_config[i];
+
+		prev_state = vdrv_modbus_master_state[i];
+
+		byte_received = false;
+
+		switch(vdrv_modbus_master_state[i])
+		{
+
+		case DRV_MODBUS_MASTER_STATE_IDLE:
+
+			/* A transaction being retried goes before the queued ones */
+			if(vdrv_modbus_master_trans[i] == NULL && vdrv_modbus_master_queue_len[i] > 0)
+			{
+				vdrv_modbus_master_trans[i] = vdrv_modbus_master_queue[i][vdrv_modbus_master_queue_head[i]];
+
+				vdrv_modbus_master_queue_head[i] = (vdrv_modbus_master_queue_head[i] + 1) % DRV_MODBUS_MASTER_QUEUE_LEN;
+
+				vdrv_modbus_master_queue_len[i]--;
+
+				vdrv_modbus_master_attempts[i] = 0;
+			}
+
+			if(vdrv_modbus_master_trans[i] != NULL)
+			{
+				/* Whatever was received while idle isn't a response to this
+				 * request */
+				while(hal_uart_retrieve(config->uart_inst, &byte, 1) == ERROR_NONE);
+
+				drv_modbus_master_build_request(i);
+
+				vdrv_modbus_master_state[i] = DRV_MODBUS_MASTER_STATE_SEND_REQUEST;
+			}
+
+			break;
+
+		case DRV_MODBUS_MASTER_STATE_SEND_REQUEST:
+
+			if(hal_uart_send(config->uart_inst,
+							 vdrv_modbus_master_frame[i],
+							 vdrv_modbus_master_frame_index[i])
+				== ERROR_NONE)
+			{
+				vdrv_modbus_master_attempts[i]++;
+
+				hal_timer_attach(config->timer_inst,
+								 &vdrv_modbus_master_timer[i],
+								 DRV_MODBUS_RTU_TX_COMPLETE_TIMEOUT_MS);
+
+				vdrv_modbus_master_state[i] = DRV_MODBUS_MASTER_STATE_WAIT_TX_COMPLETE;
+			}
+
+			break;
+
+		case DRV_MODBUS_MASTER_STATE_WAIT_TX_COMPLETE:
+
+			if(hal_uart_tx_complete_get(config->uart_inst))
+			{
+				if(vdrv_modbus_master_trans[i]->unit_id == DRV_MODBUS_RTU_BROADCAST_ADDRESS)
+				{
+					/* Nobody answers. Give the slaves time to process it */
+					drv_modbus_master_end_attempt(i, DRV_MODBUS_MASTER_RESULT_OK);
+
+					drv_modbus_master_turnaround(i, config->turnaround_ms);
+				}
+				else
+				{
+					/* The response timeout counts from the end of the
+					 * request */
+					hal_timer_attach(config->timer_inst,
+									 &vdrv_modbus_master_timer[i],
+									 config->response_timeout_ms);
+
+					vdrv_modbus_master_state[i] = DRV_MODBUS_MASTER_STATE_WAIT_RESPONSE;
+				}
+			}
+			else if(hal_timer_status_get(&vdrv_modbus_master_timer[i])
+					!= HAL_TIMER_STATUS_TIMEOUT_NOT_REACHED)
+			{
+				drv_modbus_master_end_attempt(i, DRV_MODBUS_MASTER_RESULT_TIMEOUT);
+
+				drv_modbus_master_turnaround(i, 0);
+			}
+
+			break;
+
+		case DRV_MODBUS_MASTER_STATE_WAIT_RESPONSE:
+
+			if(hal_uart_retrieve(config->uart_inst,
+								 vdrv_modbus_master_frame[i],
+								 1)
+				  == ERROR_NONE)
+			{
+				byte_received = true;
+
+				/* Characters lost from now on corrupt the response */
+				vdrv_modbus_master_overrun_ref[i] = hal_uart_overrun_cnt_get(config->uart_inst);
+
+				vdrv_modbus_master_frame_index[i] = 1;
+
+				hal_timer_attach(config->timer_inst,
+								 &vdrv_modbus_master_timer[i],
+								 DRV_MODBUS_RTU_TIMEOUT_BETWEEN_BYTES_MS);
+
+				vdrv_modbus_master_state[i] = DRV_MODBUS_MASTER_STATE_RECEIVING;
+			}
+			else if(hal_timer_status_get(&vdrv_modbus_master_timer[i])
+					!= HAL_TIMER_STATUS_TIMEOUT_NOT_REACHED)
+			{
+				drv_modbus_master_end_attempt(i, DRV_MODBUS_MASTER_RESULT_TIMEOUT);
+
+				/* The line has been silent for longer than T3.5 */
+				drv_modbus_master_turnaround(i, 0);
+			}
+
+			break;
+
+		case DRV_MODBUS_MASTER_STATE_RECEIVING:
+
+			if(hal_uart_retrieve(config->uart_inst,
+								 &vdrv_modbus_master_frame[i][vdrv_modbus_master_frame_index[i]],
+								 1)
+				  == ERROR_NONE)
+			{
+				byte_received = true;
+
+				if(++vdrv_modbus_master_frame_index[i] >= DRV_MODBUS_RTU_MAX_FRAME_LEN_BYTES)
+
+					vdrv_modbus_master_state[i] = DRV_MODBUS_MASTER_STATE_DISCARD;
+
+				hal_timer_attach(config->timer_inst,
+								 &vdrv_modbus_master_timer[i],
+								 DRV_MODBUS_RTU_TIMEOUT_BETWEEN_BYTES_MS);
+			}
+			else if(hal_timer_status_get(&vdrv_modbus_master_timer[i])
+					!= HAL_TIMER_STATUS_TIMEOUT_NOT_REACHED)
+
+				vdrv_modbus_master_state[i] = DRV_MODBUS_MASTER_STATE_CHECK_RESPONSE;
+
+			break;
+
+		case DRV_MODBUS_MASTER_STATE_DISCARD:
+
+			/* Wait for the end of an oversize frame */
+
+			if(hal_uart_retrieve(config->uart_inst, &byte, 1) == ERROR_NONE)
+			{
+				byte_received = true;
+
+				hal_timer_attach(config->timer_inst,
+								 &vdrv_modbus_master_timer[i],
+								 DRV_MODBUS_RTU_TIMEOUT_BETWEEN_BYTES_MS);
+			}
+			else if(hal_timer_status_get(&vdrv_modbus_master_timer[i])
+					!= HAL_TIMER_STATUS_TIMEOUT_NOT_REACHED)
+			{
+				drv_modbus_master_end_attempt(i, DRV_MODBUS_MASTER_RESULT_BAD_RESPONSE);
+
+				drv_modbus_master_turnaround(i, drv_modbus_master_t35_left_ms(i));
+			}
+
+			break;
+
+		case DRV_MODBUS_MASTER_STATE_CHECK_RESPONSE:
+
+			result = drv_modbus_master_check_response(i);
+
+			drv_modbus_master_end_attempt(i, result);
+
+			/* The next request goes out as soon as T3.5 has elapsed since
+			 * the end of the response */
+			drv_modbus_master_turnaround(i, drv_modbus_master_t35_left_ms(i));
+
+			break;
+
+		case DRV_MODBUS_MASTER_STATE_TURNAROUND:
+
+			if(hal_timer_status_get(&vdrv_modbus_master_timer[i])
+				!= HAL_TIMER_STATUS_TIMEOUT_NOT_REACHED)
+
+				vdrv_modbus_master_state[i] = DRV_MODBUS_MASTER_STATE_IDLE;
+
+			break;
+
+		default:
+
+			vdrv_modbus_master_state[i] = DRV_MODBUS_MASTER_STATE_IDLE;
+
+			break;
+		}
+
+		/* Same as the slave engine: run again right away while there is
+		 * progress */
+		if(byte_received || vdrv_modbus_master_state[i] != prev_state)
+
+			hal_os_task_yield();
+	}
+}
+
+/* Queues a transaction. It is sent as soon as the bus is free, in order. An
+ * instance that was not started would never send it, so it is refused */
+error_e drv_modbus_master_submit(drv_modbus_master_inst_e inst,
+								 drv_modbus_master_trans_s *trans)
+{
+	if(inst >= DRV_MODBUS_MASTER_INST_MAX || trans == NULL
+		|| !drv_modbus_master_request_valid(trans))
+
+		return ERROR_MODBUS_MASTER_BAD_REQUEST;
+
+	if(vdrv_modbus_master_status[inst] != STATUS_STARTED)
+
+		return ERROR_MODBUS_MASTER_NOT_STARTED;
+
+	if(vdrv_modbus_master_queue_len[inst] >= DRV_MODBUS_MASTER_QUEUE_LEN)
+
+		return ERROR_MODBUS_MASTER_QUEUE_FULL;
+
+	vdrv_modbus_master_queue[inst][(vdrv_modbus_master_queue_head[inst] + vdrv_modbus_master_queue_len[inst])
+								   % DRV_MODBUS_MASTER_QUEUE_LEN] = trans;
+
+	vdrv_modbus_master_queue_len[inst]++;
+
+	return ERROR_NONE;
+}
+
+static bool drv_modbus_master_request_valid(const drv_modbus_master_trans_s *trans)
+{
+	bool reads = false;
+	bool writes = false;
+
+	switch(trans->fc)
+	{
+	case DRV_MODBUS_MASTER_FC_READ_HOLDING_REGS:
+	case DRV_MODBUS_MASTER_FC_READ_INPUT_REGS:
+
+		reads = true;
+
+		if(trans->n_read == 0 || trans->n_read > DRV_MODBUS_MASTER_MAX_READ_REGS)
+
+			return false;
+
+		break;
+
+	case DRV_MODBUS_MASTER_FC_WRITE_SINGLE_REG:
+
+		writes = true;
+
+		break;
+
+	case DRV_MODBUS_MASTER_FC_WRITE_MULTIPLE_REGS:
+
+		writes = true;
+
+		if(trans->n_write == 0 || trans->n_write > DRV_MODBUS_MASTER_MAX_WRITE_REGS)
+
+			return false;
+
+		break;
+
+	case DRV_MODBUS_MASTER_FC_READ_WRITE_MULTIPLE_REGS:
+
+		reads = true;
+
+		writes = true;
+
+		if(trans->n_read == 0 || trans->n_read > DRV_MODBUS_MASTER_MAX_READ_REGS
+			|| trans->n_write == 0 || trans->n_write > DRV_MODBUS_MASTER_MAX_READ_WRITE_REGS)
+
+			return false;
+
+		break;
+
+	default:
+
+		return false;
+	}
+
+	/* Nothing would be read back from a broadcast request */
+	if(reads && (trans->read_vals == NULL || trans->unit_id == DRV_MODBUS_RTU_BROADCAST_ADDRESS))
+
+		return false;
+
+	if(writes && trans->write_vals == NULL)
+
+		return false;
+
+	return true;
+}
+
+/* Builds the request of the current transaction, CRC included */
+static void drv_modbus_master_build_request(drv_modbus_master_inst_e inst)
+{
+	const drv_modbus_master_trans_s *trans = vdrv_modbus_master_trans[inst];
+	uint8_t *frame = vdrv_modbus_master_frame[inst];
+	uint16_t len;
+	uint16_t n_write = 0;
+	uint8_t crc[2];
+
+	frame[0] = trans->unit_id;
+
+	frame[1] = trans->fc;
+
+	switch(trans->fc)
+	{
+	case DRV_MODBUS_MASTER_FC_READ_HOLDING_REGS:
+	case DRV_MODBUS_MASTER_FC_READ_INPUT_REGS:
+
+		drv_modbus_master_put_u16(&frame[2], trans->read_addr);
+
+		drv_modbus_master_put_u16(&frame[4], trans->n_read);
+
+		len = 6;
+
+		break;
+
+	case DRV_MODBUS_MASTER_FC_WRITE_SINGLE_REG:
+
+		drv_modbus_master_put_u16(&frame[2], trans->write_addr);
+
+		drv_modbus_master_put_u16(&frame[4], trans->write_vals[0]);
+
+		len = 6;
+
+		break;
+
+	case DRV_MODBUS_MASTER_FC_WRITE_MULTIPLE_REGS:
+
+		drv_modbus_master_put_u16(&frame[2], trans->write_addr);
+
+		drv_modbus_master_put_u16(&frame[4], trans->n_write);
+
+		frame[6] = (uint8_t)(trans->n_write * 2);
+
+		len = 7;
+
+		n_write = trans->n_write;
+
+		break;
+
+	default:
+
+		/* DRV_MODBUS_MASTER_FC_READ_WRITE_MULTIPLE_REGS */
+		drv_modbus_master_put_u16(&frame[2], trans->read_addr);
+
+		drv_modbus_master_put_u16(&frame[4], trans->n_read);
+
+		drv_modbus_master_put_u16(&frame[6], trans->write_addr);
+
+		drv_modbus_master_put_u16(&frame[8], trans->n_write);
+
+		frame[10] = (uint8_t)(trans->n_write * 2);
+
+		len = 11;
+
+		n_write = trans->n_write;
+
+		break;
+	}
+
+	for(uint16_t j = 0; j < n_write; j++, len += 2)
+
+		drv_modbus_master_put_u16(&frame[len], trans->write_vals[j]);
+
+	drv_modbus_rtu_crc_calc(frame, len, crc);
+
+	frame[len++] = crc[0];
+
+	frame[len++] = crc[1];
+
+	vdrv_modbus_master_frame_index[inst] = len;
+}
+
+/* Validates the received response against the current request. Read values
+ * are copied to the transaction */
+static drv_modbus_master_result_e drv_modbus_master_check_response(drv_modbus_master_inst_e inst)
+{
+	drv_modbus_master_trans_s *trans = vdrv_modbus_master_trans[inst];
+	const uint8_t *frame = vdrv_modbus_master_frame[inst];
+	uint16_t len = vdrv_modbus_master_frame_index[inst];
+
+	if(!drv_modbus_rtu_crc_check(frame, len)
+		|| hal_uart_overrun_cnt_get(vdrv_modbus_master_config[inst].uart_inst) != vdrv_modbus_master_overrun_ref[inst]
+		|| frame[0] != trans->unit_id)
+
+		return DRV_MODBUS_MASTER_RESULT_BAD_RESPONSE;
+
+	if(frame[1] == (trans->fc | 0x80) && len == DRV_MODBUS_MASTER_EXCEPTION_LEN_BYTES)
+	{
+		trans->exception_code = frame[2];
+
+		return DRV_MODBUS_MASTER_RESULT_EXCEPTION;
+	}
+
+	if(frame[1] != trans->fc)
+
+		return DRV_MODBUS_MASTER_RESULT_BAD_RESPONSE;
+
+	switch(trans->fc)
+	{
+	case DRV_MODBUS_MASTER_FC_WRITE_SINGLE_REG:
+
+		/* Echo of the request */
+		if(len != 8
+			|| drv_modbus_master_get_u16(&frame[2]) != trans->write_addr
+			|| drv_modbus_master_get_u16(&frame[4]) != trans->write_vals[0])
+
+			return DRV_MODBUS_MASTER_RESULT_BAD_RESPONSE;
+
+		break;
+
+	case DRV_MODBUS_MASTER_FC_WRITE_MULTIPLE_REGS:
+
+		if(len != 8
+			|| drv_modbus_master_get_u16(&frame[2]) != trans->write_addr
+			|| drv_modbus_master_get_u16(&frame[4]) != trans->n_write)
+
+			return DRV_MODBUS_MASTER_RESULT_BAD_RESPONSE;
+
+		break;
+
+	default:
+
+		/* Reads: byte count and register values */
+		if(len != 5 + trans->n_read * 2 || frame[2] != trans->n_read * 2)
+
+			return DRV_MODBUS_MASTER_RESULT_BAD_RESPONSE;
+
+		for(uint16_t j = 0; j < trans->n_read; j++)
+
+			trans->read_vals[j] = drv_modbus_master_get_u16(&frame[3 + j * 2]);
+
+		break;
+	}
+
+	return DRV_MODBUS_MASTER_RESULT_OK;
+}
+
+/* Finishes the transaction, unless the request can be tried again */
+static void drv_modbus_master_end_attempt(drv_modbus_master_inst_e inst,
+										  drv_modbus_master_result_e result)
+{
+	drv_modbus_master_trans_s *trans = vdrv_modbus_master_trans[inst];
+
+	if((result == DRV_MODBUS_MASTER_RESULT_TIMEOUT || result == DRV_MODBUS_MASTER_RESULT_BAD_RESPONSE)
+		&& vdrv_modbus_master_attempts[inst] <= vdrv_modbus_master_config[inst].n_retries)
+
+		return;
+
+	vdrv_modbus_master_trans[inst] = NULL;
+
+	if(trans->cb != NULL)
+
+		trans->cb(trans, result);
+}
+
+/* Waits delay_ms before the bus can be used again */
+static void drv_modbus_master_turnaround(drv_modbus_master_inst_e inst, uint16_t delay_ms)
+{
+	if(delay_ms == 0)
+	{
+		vdrv_modbus_master_state[inst] = DRV_MODBUS_MASTER_STATE_IDLE;
+
+		return;
+	}
+
+	hal_timer_attach(vdrv_modbus_master_config[inst].timer_inst,
+					 &vdrv_modbus_master_timer[inst],
+					 delay_ms);
+
+	vdrv_modbus_master_state[inst] = DRV_MODBUS_MASTER_STATE_TURNAROUND;
+}
+
+/* Part of T3.5 has already been waited for to find the end of the last
+ * frame. Returns what is left of it */
+static uint16_t drv_modbus_master_t35_left_ms(drv_modbus_master_inst_e inst)
+{
+	uint16_t t35 = drv_modbus_rtu_t35_ms(hal_uart_baudrate_get(vdrv_modbus_master_config[inst].uart_inst));
+
+	if(t35 <= DRV_MODBUS_RTU_TIMEOUT_BETWEEN_BYTES_MS)
+
+		return 0;
+
+	return t35 - DRV_MODBUS_RTU_TIMEOUT_BETWEEN_BYTES_MS;
+}
+
+static void drv_modbus_master_put_u16(uint8_t *buf, uint16_t val)
+{
+	buf[0] = (uint8_t)(val >> 8);
+
+	buf[1] = (uint8_t)(val & 0xFF);
+}
+
+static uint16_t drv_modbus_master_get_u16(const uint8_t *buf)
+{
+	return ((uint16_t)buf[0] << 8) | buf[1];
+}
@@ -0,0 +1,83 @@
+/*
+ * drv_modbus_master.h
+ *
+ *  Created on: Oct 19, 2026
+ *      Author: ricard
+ */
+
+#ifndef DRV_DRV_MODBUS_DRV_MODBUS_MASTER_H_
+#define DRV_DRV_MODBUS_DRV_MODBUS_MASTER_H_
+
+#include <stdint.h>
+#include "hal_uart/hal_uart.h"
+#include "hal_timer/hal_timer.h"
+#include "error.h"
+
+/* Transactions waiting to be sent, per instance */
+#define DRV_MODBUS_MASTER_QUEUE_LEN		8
+
+typedef enum
+{
+	DRV_MODBUS_MASTER_INST_0,
+	DRV_MODBUS_MASTER_INST_MAX
+} drv_modbus_master_inst_e;
+
+typedef enum
+{
+	DRV_MODBUS_MASTER_RESULT_OK,
+	DRV_MODBUS_MASTER_RESULT_EXCEPTION,		/* exception_code is valid */
+	DRV_MODBUS_MASTER_RESULT_TIMEOUT,
+	DRV_MODBUS_MASTER_RESULT_BAD_RESPONSE,
+	DRV_MODBUS_MASTER_RESULT_MAX
+} drv_modbus_master_result_e;
+
+typedef struct drv_modbus_master_trans drv_modbus_master_trans_s;
+
+/* Called from the master task once the transaction is over. Broadcast
+ * requests complete with DRV_MODBUS_MASTER_RESULT_OK after the turnaround
+ * delay. Another transaction may be submitted from here */
+typedef void (*drv_modbus_master_cb)(drv_modbus_master_trans_s *trans,
+									 drv_modbus_master_result_e result);
+
+/* Which fields are used depends on the function code:
+ * 0x03, 0x04: read_addr, n_read, read_vals
+ * 0x06: write_addr, write_vals[0]
+ * 0x10: write_addr, n_write, write_vals
+ * 0x17: all of them. The write is done before the read
+ * The transaction is not copied, so it must be kept until the callback is
+ * called */
+struct drv_modbus_master_trans
+{
+	uint8_t unit_id;
+	uint8_t fc;
+	uint16_t read_addr;
+	uint16_t n_read;
+	uint16_t *read_vals;
+	uint16_t write_addr;
+	uint16_t n_write;
+	const uint16_t *write_vals;
+	uint8_t exception_code;
+	drv_modbus_master_cb cb;
+	void *ctx;
+};
+
+/* A request is sent again up to n_retries times if no valid response
+ * arrives. Exception responses are final. turnaround_ms is the delay after a
+ * broadcast request, for the slaves to process it */
+typedef struct
+{
+	drv_modbus_master_inst_e inst;
+	hal_uart_uart_num_e uart_inst;
+	hal_timer_timer_inst_e timer_inst;
+	uint16_t response_timeout_ms;
+	uint16_t turnaround_ms;
+	uint8_t n_retries;
+} drv_modbus_master_config_s;
+
+void drv_modbus_master_init(void);
+void drv_modbus_master_start(const drv_modbus_master_config_s config);
+void drv_modbus_master_fxn(void);
+error_e drv_modbus_master_submit(drv_modbus_master_inst_e inst,
+								 drv_modbus_master_trans_s *trans);
+
+#endif /* DRV_DRV_MODBUS_DRV_MODBUS_MASTER_H_ */
@@ -6,24 +6,174 @@
  */
 
 
+#include <stdlib.h>
 #include "drv_modbus_registers.h"
+#include "drv_modbus.h"
+#include "drv_modbus_fifo.h"
 
-const uint16_t vdrv_modbus_0_input_regs_addr[DRV_MODBUS_0_INPUT_REG_MAX] =
+/* The main input and holding values live here until their ranges are bound */
+uint16_t vdrv_modbus_0_input_regs_val[DRV_MODBUS_0_INPUT_REG_MAX];
+uint16_t vdrv_modbus_0_holding_regs_val[DRV_MODBUS_0_HOLDING_REG_MAX];
+uint16_t vdrv_modbus_0_os_prof_regs_val[DRV_MODBUS_0_OS_PROF_REG_MAX];
+uint16_t vdrv_modbus_0_latency_regs_val[DRV_MODBUS_LATENCY_REG_MAX];
+uint16_t vdrv_modbus_0_gw_input_regs_val[DRV_MODBUS_0_GW_INPUT_REG_MAX];
+uint16_t vdrv_modbus_0_gw_holding_regs_val[DRV_MODBUS_0_GW_HOLDING_REG_MAX];
+uint16_t vdrv_modbus_0_gw_status_regs_val[DRV_MODBUS_0_GW_STATUS_REG_MAX];
+
+/* Snapshots of the input ranges that can be frozen */
+static uint16_t vdrv_modbus_0_input_frozen[DRV_MODBUS_0_INPUT_REG_MAX];
+static uint16_t vdrv_modbus_0_gw_input_frozen[DRV_MODBUS_0_GW_INPUT_REG_MAX];
+static uint16_t vdrv_modbus_0_gw_status_frozen[DRV_MODBUS_0_GW_STATUS_REG_MAX];
+
+/* Report by exception state */
+static uint16_t vdrv_modbus_0_rbe_input_reported[DRV_MODBUS_0_INPUT_REG_MAX];
+static uint32_t vdrv_modbus_0_rbe_input_version[DRV_MODBUS_0_INPUT_REG_MAX];
+static uint16_t vdrv_modbus_0_rbe_gw_input_reported[DRV_MODBUS_0_GW_INPUT_REG_MAX];
+static uint32_t vdrv_modbus_0_rbe_gw_input_version[DRV_MODBUS_0_GW_INPUT_REG_MAX];
+static uint16_t vdrv_modbus_0_rbe_gw_holding_reported[DRV_MODBUS_0_GW_HOLDING_REG_MAX];
+static uint32_t vdrv_modbus_0_rbe_gw_holding_version[DRV_MODBUS_0_GW_HOLDING_REG_MAX];
+
+static volatile uint32_t *drv_modbus_range_seq(drv_modbus_inst inst,
+											   uint8_t bank,
+											   drv_modbus_register_type_s type,
+											   uint8_t range);
+static bool drv_modbus_0_led_validate(drv_modbus_inst inst, uint16_t addr, uint16_t val);
+static void drv_modbus_0_latency_reset_written(drv_modbus_inst inst, uint16_t addr, uint16_t val);
+static void drv_modbus_0_freeze_written(drv_modbus_inst inst, uint16_t addr, uint16_t val);
+static void drv_modbus_0_fifo_ack_written(drv_modbus_inst inst, uint16_t addr, uint16_t val);
+
+/* Update counters of the ranges with multi-word values, or whose registers
+ * are updated together */
+static volatile uint32_t vdrv_modbus_0_input_seq;
+static volatile uint32_t vdrv_modbus_0_holding_seq;
+
+/* Write hooks */
+
+static const drv_modbus_write_hooks_s cdrv_modbus_0_led_hooks =
 {
-		0x0000	// DRV_MODBUS_0_INPUT_REG_PUSH_BUTTON
+		.validate = drv_modbus_0_led_validate,
+		.written = NULL
 };
 
-const uint16_t vdrv_modbus_0_holding_regs_addr[DRV_MODBUS_0_HOLDING_REG_MAX] =
+static const drv_modbus_write_hooks_s cdrv_modbus_0_latency_reset_hooks =
 {
-		0x0000,	// DRV_MODBUS_0_HOLDING_REG_CLK_FREQ_HIGH
-		0x0001,	// DRV_MODBUS_0_HOLDING_REG_CLK_FREQ_LOW
-		0x0002,	// DRV_MODBUS_0_HOLDING_REG_BAUDRATE_HIGH
-		0x0003,	// DRV_MODBUS_0_HOLDING_REG_BAUDRATE_LOW
-		0x0004	// DRV_MODBUS_0_HOLDING_REG_LED
+		.validate = NULL,
+		.written = drv_modbus_0_latency_reset_written
 };
 
-uint16_t vdrv_modbus_0_input_regs_val[DRV_MODBUS_0_INPUT_REG_MAX];
-uint16_t vdrv_modbus_0_holding_regs_val[DRV_MODBUS_0_HOLDING_REG_MAX];
+static const drv_modbus_write_hooks_s cdrv_modbus_0_freeze_hooks =
+{
+		.validate = NULL,
+		.written = drv_modbus_0_freeze_written
+};
+
+static const drv_modbus_write_hooks_s cdrv_modbus_0_fifo_ack_hooks =
+{
+		.validate = NULL,
+		.written = drv_modbus_0_fifo_ack_written
+};
+
+static const drv_modbus_write_hooks_s *const cdrv_modbus_0_holding_hooks[DRV_MODBUS_0_HOLDING_REG_MAX] =
+{
+		[DRV_MODBUS_0_HOLDING_REG_LED] = &cdrv_modbus_0_led_hooks,
+		[DRV_MODBUS_0_HOLDING_REG_LATENCY_RESET] = &cdrv_modbus_0_latency_reset_hooks,
+		[DRV_MODBUS_0_HOLDING_REG_FREEZE] = &cdrv_modbus_0_freeze_hooks,
+		[DRV_MODBUS_0_HOLDING_REG_FIFO_ACK] = &cdrv_modbus_0_fifo_ack_hooks
+};
+
+static const drv_modbus_write_hooks_s *const cdrv_modbus_0_legacy_io_holding_hooks[1] =
+{
+		&cdrv_modbus_0_led_hooks
+};
+
+/* The ranges of the main and legacy I/O banks can be bound to storage of the
+ * application, so they are not constant */
+static drv_modbus_range_s vdrv_modbus_0_input_ranges[DRV_MODBUS_0_INPUT_RANGE_MAX] =
+{
+		{	.start_addr = 0x0000,							.n_regs = DRV_MODBUS_0_INPUT_REG_MAX,		.val = vdrv_modbus_0_input_regs_val,	.seq = &vdrv_modbus_0_input_seq,	.frozen = vdrv_modbus_0_input_frozen	},	// DRV_MODBUS_0_INPUT_RANGE_MAIN
+		{	.start_addr = DRV_MODBUS_0_OS_PROF_START_ADDR,	.n_regs = DRV_MODBUS_0_OS_PROF_REG_MAX,		.val = vdrv_modbus_0_os_prof_regs_val	},	// DRV_MODBUS_0_INPUT_RANGE_OS_PROF
+		{	.start_addr = DRV_MODBUS_0_LATENCY_START_ADDR,	.n_regs = DRV_MODBUS_LATENCY_REG_MAX,		.val = vdrv_modbus_0_latency_regs_val	}	// DRV_MODBUS_0_INPUT_RANGE_LATENCY
+};
+
+static drv_modbus_range_s vdrv_modbus_0_holding_ranges[DRV_MODBUS_0_HOLDING_RANGE_MAX] =
+{
+		{	.start_addr = 0x0000,							.n_regs = DRV_MODBUS_0_HOLDING_REG_MAX,		.val = vdrv_modbus_0_holding_regs_val,	.hooks = cdrv_modbus_0_holding_hooks,	.seq = &vdrv_modbus_0_holding_seq	}	// DRV_MODBUS_0_HOLDING_RANGE_MAIN
+};
+
+static drv_modbus_range_s vdrv_modbus_0_legacy_io_input_ranges[DRV_MODBUS_0_LEGACY_IO_INPUT_RANGE_MAX] =
+{
+		{	.start_addr = 0x0000,	.n_regs = 1,	.val = &vdrv_modbus_0_input_regs_val[DRV_MODBUS_0_INPUT_REG_PUSH_BUTTON]	}	// DRV_MODBUS_0_LEGACY_IO_INPUT_RANGE_MAIN
+};
+
+static drv_modbus_range_s vdrv_modbus_0_legacy_io_holding_ranges[DRV_MODBUS_0_LEGACY_IO_HOLDING_RANGE_MAX] =
+{
+		{	.start_addr = 0x0000,	.n_regs = 1,	.val = &vdrv_modbus_0_holding_regs_val[DRV_MODBUS_0_HOLDING_REG_LED],	.hooks = cdrv_modbus_0_legacy_io_holding_hooks	}	// DRV_MODBUS_0_LEGACY_IO_HOLDING_RANGE_MAIN
+};
+
+static const drv_modbus_range_s cdrv_modbus_0_gateway_input_ranges[DRV_MODBUS_0_GATEWAY_INPUT_RANGE_MAX] =
+{
+		{	.start_addr = 0x0000,								.n_regs = DRV_MODBUS_0_GW_INPUT_REG_MAX,	.val = vdrv_modbus_0_gw_input_regs_val,	.frozen = vdrv_modbus_0_gw_input_frozen	},	// DRV_MODBUS_0_GATEWAY_INPUT_RANGE_CACHE
+		{	.start_addr = DRV_MODBUS_0_GW_STATUS_START_ADDR,	.n_regs = DRV_MODBUS_0_GW_STATUS_REG_MAX,	.val = vdrv_modbus_0_gw_status_regs_val,	.frozen = vdrv_modbus_0_gw_status_frozen	}	// DRV_MODBUS_0_GATEWAY_INPUT_RANGE_STATUS
+};
+
+static const drv_modbus_range_s cdrv_modbus_0_gateway_holding_ranges[DRV_MODBUS_0_GATEWAY_HOLDING_RANGE_MAX] =
+{
+		{	.start_addr = 0x0000,								.n_regs = DRV_MODBUS_0_GW_HOLDING_REG_MAX,	.val = vdrv_modbus_0_gw_holding_regs_val	}	// DRV_MODBUS_0_GATEWAY_HOLDING_RANGE_CACHE
+};
+
+static const drv_modbus_rbe_block_s cdrv_modbus_0_main_rbe_blocks[DRV_MODBUS_0_RBE_BLOCK_MAIN_MAX] =
+{
+		{	.type = DRV_MODBUS_REGISTER_TYPE_INPUT,		.start_addr = 0x0000,	.n_regs = DRV_MODBUS_0_INPUT_REG_MAX,		.deadband = 0,	.reported = vdrv_modbus_0_rbe_input_reported,		.version = vdrv_modbus_0_rbe_input_version			}	// DRV_MODBUS_0_RBE_BLOCK_MAIN_INPUT
+};
+
+static const drv_modbus_rbe_block_s cdrv_modbus_0_gateway_rbe_blocks[DRV_MODBUS_0_RBE_BLOCK_GATEWAY_MAX] =
+{
+		{	.type = DRV_MODBUS_REGISTER_TYPE_INPUT,		.start_addr = 0x0000,	.n_regs = DRV_MODBUS_0_GW_INPUT_REG_MAX,	.deadband = 0,	.reported = vdrv_modbus_0_rbe_gw_input_reported,	.version = vdrv_modbus_0_rbe_gw_input_version		},	// DRV_MODBUS_0_RBE_BLOCK_GATEWAY_INPUT
+		{	.type = DRV_MODBUS_REGISTER_TYPE_HOLDING,	.start_addr = 0x0000,	.n_regs = DRV_MODBUS_0_GW_HOLDING_REG_MAX,	.deadband = 0,	.reported = vdrv_modbus_0_rbe_gw_holding_reported,	.version = vdrv_modbus_0_rbe_gw_holding_version		}	// DRV_MODBUS_0_RBE_BLOCK_GATEWAY_HOLDING
+};
+
+const drv_modbus_bank_s cdrv_modbus_0_banks[DRV_MODBUS_0_BANK_MAX] =
+{
+		{
+				.holding_ranges = vdrv_modbus_0_holding_ranges,
+				.input_ranges = vdrv_modbus_0_input_ranges,
+				.rbe_blocks = cdrv_modbus_0_main_rbe_blocks,
+				.n_holding_ranges = DRV_MODBUS_0_HOLDING_RANGE_MAX,
+				.n_input_ranges = DRV_MODBUS_0_INPUT_RANGE_MAX,
+				.n_rbe_blocks = DRV_MODBUS_0_RBE_BLOCK_MAIN_MAX
+		},	// DRV_MODBUS_0_BANK_MAIN
+		{
+				.holding_ranges = vdrv_modbus_0_legacy_io_holding_ranges,
+				.input_ranges = vdrv_modbus_0_legacy_io_input_ranges,
+				.rbe_blocks = NULL,
+				.n_holding_ranges = DRV_MODBUS_0_LEGACY_IO_HOLDING_RANGE_MAX,
+				.n_input_ranges = DRV_MODBUS_0_LEGACY_IO_INPUT_RANGE_MAX,
+				.n_rbe_blocks = 0
+		},	// DRV_MODBUS_0_BANK_LEGACY_IO
+		{
+				.holding_ranges = cdrv_modbus_0_gateway_holding_ranges,
+				.input_ranges = cdrv_modbus_0_gateway_input_ranges,
+				.rbe_blocks = cdrv_modbus_0_gateway_rbe_blocks,
+				.n_holding_ranges = DRV_MODBUS_0_GATEWAY_HOLDING_RANGE_MAX,
+				.n_input_ranges = DRV_MODBUS_0_GATEWAY_INPUT_RANGE_MAX,
+				.n_rbe_blocks = DRV_MODBUS_0_RBE_BLOCK_GATEWAY_MAX
+		}	// DRV_MODBUS_0_BANK_GATEWAY
+};
+
+/* Ranges that can be bound, per bank and register type */
+static drv_modbus_range_s *const cdrv_modbus_0_bindable_ranges[DRV_MODBUS_0_BANK_MAX][2] =
+{
+		[DRV_MODBUS_0_BANK_MAIN] =
+		{
+				[DRV_MODBUS_REGISTER_TYPE_INPUT] = vdrv_modbus_0_input_ranges,
+				[DRV_MODBUS_REGISTER_TYPE_HOLDING] = vdrv_modbus_0_holding_ranges
+		},
+		[DRV_MODBUS_0_BANK_LEGACY_IO] =
+		{
+				[DRV_MODBUS_REGISTER_TYPE_INPUT] = vdrv_modbus_0_legacy_io_input_ranges,
+				[DRV_MODBUS_REGISTER_TYPE_HOLDING] = vdrv_modbus_0_legacy_io_holding_ranges
+		}
+};
 
 error_e drv_modbus_read_register(drv_modbus_inst inst,
 								 drv_modbus_register_type_s type,
@@ -36,16 +186,17 @@ error_e drv_modbus_read_register(drv_modbus_inst inst,
 
 	if(inst == DRV_MODBUS_INST_0)
 	{
+		/* Through the ranges, which may be bound elsewhere */
 		if(type == DRV_MODBUS_REGISTER_TYPE_INPUT
 			&& reg < DRV_MODBUS_0_INPUT_REG_MAX)
 		{
-			*val = vdrv_modbus_0_input_regs_val[reg];
+			*val = vdrv_modbus_0_input_ranges[DRV_MODBUS_0_INPUT_RANGE_MAIN].val[reg];
 			ret = ERROR_NONE;
 		}
 		else if(type == DRV_MODBUS_REGISTER_TYPE_HOLDING
 				&& reg < DRV_MODBUS_0_HOLDING_REG_MAX)
 		{
-			*val = vdrv_modbus_0_holding_regs_val[reg];
+			*val = vdrv_modbus_0_holding_ranges[DRV_MODBUS_0_HOLDING_RANGE_MAIN].val[reg];
 			ret = ERROR_NONE;
 		}
 	}
@@ -67,16 +218,154 @@ error_e drv_modbus_write_register(drv_modbus_inst inst,
 		if(type == DRV_MODBUS_REGISTER_TYPE_INPUT
 			&& reg < DRV_MODBUS_0_INPUT_REG_MAX)
 		{
-			vdrv_modbus_0_input_regs_val[reg] = val;
+			vdrv_modbus_0_input_ranges[DRV_MODBUS_0_INPUT_RANGE_MAIN].val[reg] = val;
 			ret = ERROR_NONE;
 		}
 		else if(type == DRV_MODBUS_REGISTER_TYPE_HOLDING
 				&& reg < DRV_MODBUS_0_HOLDING_REG_MAX)
 		{
-			vdrv_modbus_0_holding_regs_val[reg] = val;
+			vdrv_modbus_0_holding_ranges[DRV_MODBUS_0_HOLDING_RANGE_MAIN].val[reg] = val;
 			ret = ERROR_NONE;
 		}
 	}
 
 	return ret;
 }
+
+/* Updates of several registers of a range, e.g. the two halves of a 32-bit
+ * value, are made between update_begin and update_end, which may be called
+ * from an interrupt. Responses never mix values from before and after an
+ * update: a response whose registers were updated while it was being built
+ * copies them again. Neither side waits for the other */
+void drv_modbus_range_update_begin(drv_modbus_inst inst,
+								   uint8_t bank,
+								   drv_modbus_register_type_s type,
+								   uint8_t range)
+{
+	volatile uint32_t *seq = drv_modbus_range_seq(inst, bank, type, range);
+
+	if(seq == NULL)
+
+		return;
+
+	/* Odd while the update is in progress */
+	*seq = *seq + 1;
+
+	DRV_MODBUS_BARRIER();
+}
+
+void drv_modbus_range_update_end(drv_modbus_inst inst,
+								 uint8_t bank,
+								 drv_modbus_register_type_s type,
+								 uint8_t range)
+{
+	volatile uint32_t *seq = drv_modbus_range_seq(inst, bank, type, range);
+
+	if(seq == NULL)
+
+		return;
+
+	DRV_MODBUS_BARRIER();
+
+	*seq = *seq + 1;
+}
+
+/* Serves a range straight from storage owned by the caller, e.g. a struct of
+ * the application laid out as the range, so that the live data is read and
+ * written in place. n_regs must be the size of the range. Only the ranges of
+ * the main and legacy I/O banks can be bound, and only from a start
+ * function, before any request is served */
+error_e drv_modbus_range_bind(drv_modbus_inst inst,
+							  uint8_t bank,
+							  drv_modbus_register_type_s type,
+							  uint8_t range,
+							  uint16_t *storage,
+							  uint16_t n_regs)
+{
+	drv_modbus_range_s *ranges;
+	uint8_t n_ranges;
+
+	if(inst != DRV_MODBUS_INST_0
+		|| bank >= DRV_MODBUS_0_BANK_MAX
+		|| type > DRV_MODBUS_REGISTER_TYPE_HOLDING
+		|| storage == NULL)
+
+		return ERROR_MODBUS_INEXISTENT_REGISTER;
+
+	ranges = cdrv_modbus_0_bindable_ranges[bank][type];
+
+	n_ranges = type == DRV_MODBUS_REGISTER_TYPE_HOLDING ?
+			cdrv_modbus_0_banks[bank].n_holding_ranges : cdrv_modbus_0_banks[bank].n_input_ranges;
+
+	if(ranges == NULL || range >= n_ranges || ranges[range].n_regs != n_regs)
+
+		return ERROR_MODBUS_INEXISTENT_REGISTER;
+
+	ranges[range].val = storage;
+
+	return ERROR_NONE;
+}
+
+static volatile uint32_t *drv_modbus_range_seq(drv_modbus_inst inst,
+											   uint8_t bank,
+											   drv_modbus_register_type_s type,
+											   uint8_t range)
+{
+	const drv_modbus_bank_s *b;
+
+	if(inst != DRV_MODBUS_INST_0 || bank >= DRV_MODBUS_0_BANK_MAX)
+
+		return NULL;
+
+	b = &cdrv_modbus_0_banks[bank];
+
+	if(type == DRV_MODBUS_REGISTER_TYPE_HOLDING && range < b->n_holding_ranges)
+
+		return b->holding_ranges[range].seq;
+
+	if(type == DRV_MODBUS_REGISTER_TYPE_INPUT && range < b->n_input_ranges)
+
+		return b->input_ranges[range].seq;
+
+	return NULL;
+}
+
+static bool drv_modbus_0_led_validate(drv_modbus_inst inst, uint16_t addr, uint16_t val)
+{
+	(void)inst;
+	(void)addr;
+
+	return val == DRV_MODBUS_0_LED_OFF || val == DRV_MODBUS_0_LED_ON || val == DRV_MODBUS_0_LED_BLINK;
+}
+
+/* Any value other than 0 clears the latency histograms. The register reads
+ * back as 0 */
+static void drv_modbus_0_latency_reset_written(drv_modbus_inst inst, uint16_t addr, uint16_t val)
+{
+	if(val == 0)
+
+		return;
+
+	drv_modbus_latency_reset(inst);
+
+	(void)drv_modbus_write_register(inst, DRV_MODBUS_REGISTER_TYPE_HOLDING, addr, 0);
+}
+
+static void drv_modbus_0_freeze_written(drv_modbus_inst inst, uint16_t addr, uint16_t val)
+{
+	(void)addr;
+
+	drv_modbus_freeze(inst, val != 0);
+}
+
+/* Removes the acknowledged samples of the FIFO. The register reads back as 0 */
+static void drv_modbus_0_fifo_ack_written(drv_modbus_inst inst, uint16_t addr, uint16_t val)
+{
+	if(val == 0)
+
+		return;
+
+	drv_modbus_fifo_ack(inst, addr, val);
+
+	(void)drv_modbus_write_register(inst, DRV_MODBUS_REGISTER_TYPE_HOLDING, addr, 0);
+}
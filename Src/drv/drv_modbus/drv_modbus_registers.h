@@ -9,39 +9,310 @@
 #define DRV_DRV_MODBUS_DRV_MODBUS_REGISTERS_H_
 
 #include <stdint.h>
+#include <stdbool.h>
 #include "drv_modbus_common.h"
 #include "error.h"
 
+/* Version of the register map, reported as extended device identification
+ * object 0x80. To be increased on every change of the map */
+#define DRV_MODBUS_0_REGISTER_MAP_VERSION	"2.6"
+
 /* Types */
 
+/* Input registers starting at address 0x0000 */
 enum
 {
-	DRV_MODBUS_0_INPUT_REG_PUSH_BUTTON,
+	DRV_MODBUS_0_INPUT_REG_PUSH_BUTTON,		// 0x0000
 	DRV_MODBUS_0_INPUT_REG_MAX
 };
 
+/* Holding registers starting at address 0x0000 */
 enum
 {
-	DRV_MODBUS_0_HOLDING_REG_CLK_FREQ_HIGH,
-	DRV_MODBUS_0_HOLDING_REG_CLK_FREQ_LOW,
-	DRV_MODBUS_0_HOLDING_REG_BAUDRATE_HIGH,
-	DRV_MODBUS_0_HOLDING_REG_BAUDRATE_LOW,
-	DRV_MODBUS_0_HOLDING_REG_LED,
+	DRV_MODBUS_0_HOLDING_REG_CLK_FREQ_HIGH,	// 0x0000
+	DRV_MODBUS_0_HOLDING_REG_CLK_FREQ_LOW,	// 0x0001
+	DRV_MODBUS_0_HOLDING_REG_BAUDRATE_HIGH,	// 0x0002
+	DRV_MODBUS_0_HOLDING_REG_BAUDRATE_LOW,	// 0x0003
+	DRV_MODBUS_0_HOLDING_REG_LED,			// 0x0004
+	DRV_MODBUS_0_HOLDING_REG_LATENCY_RESET,	// 0x0005
+	DRV_MODBUS_0_HOLDING_REG_FREEZE,		// 0x0006
+	DRV_MODBUS_0_HOLDING_REG_FIFO_ACK,		// 0x0007
 	DRV_MODBUS_0_HOLDING_REG_MAX
 };
 
+/* The same registers, laid out as the application structs that can be bound
+ * as their storage with drv_modbus_range_bind. 32-bit values are high word
+ * first */
+typedef struct
+{
+	uint16_t push_button;
+} drv_modbus_0_input_s;
+
+typedef struct
+{
+	uint16_t clk_freq[2];
+	uint16_t baudrate[2];
+	uint16_t led;
+	uint16_t latency_reset;
+	uint16_t freeze;
+	uint16_t fifo_ack;
+} drv_modbus_0_holding_s;
+
+/* The structs are bound as the whole range, so they must match it */
+_Static_assert(sizeof(drv_modbus_0_input_s) == DRV_MODBUS_0_INPUT_REG_MAX * sizeof(uint16_t),
+			   "drv_modbus_0_input_s does not match the input registers");
+_Static_assert(sizeof(drv_modbus_0_holding_s) == DRV_MODBUS_0_HOLDING_REG_MAX * sizeof(uint16_t),
+			   "drv_modbus_0_holding_s does not match the holding registers");
+
+/* Writing DRV_MODBUS_0_HOLDING_REG_FREEZE with anything but 0, usually as a
+ * broadcast so that every node does it on the same frame, snapshots the
+ * input ranges that can be frozen. They are then served from the snapshot
+ * until the next freeze, or until 0 is written. The gateway cache is frozen
+ * together with its status, so that the stale flags and ages describe the
+ * frozen values */
+
+/* Writing n to DRV_MODBUS_0_HOLDING_REG_FIFO_ACK removes the n oldest samples
+ * of the push button FIFO, once read with FC 0x18. It reads back as 0 */
+
+/* Values of DRV_MODBUS_0_HOLDING_REG_LED. Others are refused */
+#define DRV_MODBUS_0_LED_OFF				0
+#define DRV_MODBUS_0_LED_ON					1
+#define DRV_MODBUS_0_LED_BLINK				2
+
+/* OS profiling input registers, starting at address 0x0100. A header is
+ * followed by one entry of DRV_MODBUS_OS_PROF_TASK_REG_MAX registers per task,
+ * in attach order. Cycles are CPU cycles. There is room for every task of the
+ * configuration, which checks it, and the whole block fits in one read */
+#define DRV_MODBUS_0_OS_PROF_START_ADDR		0x0100
+#define DRV_MODBUS_0_OS_PROF_MAX_TASKS		9
+
+enum
+{
+	DRV_MODBUS_0_OS_PROF_REG_N_TASKS,				// 0x0100
+	DRV_MODBUS_0_OS_PROF_REG_LOOP_PASSES_HIGH,		// 0x0101
+	DRV_MODBUS_0_OS_PROF_REG_LOOP_PASSES_LOW,		// 0x0102
+	DRV_MODBUS_0_OS_PROF_REG_LOOP_MIN_HIGH,			// 0x0103
+	DRV_MODBUS_0_OS_PROF_REG_LOOP_MIN_LOW,			// 0x0104
+	DRV_MODBUS_0_OS_PROF_REG_LOOP_MAX_HIGH,			// 0x0105
+	DRV_MODBUS_0_OS_PROF_REG_LOOP_MAX_LOW,			// 0x0106
+	DRV_MODBUS_0_OS_PROF_REG_LOOP_JITTER_HIGH,		// 0x0107
+	DRV_MODBUS_0_OS_PROF_REG_LOOP_JITTER_LOW,		// 0x0108
+	DRV_MODBUS_0_OS_PROF_REG_TASKS					// 0x0109
+};
+
+enum
+{
+	DRV_MODBUS_OS_PROF_TASK_REG_CALLS_HIGH,
+	DRV_MODBUS_OS_PROF_TASK_REG_CALLS_LOW,
+	DRV_MODBUS_OS_PROF_TASK_REG_MIN_HIGH,
+	DRV_MODBUS_OS_PROF_TASK_REG_MIN_LOW,
+	DRV_MODBUS_OS_PROF_TASK_REG_MAX_HIGH,
+	DRV_MODBUS_OS_PROF_TASK_REG_MAX_LOW,
+	DRV_MODBUS_OS_PROF_TASK_REG_MEAN_HIGH,
+	DRV_MODBUS_OS_PROF_TASK_REG_MEAN_LOW,
+	DRV_MODBUS_OS_PROF_TASK_REG_LOAD_PERMILLE,
+	DRV_MODBUS_OS_PROF_TASK_REG_MISSED_DEADLINES,
+	DRV_MODBUS_OS_PROF_TASK_REG_OVERRUNS,
+	DRV_MODBUS_OS_PROF_TASK_REG_MAX
+};
+
+#define DRV_MODBUS_0_OS_PROF_REG_MAX	(DRV_MODBUS_0_OS_PROF_REG_TASKS \
+										 + DRV_MODBUS_0_OS_PROF_MAX_TASKS * DRV_MODBUS_OS_PROF_TASK_REG_MAX)
+
+/* Transaction latency histograms, input registers starting at address 0x0200.
+ * One histogram of DRV_MODBUS_LATENCY_N_BUCKETS registers per metric, and one
+ * group of metrics per function code, i.e. the register of a bucket is
+ * (fc * DRV_MODBUS_LATENCY_METRIC_MAX + metric) * DRV_MODBUS_LATENCY_N_BUCKETS
+ * + bucket. Bucket 0 counts transactions under 128 us, bucket k counts
+ * [64 * 2^k, 64 * 2^(k+1)) us and the last one everything above. Counters
+ * saturate at 0xFFFF */
+#define DRV_MODBUS_0_LATENCY_START_ADDR		0x0200
+#define DRV_MODBUS_LATENCY_N_BUCKETS		12
+
+typedef enum
+{
+	DRV_MODBUS_LATENCY_FC_READ_HOLDING_REGS,
+	DRV_MODBUS_LATENCY_FC_READ_INPUT_REGS,
+	DRV_MODBUS_LATENCY_FC_WRITE_SINGLE_REG,
+	DRV_MODBUS_LATENCY_FC_WRITE_MULTIPLE_REGS,
+	DRV_MODBUS_LATENCY_FC_OTHER,
+	DRV_MODBUS_LATENCY_FC_MAX
+} drv_modbus_latency_fc_e;
+
+typedef enum
+{
+	DRV_MODBUS_LATENCY_METRIC_RECEIVE,		/* First byte to end of frame */
+	DRV_MODBUS_LATENCY_METRIC_PROCESSING,	/* Dispatch to response ready */
+	DRV_MODBUS_LATENCY_METRIC_TURNAROUND,	/* Response ready to TX complete */
+	DRV_MODBUS_LATENCY_METRIC_TOTAL,		/* First byte to TX complete */
+	DRV_MODBUS_LATENCY_METRIC_MAX
+} drv_modbus_latency_metric_e;
+
+#define DRV_MODBUS_LATENCY_REG_MAX		(DRV_MODBUS_LATENCY_FC_MAX \
+										 * DRV_MODBUS_LATENCY_METRIC_MAX \
+										 * DRV_MODBUS_LATENCY_N_BUCKETS)
+
+/* Ranges of contiguous registers */
+enum
+{
+	DRV_MODBUS_0_INPUT_RANGE_MAIN,
+	DRV_MODBUS_0_INPUT_RANGE_OS_PROF,
+	DRV_MODBUS_0_INPUT_RANGE_LATENCY,
+	DRV_MODBUS_0_INPUT_RANGE_MAX
+};
+
+enum
+{
+	DRV_MODBUS_0_HOLDING_RANGE_MAIN,
+	DRV_MODBUS_0_HOLDING_RANGE_MAX
+};
+
+/* The legacy I/O bank stands in for the former stand-alone I/O node: the push
+ * button at input register 0x0000 and the LED at holding register 0x0000. It
+ * shares the values of the main bank */
+enum
+{
+	DRV_MODBUS_0_LEGACY_IO_INPUT_RANGE_MAIN,
+	DRV_MODBUS_0_LEGACY_IO_INPUT_RANGE_MAX
+};
+
+enum
+{
+	DRV_MODBUS_0_LEGACY_IO_HOLDING_RANGE_MAIN,
+	DRV_MODBUS_0_LEGACY_IO_HOLDING_RANGE_MAX
+};
+
+/* The gateway bank is a cache of the downstream bus, filled by the gateway
+ * poll schedule. Input and holding registers starting at address 0x0000
+ * mirror downstream input and holding registers, at the places set by the
+ * schedule. The status input registers hold one stale flag per block of the
+ * schedule, followed by the age of each block in ms */
+#define DRV_MODBUS_0_GW_INPUT_REG_MAX		64
+#define DRV_MODBUS_0_GW_HOLDING_REG_MAX		64
+#define DRV_MODBUS_0_GW_STATUS_START_ADDR	0x0F00
+#define DRV_MODBUS_0_GW_MAX_BLOCKS			16
+
+enum
+{
+	DRV_MODBUS_0_GW_STATUS_REG_STALE_FLAGS,	// 0x0F00
+	DRV_MODBUS_0_GW_STATUS_REG_AGES,		// 0x0F01
+	DRV_MODBUS_0_GW_STATUS_REG_MAX = DRV_MODBUS_0_GW_STATUS_REG_AGES + DRV_MODBUS_0_GW_MAX_BLOCKS
+};
+
+enum
+{
+	DRV_MODBUS_0_GATEWAY_INPUT_RANGE_CACHE,
+	DRV_MODBUS_0_GATEWAY_INPUT_RANGE_STATUS,
+	DRV_MODBUS_0_GATEWAY_INPUT_RANGE_MAX
+};
+
+enum
+{
+	DRV_MODBUS_0_GATEWAY_HOLDING_RANGE_CACHE,
+	DRV_MODBUS_0_GATEWAY_HOLDING_RANGE_MAX
+};
+
+/* Blocks of registers reported by exception (FC 0x41) */
+enum
+{
+	DRV_MODBUS_0_RBE_BLOCK_MAIN_INPUT,
+	DRV_MODBUS_0_RBE_BLOCK_MAIN_MAX
+};
+
+enum
+{
+	DRV_MODBUS_0_RBE_BLOCK_GATEWAY_INPUT,
+	DRV_MODBUS_0_RBE_BLOCK_GATEWAY_HOLDING,
+	DRV_MODBUS_0_RBE_BLOCK_GATEWAY_MAX
+};
+
+/* Register banks. Each unit id answered by an instance is mapped to one
+ * bank */
+enum
+{
+	DRV_MODBUS_0_BANK_MAIN,
+	DRV_MODBUS_0_BANK_LEGACY_IO,
+	DRV_MODBUS_0_BANK_GATEWAY,
+	DRV_MODBUS_0_BANK_MAX
+};
+
 typedef enum
 {
 	DRV_MODBUS_REGISTER_TYPE_INPUT,
 	DRV_MODBUS_REGISTER_TYPE_HOLDING
 } drv_modbus_register_type_s;
 
+/* Hooks of a holding register, run while a master write is served. validate
+ * gets the value before anything is stored: refusing it answers the request
+ * with exception 0x03 and leaves every register of the request untouched.
+ * written is called once per write of the register, after the value has been
+ * stored. Either may be NULL. Both run in the Modbus task and must not take
+ * long */
+typedef bool (*drv_modbus_validate_fn)(drv_modbus_inst inst, uint16_t addr, uint16_t val);
+typedef void (*drv_modbus_written_fn)(drv_modbus_inst inst, uint16_t addr, uint16_t val);
+
+typedef struct
+{
+	drv_modbus_validate_fn validate;
+	drv_modbus_written_fn written;
+} drv_modbus_write_hooks_s;
+
+/* A range of contiguous registers, starting at start_addr, whose values are
+ * stored in val. Holding ranges may have hooks, indexed by address -
+ * start_addr, with NULL for registers without them. Ranges where no register
+ * has hooks leave hooks NULL, and cost nothing more to write. Ranges holding
+ * values of several registers that may be updated from an interrupt have a
+ * seq counter, see drv_modbus_range_update_begin. Input ranges that can be
+ * frozen have a snapshot buffer of n_regs registers in frozen */
+typedef struct
+{
+	uint16_t start_addr;
+	uint16_t n_regs;
+	uint16_t *val;
+	const drv_modbus_write_hooks_s *const *hooks;
+	volatile uint32_t *seq;
+	uint16_t *frozen;
+} drv_modbus_range_s;
+
+/* Keeps the compiler from moving register accesses across the seq counter */
+#define DRV_MODBUS_BARRIER()	__asm volatile("" ::: "memory")
+
+/* Registers that can be reported by exception. They must lie within a single
+ * range. reported holds the value last given a stamp, and version the stamp,
+ * 0 until the first one. A register gets a new stamp once it differs from its
+ * reported value by more than deadband. Stamps are 32 bit so that they never
+ * wrap around in practice */
+typedef struct
+{
+	drv_modbus_register_type_s type;
+	uint16_t start_addr;
+	uint16_t n_regs;
+	uint16_t deadband;
+	uint16_t *reported;
+	uint32_t *version;
+} drv_modbus_rbe_block_s;
+
+/* A complete register map. rbe_blocks may be NULL if n_rbe_blocks is 0 */
+typedef struct
+{
+	const drv_modbus_range_s *holding_ranges;
+	const drv_modbus_range_s *input_ranges;
+	const drv_modbus_rbe_block_s *rbe_blocks;
+	uint8_t n_holding_ranges;
+	uint8_t n_input_ranges;
+	uint8_t n_rbe_blocks;
+} drv_modbus_bank_s;
+
 /* Constants */
 
-extern const uint16_t vdrv_modbus_0_input_regs_addr[DRV_MODBUS_0_INPUT_REG_MAX];
-extern const uint16_t vdrv_modbus_0_holding_regs_addr[DRV_MODBUS_0_HOLDING_REG_MAX];
+extern const drv_modbus_bank_s cdrv_modbus_0_banks[DRV_MODBUS_0_BANK_MAX];
 extern uint16_t vdrv_modbus_0_input_regs_val[DRV_MODBUS_0_INPUT_REG_MAX];
 extern uint16_t vdrv_modbus_0_holding_regs_val[DRV_MODBUS_0_HOLDING_REG_MAX];
+extern uint16_t vdrv_modbus_0_os_prof_regs_val[DRV_MODBUS_0_OS_PROF_REG_MAX];
+extern uint16_t vdrv_modbus_0_latency_regs_val[DRV_MODBUS_LATENCY_REG_MAX];
+extern uint16_t vdrv_modbus_0_gw_input_regs_val[DRV_MODBUS_0_GW_INPUT_REG_MAX];
+extern uint16_t vdrv_modbus_0_gw_holding_regs_val[DRV_MODBUS_0_GW_HOLDING_REG_MAX];
+extern uint16_t vdrv_modbus_0_gw_status_regs_val[DRV_MODBUS_0_GW_STATUS_REG_MAX];
 
 /* APIs */
 error_e drv_modbus_read_register(drv_modbus_inst inst,
@@ -52,5 +323,19 @@ error_e drv_modbus_write_register(drv_modbus_inst inst,
 		 	 	 	 	 	 	  drv_modbus_register_type_s type,
 								  uint16_t reg,
 								  uint16_t val);
+void drv_modbus_range_update_begin(drv_modbus_inst inst,
+								   uint8_t bank,
+								   drv_modbus_register_type_s type,
+								   uint8_t range);
+void drv_modbus_range_update_end(drv_modbus_inst inst,
+								 uint8_t bank,
+								 drv_modbus_register_type_s type,
+								 uint8_t range);
+error_e drv_modbus_range_bind(drv_modbus_inst inst,
+							  uint8_t bank,
+							  drv_modbus_register_type_s type,
+							  uint8_t range,
+							  uint16_t *storage,
+							  uint16_t n_regs);
 
 #endif /* DRV_DRV_MODBUS_DRV_MODBUS_REGISTERS_H_ */
@@ -0,0 +1,87 @@
+/*
+ * drv_modbus_rtu.c
+ *
+ *  Created on: Oct 19, 2026
+ *      Author: ricard
+ */
+#include "drv_modbus_rtu.h"
+
+/* Above 19200 bauds the protocol fixes T3.5 to 1.75 ms */
+#define DRV_MODBUS_RTU_FAST_BAUDRATE		19200
+
+/* 3.5 characters of 11 bits, in bit times x 1000 (ms) */
+#define DRV_MODBUS_RTU_T35_BITS_X1000		38500
+
+/* Adds one byte to a running CRC, started with DRV_MODBUS_RTU_CRC_INIT. Over
+ * a whole frame with its CRC, the result is 0 if the frame is correct */
+uint16_t drv_modbus_rtu_crc_update(uint16_t crc, uint8_t byte)
+{
+	const uint16_t poly = 0xA001;
+
+	crc ^= byte;
+
+	for(uint8_t i = 0; i < 8; i++)
+	{
+		if((crc & 1U) == 0)
+		{
+			crc >>= 1;
+		}
+		else
+		{
+			crc >>= 1;
+
+			crc ^= poly;
+		}
+	}
+
+	return crc;
+}
+
+void drv_modbus_rtu_crc_calc(const uint8_t *buff, uint16_t len, uint8_t crc_buff[2])
+{
+	uint16_t crc = DRV_MODBUS_RTU_CRC_INIT;
+
+	for(uint16_t i = 0; i < len; i++)
+
+		crc = drv_modbus_rtu_crc_update(crc, buff[i]);
+
+	/* CRC low */
+	crc_buff[0] = (uint8_t)(crc & 0x00FFU);
+
+	/* CRC high */
+	crc_buff[1] = (uint8_t)((crc & 0xFF00U) >> 8U);
+}
+
+/* len includes the two CRC bytes at the end of the frame */
+bool drv_modbus_rtu_crc_check(const uint8_t *frame, uint16_t len)
+{
+	uint8_t crc[2];
+
+	if(len < DRV_MODBUS_RTU_MIN_FRAME_LEN_BYTES)
+
+		return false;
+
+	drv_modbus_rtu_crc_calc(frame, len - 2, crc);
+
+	return crc[0] == frame[len - 2] && crc[1] == frame[len - 1];
+}
+
+/* Silent interval that ends a frame, in us */
+uint32_t drv_modbus_rtu_t35_us(uint32_t baudrate)
+{
+	if(baudrate == 0 || baudrate > DRV_MODBUS_RTU_FAST_BAUDRATE)
+
+		return 1750;
+
+	return (DRV_MODBUS_RTU_T35_BITS_X1000 * 1000 + baudrate - 1) / baudrate;
+}
+
+/* Silent interval that ends a frame, rounded up to whole timer ticks */
+uint16_t drv_modbus_rtu_t35_ms(uint32_t baudrate)
+{
+	if(baudrate == 0 || baudrate > DRV_MODBUS_RTU_FAST_BAUDRATE)
+
+		return 2;
+
+	return (uint16_t)((DRV_MODBUS_RTU_T35_BITS_X1000 + baudrate - 1) / baudrate);
+}
@@ -0,0 +1,44 @@
+/*
+ * drv_modbus_rtu.h
+ *
+ *  Created on: Oct 19, 2026
+ *      Author: ricard
+ */
+
+#ifndef DRV_DRV_MODBUS_DRV_MODBUS_RTU_H_
+#define DRV_DRV_MODBUS_DRV_MODBUS_RTU_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/* RTU framing shared by the slave and master engines */
+
+#define DRV_MODBUS_RTU_BROADCAST_ADDRESS			0x00
+
+/* Highest address a server can have. 248 to 255 are reserved */
+#define DRV_MODBUS_RTU_MAX_SERVER_ADDRESS			247
+
+/* Largest RTU frame allowed by the protocol */
+#define DRV_MODBUS_RTU_MAX_FRAME_LEN_BYTES			256
+
+/* Address, function code and CRC */
+#define DRV_MODBUS_RTU_MIN_FRAME_LEN_BYTES			4
+
+/* Fixed silent intervals, valid at any baud rate up to 19200 bauds with the
+ * 1 ms resolution of the timers */
+#define DRV_MODBUS_RTU_TIMEOUT_BETWEEN_BYTES_MS		2
+#define DRV_MODBUS_RTU_TIME_BETWEEN_FRAMES_MS		5
+
+/* Safety net in case the transmit complete event never arrives. A full frame
+ * takes less than 300 ms even at 9600 bauds */
+#define DRV_MODBUS_RTU_TX_COMPLETE_TIMEOUT_MS		500
+
+#define DRV_MODBUS_RTU_CRC_INIT						0xFFFF
+
+uint16_t drv_modbus_rtu_crc_update(uint16_t crc, uint8_t byte);
+void drv_modbus_rtu_crc_calc(const uint8_t *buff, uint16_t len, uint8_t crc_buff[2]);
+bool drv_modbus_rtu_crc_check(const uint8_t *frame, uint16_t len);
+uint32_t drv_modbus_rtu_t35_us(uint32_t baudrate);
+uint16_t drv_modbus_rtu_t35_ms(uint32_t baudrate);
+
+#endif /* DRV_DRV_MODBUS_DRV_MODBUS_RTU_H_ */
@@ -0,0 +1,539 @@
+/*
+ * drv_modbus_sniffer.c
+ *
+ *  Created on: Oct 19, 2026
+ *      Author: ricard
+ */
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include "drv_modbus_sniffer.h"
+#include "drv_modbus_rtu.h"
+#include "drv_modbus_file.h"
+#include "hal_os/hal_os.h"
+#include "status.h"
+
+/* Frame starts seen by the interrupt and not yet handled by the task. Power
+ * of 2 */
+#define DRV_MODBUS_SNIFFER_START_QUEUE_LEN		8U
+
+#define DRV_MODBUS_SNIFFER_RING_SIZE_BYTES		(sizeof(((drv_modbus_sniffer_capture_s *)0)->data))
+
+/* Bits of a character: start, 8 data, parity and stop */
+#define DRV_MODBUS_SNIFFER_BITS_PER_CHAR		11U
+
+/* Record of the frozen field in the first file */
+#define DRV_MODBUS_SNIFFER_FROZEN_RECORD		(offsetof(drv_modbus_sniffer_capture_s, frozen) / sizeof(uint16_t))
+
+/* Type definitions */
+
+/* First byte of a frame, as seen in the receive interrupt */
+typedef struct
+{
+	uint32_t byte_seq;
+	uint32_t start_us;
+	uint32_t gap_us;
+} drv_modbus_sniffer_start_s;
+
+/* Frame being captured */
+typedef struct
+{
+	bool open;
+	drv_modbus_sniffer_record_s record;
+	uint16_t len;
+	uint16_t crc;
+	uint16_t overrun_ref;
+	uint8_t data[DRV_MODBUS_RTU_MAX_FRAME_LEN_BYTES];
+} drv_modbus_sniffer_frame_s;
+
+/* Local variables */
+
+static status_e vdrv_modbus_sniffer_status[DRV_MODBUS_SNIFFER_INST_MAX] =
+{
+		STATUS_NOT_INIT
+};
+static drv_modbus_sniffer_config_s vdrv_modbus_sniffer_config[DRV_MODBUS_SNIFFER_INST_MAX];
+static drv_modbus_sniffer_frame_s vdrv_modbus_sniffer_frame[DRV_MODBUS_SNIFFER_INST_MAX];
+
+/* Silence that separates frames, and duration of a character, in us */
+static uint32_t vdrv_modbus_sniffer_t35_us[DRV_MODBUS_SNIFFER_INST_MAX];
+static uint32_t vdrv_modbus_sniffer_char_us[DRV_MODBUS_SNIFFER_INST_MAX];
+
+/* Written in interrupt context only */
+static volatile drv_modbus_sniffer_start_s vdrv_modbus_sniffer_start[DRV_MODBUS_SNIFFER_INST_MAX][DRV_MODBUS_SNIFFER_START_QUEUE_LEN];
+static volatile uint32_t vdrv_modbus_sniffer_start_head[DRV_MODBUS_SNIFFER_INST_MAX];
+static volatile uint32_t vdrv_modbus_sniffer_rx_seq[DRV_MODBUS_SNIFFER_INST_MAX];
+static volatile uint32_t vdrv_modbus_sniffer_last_rx_us[DRV_MODBUS_SNIFFER_INST_MAX];
+
+/* Written in task context only */
+static uint32_t vdrv_modbus_sniffer_start_tail[DRV_MODBUS_SNIFFER_INST_MAX];
+static uint32_t vdrv_modbus_sniffer_consumed_seq[DRV_MODBUS_SNIFFER_INST_MAX];
+
+/* Not initialized by the startup, so that it survives resets */
+static drv_modbus_sniffer_capture_s vdrv_modbus_sniffer_capture[DRV_MODBUS_SNIFFER_INST_MAX]
+	__attribute__((section(".noinit_sram2")));
+
+/* Local function declarations */
+
+static void drv_modbus_sniffer_capture_check(drv_modbus_sniffer_inst_e inst);
+static void drv_modbus_sniffer_capture_clear(drv_modbus_sniffer_inst_e inst);
+static error_e drv_modbus_sniffer_capture_write(void *ctx,
+												uint16_t record,
+												uint16_t n_records,
+												const uint16_t *vals);
+static void drv_modbus_sniffer_frame_open(drv_modbus_sniffer_inst_e inst,
+										  uint32_t start_us,
+										  uint32_t gap_us);
+static void drv_modbus_sniffer_frame_close(drv_modbus_sniffer_inst_e inst);
+static bool drv_modbus_sniffer_start_due(drv_modbus_sniffer_inst_e inst);
+static void drv_modbus_sniffer_silence_check(drv_modbus_sniffer_inst_e inst);
+static void drv_modbus_sniffer_ring_push(drv_modbus_sniffer_inst_e inst,
+										 const drv_modbus_sniffer_record_s *record,
+										 const uint8_t *data,
+										 uint16_t len);
+static void drv_modbus_sniffer_ring_drop_oldest(drv_modbus_sniffer_inst_e inst);
+static uint32_t drv_modbus_sniffer_ring_free(const drv_modbus_sniffer_capture_s *capture);
+static uint32_t drv_modbus_sniffer_ring_write(drv_modbus_sniffer_capture_s *capture,
+											  uint32_t offset,
+											  const uint8_t *buff,
+											  uint32_t len);
+static uint32_t drv_modbus_sniffer_ring_read(const drv_modbus_sniffer_capture_s *capture,
+											 uint32_t offset,
+											 uint8_t *buff,
+											 uint32_t len);
+
+/* Initialize variables. The capture is left alone: it is checked at start */
+
+void drv_modbus_sniffer_init(void)
+{
+	for(drv_modbus_sniffer_inst_e i = 0; i < DRV_MODBUS_SNIFFER_INST_MAX; i++)
+	{
+		vdrv_modbus_sniffer_status[i] = STATUS_NOT_STARTED;
+
+		vdrv_modbus_sniffer_frame[i].open = false;
+
+		vdrv_modbus_sniffer_start_head[i] = 0;
+
+		vdrv_modbus_sniffer_start_tail[i] = 0;
+
+		vdrv_modbus_sniffer_rx_seq[i] = 0;
+
+		vdrv_modbus_sniffer_consumed_seq[i] = 0;
+	}
+}
+
+/* Configure */
+
+void drv_modbus_sniffer_start(const drv_modbus_sniffer_config_s config)
+{
+	drv_modbus_file_s file;
+	uint32_t baudrate;
+
+	if((config.inst < DRV_MODBUS_SNIFFER_INST_MAX)
+		&& (vdrv_modbus_sniffer_status[config.inst] == STATUS_NOT_STARTED))
+	{
+		vdrv_modbus_sniffer_config[config.inst] = config;
+
+		baudrate = hal_uart_baudrate_get(config.uart_inst);
+
+		vdrv_modbus_sniffer_t35_us[config.inst] = drv_modbus_rtu_t35_us(baudrate);
+
+		vdrv_modbus_sniffer_char_us[config.inst] = (baudrate > 0) ?
+				(DRV_MODBUS_SNIFFER_BITS_PER_CHAR * 1000000U) / baudrate : 0;
+
+		drv_modbus_sniffer_capture_check(config.inst);
+
+		/* Whatever is received before start is not timestamped */
+		hal_uart_flush_buffer(config.uart_inst);
+
+		/* Only the frozen field of the capture can be written */
+		file.file_num = config.file_num;
+		file.n_records = DRV_MODBUS_SNIFFER_FILE_RECORDS;
+		file.read = drv_modbus_file_mem_read;
+		file.write = drv_modbus_sniffer_capture_write;
+		file.write_record = DRV_MODBUS_SNIFFER_FROZEN_RECORD;
+		file.n_write_records = 1;
+		file.ctx = &vdrv_modbus_sniffer_capture[config.inst];
+
+		drv_modbus_file_register(config.modbus_inst, &file);
+
+		file.file_num = config.file_num + 1;
+		file.write = NULL;
+		file.n_write_records = 0;
+		file.ctx = (uint8_t *)&vdrv_modbus_sniffer_capture[config.inst]
+				   + DRV_MODBUS_SNIFFER_FILE_RECORDS * sizeof(uint16_t);
+
+		drv_modbus_file_register(config.modbus_inst, &file);
+
+		vdrv_modbus_sniffer_status[config.inst] = STATUS_STARTED;
+	}
+}
+
+/* Fxn */
+
+void drv_modbus_sniffer_fxn(void)
+{
+	drv_modbus_sniffer_config_s *config;
+	drv_modbus_sniffer_frame_s *frame;
+	volatile drv_modbus_sniffer_start_s *start;
+	bool byte_received;
+	uint8_t byte;
+
+	for(drv_modbus_sniffer_inst_e i = 0; i < DRV_MODBUS_SNIFFER_INST_MAX; i++)
+	{
+		if(vdrv_modbus_sniffer_status[i] != STATUS_STARTED)
+
+			continue;
+
+		config = &vdrv_modbus_sniffer_config[i];
+
+		frame = &vdrv_modbus_sniffer_frame[i];
+
+		byte_received = false;
+
+		while(hal_uart_retrieve(config->uart_inst, &byte, 1) == ERROR_NONE)
+		{
+			byte_received = true;
+
+			if(drv_modbus_sniffer_start_due(i))
+			{
+				/* This byte was the first after a silence */
+				drv_modbus_sniffer_frame_close(i);
+
+				start = &vdrv_modbus_sniffer_start[i][vdrv_modbus_sniffer_start_tail[i]
+														& (DRV_MODBUS_SNIFFER_START_QUEUE_LEN - 1U)];
+
+				drv_modbus_sniffer_frame_open(i, start->start_us, start->gap_us);
+
+				vdrv_modbus_sniffer_start_tail[i]++;
+			}
+			else if(!frame->open)
+
+				/* Its start has been lost, because the queue was full */
+				drv_modbus_sniffer_frame_open(i,
+											  vdrv_modbus_sniffer_last_rx_us[i],
+											  DRV_MODBUS_SNIFFER_GAP_UNKNOWN);
+
+			if(frame->len < DRV_MODBUS_RTU_MAX_FRAME_LEN_BYTES)
+			{
+				frame->data[frame->len] = byte;
+
+				frame->len++;
+
+				frame->crc = drv_modbus_rtu_crc_update(frame->crc, byte);
+			}
+			else
+
+				frame->record.info |= DRV_MODBUS_SNIFFER_INFO_OVERRUN;
+
+			vdrv_modbus_sniffer_consumed_seq[i]++;
+		}
+
+		if(frame->open)
+
+			drv_modbus_sniffer_silence_check(i);
+
+		if(byte_received)
+
+			hal_os_task_yield();
+	}
+}
+
+/* Called from the receive interrupt of the UART, for every byte. A byte that
+ * follows a silence of T3.5 starts a frame. The interrupt comes at the end of
+ * the character, so its duration is taken off */
+void drv_modbus_sniffer_rx_isr(drv_modbus_sniffer_inst_e inst)
+{
+	volatile drv_modbus_sniffer_start_s *start;
+	uint32_t now_us;
+	uint32_t silence_us;
+	uint32_t seq;
+
+	if(inst >= DRV_MODBUS_SNIFFER_INST_MAX
+		|| vdrv_modbus_sniffer_status[inst] != STATUS_STARTED)
+
+		return;
+
+	now_us = hal_timer_counter_get(vdrv_modbus_sniffer_config[inst].counter_timer_inst);
+
+	seq = vdrv_modbus_sniffer_rx_seq[inst];
+
+	silence_us = now_us - vdrv_modbus_sniffer_last_rx_us[inst];
+
+	if(seq == 0 || silence_us >= vdrv_modbus_sniffer_t35_us[inst])
+	{
+		if(vdrv_modbus_sniffer_start_head[inst] - vdrv_modbus_sniffer_start_tail[inst]
+		   < DRV_MODBUS_SNIFFER_START_QUEUE_LEN)
+		{
+			start = &vdrv_modbus_sniffer_start[inst][vdrv_modbus_sniffer_start_head[inst]
+													  & (DRV_MODBUS_SNIFFER_START_QUEUE_LEN - 1U)];
+
+			start->byte_seq = seq;
+
+			start->start_us = now_us - vdrv_modbus_sniffer_char_us[inst];
+
+			start->gap_us = (seq == 0) ? DRV_MODBUS_SNIFFER_GAP_UNKNOWN
+									   : silence_us - vdrv_modbus_sniffer_char_us[inst];
+
+			vdrv_modbus_sniffer_start_head[inst]++;
+		}
+	}
+
+	vdrv_modbus_sniffer_last_rx_us[inst] = now_us;
+
+	vdrv_modbus_sniffer_rx_seq[inst] = seq + 1;
+}
+
+/* A capture left by a previous run is kept if its header makes sense */
+static void drv_modbus_sniffer_capture_check(drv_modbus_sniffer_inst_e inst)
+{
+	drv_modbus_sniffer_capture_s *capture = &vdrv_modbus_sniffer_capture[inst];
+
+	if(capture->magic == DRV_MODBUS_SNIFFER_CAPTURE_MAGIC
+		&& capture->head < DRV_MODBUS_SNIFFER_RING_SIZE_BYTES
+		&& capture->tail < DRV_MODBUS_SNIFFER_RING_SIZE_BYTES
+		&& (capture->head & 1U) == 0
+		&& (capture->tail & 1U) == 0)
+
+	{
+		capture->n_resets++;
+
+		/* A download in progress did not survive the reset */
+		capture->frozen = 0;
+	}
+	else
+
+		drv_modbus_sniffer_capture_clear(inst);
+}
+
+static void drv_modbus_sniffer_capture_clear(drv_modbus_sniffer_inst_e inst)
+{
+	drv_modbus_sniffer_capture_s *capture = &vdrv_modbus_sniffer_capture[inst];
+
+	capture->head = 0;
+	capture->tail = 0;
+	capture->n_records = 0;
+	capture->n_frames = 0;
+	capture->n_dropped = 0;
+	capture->n_resets = 0;
+	capture->frozen = 0;
+	capture->n_skipped = 0;
+
+	/* Last, so that a reset in between finds no capture */
+	capture->magic = DRV_MODBUS_SNIFFER_CAPTURE_MAGIC;
+}
+
+/* Only called for the frozen field, the one writable record */
+static error_e drv_modbus_sniffer_capture_write(void *ctx,
+												uint16_t record,
+												uint16_t n_records,
+												const uint16_t *vals)
+{
+	drv_modbus_sniffer_capture_s *capture = ctx;
+
+	(void)record;
+	(void)n_records;
+
+	if(vals[0] > 1)
+
+		return ERROR_MODBUS_FILE_ACCESS;
+
+	capture->frozen = vals[0];
+
+	return ERROR_NONE;
+}
+
+static void drv_modbus_sniffer_frame_open(drv_modbus_sniffer_inst_e inst,
+										  uint32_t start_us,
+										  uint32_t gap_us)
+{
+	drv_modbus_sniffer_frame_s *frame = &vdrv_modbus_sniffer_frame[inst];
+
+	frame->open = true;
+
+	frame->record.timestamp_us = start_us;
+
+	frame->record.gap_us = gap_us;
+
+	frame->record.info = 0;
+
+	frame->len = 0;
+
+	frame->crc = DRV_MODBUS_RTU_CRC_INIT;
+
+	/* Characters lost from now on corrupt the frame */
+	frame->overrun_ref = hal_uart_overrun_cnt_get(vdrv_modbus_sniffer_config[inst].uart_inst);
+}
+
+/* Stores the frame being captured, if any */
+static void drv_modbus_sniffer_frame_close(drv_modbus_sniffer_inst_e inst)
+{
+	drv_modbus_sniffer_frame_s *frame = &vdrv_modbus_sniffer_frame[inst];
+
+	if(!frame->open)
+
+		return;
+
+	frame->open = false;
+
+	if(hal_uart_overrun_cnt_get(vdrv_modbus_sniffer_config[inst].uart_inst) != frame->overrun_ref)
+
+		frame->record.info |= DRV_MODBUS_SNIFFER_INFO_OVERRUN;
+
+	if(frame->len >= DRV_MODBUS_RTU_MIN_FRAME_LEN_BYTES
+		&& frame->crc == 0
+		&& (frame->record.info & DRV_MODBUS_SNIFFER_INFO_OVERRUN) == 0)
+
+		frame->record.info |= DRV_MODBUS_SNIFFER_INFO_CRC_OK;
+
+	frame->record.info |= frame->len & DRV_MODBUS_SNIFFER_INFO_LEN_MASK;
+
+	drv_modbus_sniffer_ring_push(inst, &frame->record, frame->data, frame->len);
+}
+
+/* True if the next byte to be retrieved is the first one of a frame */
+static bool drv_modbus_sniffer_start_due(drv_modbus_sniffer_inst_e inst)
+{
+	volatile drv_modbus_sniffer_start_s *start;
+
+	if(vdrv_modbus_sniffer_start_head[inst] == vdrv_modbus_sniffer_start_tail[inst])
+
+		return false;
+
+	start = &vdrv_modbus_sniffer_start[inst][vdrv_modbus_sniffer_start_tail[inst]
+											  & (DRV_MODBUS_SNIFFER_START_QUEUE_LEN - 1U)];
+
+	/* Bytes lost to a full buffer leave the count behind, so a start that
+	 * has been passed is due as well */
+	return (int32_t)(vdrv_modbus_sniffer_consumed_seq[inst] - start->byte_seq) >= 0;
+}
+
+/* Once the bus has been silent for T3.5, the frame is complete. The count of
+ * bytes handled is brought in line with the interrupt, which recovers from
+ * bytes lost to a full buffer */
+static void drv_modbus_sniffer_silence_check(drv_modbus_sniffer_inst_e inst)
+{
+	drv_modbus_sniffer_config_s *config = &vdrv_modbus_sniffer_config[inst];
+	uint32_t seq;
+	uint32_t silence_us;
+
+	seq = vdrv_modbus_sniffer_rx_seq[inst];
+
+	silence_us = hal_timer_counter_get(config->counter_timer_inst)
+				 - vdrv_modbus_sniffer_last_rx_us[inst];
+
+	/* A byte received meanwhile is the start of the next frame */
+	if(silence_us < vdrv_modbus_sniffer_t35_us[inst]
+		|| seq != vdrv_modbus_sniffer_rx_seq[inst]
+		|| vdrv_modbus_sniffer_start_head[inst] != vdrv_modbus_sniffer_start_tail[inst])
+
+		return;
+
+	drv_modbus_sniffer_frame_close(inst);
+
+	vdrv_modbus_sniffer_consumed_seq[inst] = seq;
+}
+
+/* Appends a record to the ring, dropping the oldest ones to make room. head
+ * is moved once the whole record is in place, so that neither a reader nor a
+ * reset ever finds half a record. Nothing moves while the capture is frozen */
+static void drv_modbus_sniffer_ring_push(drv_modbus_sniffer_inst_e inst,
+										 const drv_modbus_sniffer_record_s *record,
+										 const uint8_t *data,
+										 uint16_t len)
+{
+	drv_modbus_sniffer_capture_s *capture = &vdrv_modbus_sniffer_capture[inst];
+	const uint8_t pad = 0;
+	uint32_t offset;
+
+	if(capture->frozen)
+	{
+		if(capture->n_skipped < UINT16_MAX)
+
+			capture->n_skipped++;
+
+		return;
+	}
+
+	while(drv_modbus_sniffer_ring_free(capture) < sizeof(*record) + len + (len & 1U))
+
+		drv_modbus_sniffer_ring_drop_oldest(inst);
+
+	offset = drv_modbus_sniffer_ring_write(capture, capture->head, (const uint8_t *)record, sizeof(*record));
+
+	offset = drv_modbus_sniffer_ring_write(capture, offset, data, len);
+
+	/* Records start at even offsets */
+	if(len & 1U)
+
+		offset = drv_modbus_sniffer_ring_write(capture, offset, &pad, 1);
+
+	capture->head = offset;
+
+	capture->n_records++;
+
+	capture->n_frames++;
+}
+
+static void drv_modbus_sniffer_ring_drop_oldest(drv_modbus_sniffer_inst_e inst)
+{
+	drv_modbus_sniffer_capture_s *capture = &vdrv_modbus_sniffer_capture[inst];
+	drv_modbus_sniffer_record_s record;
+	uint32_t len;
+
+	(void)drv_modbus_sniffer_ring_read(capture, capture->tail, (uint8_t *)&record, sizeof(record));
+
+	len = record.info & DRV_MODBUS_SNIFFER_INFO_LEN_MASK;
+
+	len += (len & 1U) + sizeof(record);
+
+	capture->tail = (capture->tail + len) % DRV_MODBUS_SNIFFER_RING_SIZE_BYTES;
+
+	if(capture->n_records > 0)
+
+		capture->n_records--;
+
+	capture->n_dropped++;
+}
+
+/* One byte is always left unused, so that head == tail means empty */
+static uint32_t drv_modbus_sniffer_ring_free(const drv_modbus_sniffer_capture_s *capture)
+{
+	uint32_t used;
+
+	used = (capture->head + DRV_MODBUS_SNIFFER_RING_SIZE_BYTES - capture->tail)
+		   % DRV_MODBUS_SNIFFER_RING_SIZE_BYTES;
+
+	return DRV_MODBUS_SNIFFER_RING_SIZE_BYTES - 1U - used;
+}
+
+/* Copies with wrap around. Return the offset that follows */
+static uint32_t drv_modbus_sniffer_ring_write(drv_modbus_sniffer_capture_s *capture,
+											  uint32_t offset,
+											  const uint8_t *buff,
+											  uint32_t len)
+{
+	for(uint32_t j = 0; j < len; j++)
+	{
+		capture->data[offset] = buff[j];
+
+		offset = (offset + 1U) % DRV_MODBUS_SNIFFER_RING_SIZE_BYTES;
+	}
+
+	return offset;
+}
+
+static uint32_t drv_modbus_sniffer_ring_read(const drv_modbus_sniffer_capture_s *capture,
+											 uint32_t offset,
+											 uint8_t *buff,
+											 uint32_t len)
+{
+	for(uint32_t j = 0; j < len; j++)
+	{
+		buff[j] = capture->data[offset];
+
+		offset = (offset + 1U) % DRV_MODBUS_SNIFFER_RING_SIZE_BYTES;
+	}
+
+	return offset;
+}
@@ -0,0 +1,91 @@
+/*
+ * drv_modbus_sniffer.h
+ *
+ *  Created on: Oct 19, 2026
+ *      Author: ricard
+ */
+
+#ifndef DRV_DRV_MODBUS_DRV_MODBUS_SNIFFER_H_
+#define DRV_DRV_MODBUS_DRV_MODBUS_SNIFFER_H_
+
+#include <stdint.h>
+#include "drv_modbus_common.h"
+#include "hal_uart/hal_uart.h"
+#include "hal_timer/hal_timer.h"
+
+/* Size of the capture, the whole of SRAM2 */
+#define DRV_MODBUS_SNIFFER_CAPTURE_SIZE_BYTES	(32U * 1024U)
+
+/* The capture is downloaded as two consecutive files, because a single file
+ * can't have more than 10000 records */
+#define DRV_MODBUS_SNIFFER_FILE_RECORDS			((DRV_MODBUS_SNIFFER_CAPTURE_SIZE_BYTES / 2U) / 2U)
+
+#define DRV_MODBUS_SNIFFER_CAPTURE_MAGIC		0x534E4946U	/* "SNIF" */
+
+/* Flags in the info field of a record, next to the frame length. OVERRUN
+ * means that bytes were lost, to an overrun or past the maximum frame length */
+#define DRV_MODBUS_SNIFFER_INFO_LEN_MASK		0x01FFU
+#define DRV_MODBUS_SNIFFER_INFO_OVERRUN			0x4000U
+#define DRV_MODBUS_SNIFFER_INFO_CRC_OK			0x8000U
+
+/* Gap of the first frame captured after start, which has no previous one */
+#define DRV_MODBUS_SNIFFER_GAP_UNKNOWN			0xFFFFFFFFU
+
+typedef enum
+{
+	DRV_MODBUS_SNIFFER_INST_0,
+	DRV_MODBUS_SNIFFER_INST_MAX
+} drv_modbus_sniffer_inst_e;
+
+/* Header of a captured frame in the ring, followed by the len bytes of the
+ * frame and a pad byte if len is odd. Records wrap around the end of the
+ * ring. Times are in us, from the counter timer */
+typedef struct
+{
+	uint32_t timestamp_us;	/* First byte of the frame */
+	uint32_t gap_us;		/* Silence since the end of the previous frame, saturated */
+	uint16_t info;			/* Length and DRV_MODBUS_SNIFFER_INFO_ flags */
+} __attribute__((packed)) drv_modbus_sniffer_record_s;
+
+/* The capture, as laid out in SRAM2 and in the download files. head and tail
+ * are offsets in data. The sniffer is the only writer: it moves head after a
+ * record has been written, and moves tail to drop the oldest records when the
+ * ring is full. The header is checked at start, and a capture that makes
+ * sense is kept across resets.
+ * The two files are read with separate requests, so the master freezes the
+ * capture for the download by writing 1 to the frozen field, the only record
+ * that can be written, and 0 when done. While frozen, frames are counted in
+ * n_skipped instead of being stored. A reset unfreezes it */
+typedef struct
+{
+	uint32_t magic;
+	uint32_t head;
+	uint32_t tail;
+	uint32_t n_records;		/* Records in the ring */
+	uint32_t n_frames;		/* Frames captured since the capture was cleared */
+	uint32_t n_dropped;		/* Oldest records overwritten */
+	uint32_t n_resets;		/* Resets the capture has survived */
+	uint16_t frozen;
+	uint16_t n_skipped;		/* Frames not stored while frozen, saturated */
+	uint8_t data[DRV_MODBUS_SNIFFER_CAPTURE_SIZE_BYTES - 8U * sizeof(uint32_t)];
+} drv_modbus_sniffer_capture_s;
+
+/* Listen-only capture of every frame on the bus of uart_inst. Nothing is
+ * ever sent on that UART. Bytes are timestamped in the receive interrupt
+ * with the free running counter_timer_inst, which must count us. The capture
+ * is registered as files file_num and file_num + 1 of modbus_inst */
+typedef struct
+{
+	drv_modbus_sniffer_inst_e inst;
+	hal_uart_uart_num_e uart_inst;
+	hal_timer_timer_inst_e counter_timer_inst;
+	drv_modbus_inst modbus_inst;
+	uint16_t file_num;
+} drv_modbus_sniffer_config_s;
+
+void drv_modbus_sniffer_init(void);
+void drv_modbus_sniffer_start(const drv_modbus_sniffer_config_s config);
+void drv_modbus_sniffer_fxn(void);
+void drv_modbus_sniffer_rx_isr(drv_modbus_sniffer_inst_e inst);
+
+#endif /* DRV_DRV_MODBUS_DRV_MODBUS_SNIFFER_H_ */
@@ -260,7 +260,7 @@ error_e hal_clk_set_freq_hz(uint32_t freq_hz)
 	}
 }
 
-uint16_t hal_clk_get_freq_hz(void)
+uint32_t hal_clk_get_freq_hz(void)
 {
 	return vhal_clk_freq_hz;
 }
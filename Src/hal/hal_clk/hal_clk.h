@@ -19,6 +19,6 @@
 void hal_clk_init(void);
 void hal_clk_start(void);
 error_e hal_clk_set_freq_hz(uint32_t freq_hz);
-uint16_t hal_clk_get_freq_hz(void);
+uint32_t hal_clk_get_freq_hz(void);
 
 #endif /* HAL_HAL_CLK_H_ */
@@ -6,35 +6,408 @@
  */
 
 #include <stdint.h>
+#include <stdbool.h>
 #include <stdlib.h>
+#include <string.h>
 #include "hal_os.h"
+#include "hal_trace/hal_trace.h"
 
+/* The scheduler core has no dependency on the MCU, so it can be built and
+ * exercised on the host. Only entering/leaving critical sections, the idle
+ * instruction and the cycle counter are target specific */
+#if defined(__arm__)
+#include <stm32l476xx.h>
+#include <core_cm4.h>
+
+#define HAL_OS_DISABLE_IRQ()	__disable_irq()
+#define HAL_OS_ENABLE_IRQ()		__enable_irq()
+#define HAL_OS_WAIT_FOR_IRQ()	__WFI()
+
+/* For sections that may be entered with interrupts already masked */
+#define HAL_OS_SAVE_DISABLE_IRQ(primask)	do { (primask) = __get_PRIMASK(); __disable_irq(); } while(0)
+#define HAL_OS_RESTORE_IRQ(primask)			__set_PRIMASK(primask)
+#else
+#include <time.h>
+
+#define HAL_OS_DISABLE_IRQ()
+#define HAL_OS_ENABLE_IRQ()
+#define HAL_OS_WAIT_FOR_IRQ()
+
+#define HAL_OS_SAVE_DISABLE_IRQ(primask)	((primask) = 0)
+#define HAL_OS_RESTORE_IRQ(primask)			((void)(primask))
+#endif
 
 #define HAL_OS_MAX_TASKS	30
 
-static void (*hal_os_tasks[HAL_OS_MAX_TASKS])(void);
+typedef struct
+{
+	void (*fxn)(void);
+	uint16_t period_ticks;
+	uint8_t priority;
+} hal_os_task_s;
+
+static hal_os_task_s hal_os_tasks[HAL_OS_MAX_TASKS];
 static uint8_t hal_os_task_cnt;
+static uint8_t vhal_os_current_task;
+
+/* Task ids sorted by priority. Ties keep the attach order */
+static uint8_t vhal_os_task_order[HAL_OS_MAX_TASKS];
+
+/* One byte per task, so that setting a flag from an ISR and clearing it from
+ * the scheduler never races with the flags of other tasks */
+static volatile uint8_t vhal_os_task_ready[HAL_OS_MAX_TASKS];
+
+/* Set with the ready flag by a periodic release only, so that a task readied
+ * by an event just before its release doesn't miss a deadline */
+static volatile uint8_t vhal_os_task_released[HAL_OS_MAX_TASKS];
+
+/* Ticks left until the next release of every periodic task */
+static volatile uint16_t vhal_os_task_countdown[HAL_OS_MAX_TASKS];
+
+static volatile uint32_t vhal_os_ticks;
+
+/* releases is counted both from the system tick interrupt and from whatever
+ * context readies a task, so it is only updated with interrupts masked */
+static volatile hal_os_task_stats_s vhal_os_task_stats[HAL_OS_MAX_TASKS];
+
+/* Profiling accumulators */
+
+typedef struct
+{
+	uint32_t calls;
+	uint32_t min_cycles;
+	uint32_t max_cycles;
+	uint64_t total_cycles;
+} hal_os_prof_acc_s;
+
+static hal_os_prof_acc_s vhal_os_task_prof[HAL_OS_MAX_TASKS];
+static hal_os_prof_acc_s vhal_os_loop_prof;
+static uint64_t vhal_os_busy_cycles;
+static uint32_t vhal_os_last_pass_cycles;
+static bool vhal_os_last_pass_slept;
+
+static bool hal_os_any_task_ready(void);
+static void hal_os_prof_acc_add(hal_os_prof_acc_s *acc, uint32_t cycles);
 
 void hal_os_init(void)
 {
 	hal_os_task_cnt = 0;
+
+	vhal_os_current_task = HAL_OS_INVALID_TASK_ID;
+
+	vhal_os_ticks = 0;
+
+	memset((void *)vhal_os_task_stats, 0, sizeof(vhal_os_task_stats));
+
+	hal_os_prof_reset();
 }
 
 void hal_os_start(void)
 {
-	/* Nothing to be done here */
+#if defined(__arm__)
+	/* Enable the DWT cycle counter, used to profile the tasks */
+	CoreDebug->DEMCR |= CoreDebug_DEMCR_TRCENA_Msk;
+
+	DWT->CYCCNT = 0;
+
+	DWT->CTRL |= DWT_CTRL_CYCCNTENA_Msk;
+#endif
+
+	vhal_os_last_pass_cycles = hal_os_cycles_get();
 }
 
+/* Runs the highest priority ready task, or sleeps until the next interrupt if
+ * there is none */
 void hal_os_fxn(void)
 {
+	uint8_t task_id;
+	uint32_t start_tick;
+	uint32_t pass_cycles;
+	uint32_t task_cycles;
+
+	/* Loop period. The counter stops while sleeping, so passes following a
+	 * sleep are meaningless */
+	pass_cycles = hal_os_cycles_get();
+
+	if(vhal_os_last_pass_slept == false)
+
+		hal_os_prof_acc_add(&vhal_os_loop_prof,
+							pass_cycles - vhal_os_last_pass_cycles);
+
+	vhal_os_last_pass_cycles = pass_cycles;
+
+	vhal_os_last_pass_slept = false;
+
 	for(uint8_t i = 0; i < hal_os_task_cnt; i++)
+	{
+		task_id = vhal_os_task_order[i];
+
+		if(vhal_os_task_ready[task_id])
+		{
+			/* Clear the flag before running the task, so that any event
+			 * raised while it runs is not lost */
+			vhal_os_task_ready[task_id] = 0;
+
+			vhal_os_task_released[task_id] = 0;
+
+			vhal_os_current_task = task_id;
+
+			start_tick = vhal_os_ticks;
 
-		hal_os_tasks[i]();
+			task_cycles = hal_os_cycles_get();
+
+			HAL_TRACE(HAL_TRACE_ID_OS_TASK_BEGIN, task_id, 0);
+
+			hal_os_tasks[task_id].fxn();
+
+			HAL_TRACE(HAL_TRACE_ID_OS_TASK_END, task_id, 0);
+
+			task_cycles = hal_os_cycles_get() - task_cycles;
+
+			vhal_os_current_task = HAL_OS_INVALID_TASK_ID;
+
+			hal_os_prof_acc_add(&vhal_os_task_prof[task_id], task_cycles);
+
+			vhal_os_task_stats[task_id].runs++;
+
+			if(hal_os_tasks[task_id].period_ticks != HAL_OS_NO_PERIOD
+				&& vhal_os_ticks - start_tick >= hal_os_tasks[task_id].period_ticks)
+
+				vhal_os_task_stats[task_id].overruns++;
+
+			vhal_os_busy_cycles += hal_os_cycles_get() - pass_cycles;
+
+			/* Start over, so that higher priority tasks made ready meanwhile
+			 * go first */
+			return;
+		}
+	}
+
+	/* Nothing is pending. Interrupts are masked while checking again, so that
+	 * an event raised between the check and WFI still wakes the core up (a
+	 * pending interrupt ends WFI even with PRIMASK set, and is served as soon
+	 * as it is cleared) */
+	HAL_OS_DISABLE_IRQ();
+
+	vhal_os_busy_cycles += hal_os_cycles_get() - pass_cycles;
+
+	if(hal_os_any_task_ready() == false)
+	{
+		vhal_os_last_pass_slept = true;
+
+		HAL_OS_WAIT_FOR_IRQ();
+	}
+
+	HAL_OS_ENABLE_IRQ();
+}
+
+uint8_t hal_os_task_attach(void (*fxn)(void),
+						   uint16_t period_ticks,
+						   uint8_t priority)
+{
+	uint8_t task_id;
+	uint8_t i;
+
+	if(fxn == NULL || hal_os_task_cnt >= HAL_OS_MAX_TASKS)
+
+		return HAL_OS_INVALID_TASK_ID;
+
+	task_id = hal_os_task_cnt;
+
+	hal_os_tasks[task_id].fxn = fxn;
+	hal_os_tasks[task_id].period_ticks = period_ticks;
+	hal_os_tasks[task_id].priority = priority;
+
+	vhal_os_task_countdown[task_id] = period_ticks;
+
+	/* Insert the task in the priority order */
+	for(i = task_id;
+		i > 0 && hal_os_tasks[vhal_os_task_order[i - 1]].priority > priority;
+		i--)
+
+		vhal_os_task_order[i] = vhal_os_task_order[i - 1];
+
+	vhal_os_task_order[i] = task_id;
+
+	/* Every task runs at least once */
+	vhal_os_task_ready[task_id] = 1;
+
+	vhal_os_task_released[task_id] = 0;
+
+	vhal_os_task_stats[task_id].releases++;
+
+	hal_os_task_cnt++;
+
+	return task_id;
 }
 
-void hal_os_task_attach(void (*fxn)(void))
+/* May be called from interrupt context */
+void hal_os_task_ready_set(uint8_t task_id)
 {
-	if(fxn != NULL)
+	uint32_t primask;
+
+	if(task_id < hal_os_task_cnt)
+	{
+		vhal_os_task_ready[task_id] = 1;
+
+		HAL_OS_SAVE_DISABLE_IRQ(primask);
+
+		vhal_os_task_stats[task_id].releases++;
+
+		HAL_OS_RESTORE_IRQ(primask);
+	}
+}
+
+/* Called by a task which still has work to do, so that it is run again
+ * without waiting for an event */
+void hal_os_task_yield(void)
+{
+	if(vhal_os_current_task < hal_os_task_cnt)
+
+		vhal_os_task_ready[vhal_os_current_task] = 1;
+}
+
+/* Called from the system tick interrupt. Releases the periodic tasks whose
+ * period has elapsed */
+void hal_os_tick(void)
+{
+	vhal_os_ticks++;
+
+	for(uint8_t i = 0; i < hal_os_task_cnt; i++)
+	{
+		if(hal_os_tasks[i].period_ticks == HAL_OS_NO_PERIOD
+			|| --vhal_os_task_countdown[i] > 0)
+
+			continue;
+
+		vhal_os_task_countdown[i] = hal_os_tasks[i].period_ticks;
+
+		/* The previous release hasn't been served yet: its deadline (the
+		 * start of the next period) has been missed */
+		if(vhal_os_task_released[i])
+
+			vhal_os_task_stats[i].missed_deadlines++;
+
+		vhal_os_task_released[i] = 1;
+
+		vhal_os_task_ready[i] = 1;
+
+		vhal_os_task_stats[i].releases++;
+	}
+}
+
+/* The counters are copied with interrupts masked, so that they are taken at
+ * the same instant */
+error_e hal_os_task_stats_get(uint8_t task_id, hal_os_task_stats_s *stats)
+{
+	uint32_t primask;
+
+	if(task_id >= hal_os_task_cnt)
+
+		return ERROR_OS_NON_EXISTENT_TASK;
+
+	HAL_OS_SAVE_DISABLE_IRQ(primask);
+
+	*stats = vhal_os_task_stats[task_id];
+
+	HAL_OS_RESTORE_IRQ(primask);
+
+	return ERROR_NONE;
+}
+
+uint8_t hal_os_task_cnt_get(void)
+{
+	return hal_os_task_cnt;
+}
+
+/* Free running timestamp, used for profiling */
+uint32_t hal_os_cycles_get(void)
+{
+#if defined(__arm__)
+	return DWT->CYCCNT;
+#else
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	return (uint32_t)((uint64_t)now.tv_sec * 1000000000ULL + now.tv_nsec);
+#endif
+}
+
+error_e hal_os_task_prof_get(uint8_t task_id, hal_os_task_prof_s *prof)
+{
+	hal_os_prof_acc_s acc;
+	uint64_t busy_cycles;
+
+	if(task_id >= hal_os_task_cnt)
+
+		return ERROR_OS_NON_EXISTENT_TASK;
+
+	acc = vhal_os_task_prof[task_id];
+	busy_cycles = vhal_os_busy_cycles;
+
+	prof->calls = acc.calls;
+	prof->min_cycles = acc.calls > 0 ? acc.min_cycles : 0;
+	prof->max_cycles = acc.max_cycles;
+	prof->mean_cycles = acc.calls > 0 ? (uint32_t)(acc.total_cycles / acc.calls) : 0;
+	prof->load_permille = busy_cycles > 0 ? (uint16_t)(acc.total_cycles * 1000 / busy_cycles) : 0;
+
+	return ERROR_NONE;
+}
+
+void hal_os_loop_prof_get(hal_os_loop_prof_s *prof)
+{
+	hal_os_prof_acc_s acc = vhal_os_loop_prof;
+
+	prof->passes = acc.calls;
+	prof->min_period_cycles = acc.calls > 0 ? acc.min_cycles : 0;
+	prof->max_period_cycles = acc.max_cycles;
+	prof->jitter_cycles = prof->max_period_cycles - prof->min_period_cycles;
+}
+
+void hal_os_prof_reset(void)
+{
+	for(uint8_t i = 0; i < HAL_OS_MAX_TASKS; i++)
+	{
+		vhal_os_task_prof[i].calls = 0;
+		vhal_os_task_prof[i].min_cycles = UINT32_MAX;
+		vhal_os_task_prof[i].max_cycles = 0;
+		vhal_os_task_prof[i].total_cycles = 0;
+	}
+
+	vhal_os_loop_prof.calls = 0;
+	vhal_os_loop_prof.min_cycles = UINT32_MAX;
+	vhal_os_loop_prof.max_cycles = 0;
+	vhal_os_loop_prof.total_cycles = 0;
+
+	vhal_os_busy_cycles = 0;
+
+	/* The next pass doesn't have a valid reference */
+	vhal_os_last_pass_slept = true;
+}
+
+static bool hal_os_any_task_ready(void)
+{
+	for(uint8_t i = 0; i < hal_os_task_cnt; i++)
+
+		if(vhal_os_task_ready[i])
+
+			return true;
+
+	return false;
+}
+
+static void hal_os_prof_acc_add(hal_os_prof_acc_s *acc, uint32_t cycles)
+{
+	acc->calls++;
+
+	acc->total_cycles += cycles;
+
+	if(cycles < acc->min_cycles)
+
+		acc->min_cycles = cycles;
+
+	if(cycles > acc->max_cycles)
 
-		hal_os_tasks[hal_os_task_cnt++] = fxn;
+		acc->max_cycles = cycles;
 }
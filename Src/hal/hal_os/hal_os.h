@@ -8,11 +8,63 @@
 #ifndef HAL_HAL_OS_HAL_OS_H_
 #define HAL_HAL_OS_HAL_OS_H_
 
+#include <stdint.h>
+#include <error.h>
+
+#define HAL_OS_INVALID_TASK_ID		0xFF
+
+/* A task with no period is only run when its ready flag is set */
+#define HAL_OS_NO_PERIOD			0
+
+/* Lower values mean higher priority */
+#define HAL_OS_HIGHEST_PRIORITY		0
+
+typedef struct
+{
+	uint32_t releases;			/* Times the task has been made ready */
+	uint32_t runs;				/* Times the task has been run */
+	uint32_t missed_deadlines;	/* Periodic releases found the previous one
+								 * still pending */
+	uint32_t overruns;			/* Runs that took longer than the period */
+} hal_os_task_stats_s;
+
+/* Execution time profile of a task. Cycles are CPU cycles on target (DWT
+ * CYCCNT) and nanoseconds on the host build */
+typedef struct
+{
+	uint32_t calls;
+	uint32_t min_cycles;
+	uint32_t max_cycles;
+	uint32_t mean_cycles;
+	uint16_t load_permille;		/* Share of the busy loop time */
+} hal_os_task_prof_s;
+
+/* Period of the scheduler loop while it has work to do. Passes that put the
+ * core to sleep are not taken into account */
+typedef struct
+{
+	uint32_t passes;
+	uint32_t min_period_cycles;
+	uint32_t max_period_cycles;
+	uint32_t jitter_cycles;
+} hal_os_loop_prof_s;
+
 void hal_os_init(void);
 void hal_os_start(void);
 void hal_os_fxn(void);
 
-void hal_os_task_attach(void (*fxn)(void));
+uint8_t hal_os_task_attach(void (*fxn)(void),
+						   uint16_t period_ticks,
+						   uint8_t priority);
+void hal_os_task_ready_set(uint8_t task_id);
+void hal_os_task_yield(void);
+void hal_os_tick(void);
+error_e hal_os_task_stats_get(uint8_t task_id, hal_os_task_stats_s *stats);
+uint8_t hal_os_task_cnt_get(void);
+uint32_t hal_os_cycles_get(void);
+error_e hal_os_task_prof_get(uint8_t task_id, hal_os_task_prof_s *prof);
+void hal_os_loop_prof_get(hal_os_loop_prof_s *prof);
+void hal_os_prof_reset(void);
 
 
 #endif /* HAL_HAL_OS_HAL_OS_H_ */
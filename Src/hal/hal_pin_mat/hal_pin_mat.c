@@ -120,6 +120,50 @@ const hal_pin_mat_pin_type_s chal_pin_mat_pin_matrix[HAL_MAT_PIN_MAX] =
 		  7,		// alter_func_low_sel	-> AF7
 		  0			// alter_func_high_sel	-> not used
 		},
+
+		/* HAL_MAT_PIN_USART2_DE */
+		{ GPIOA,	// port					-> A
+		  1,		// pin					-> 1
+		  2,		// mode					-> alternate
+		  0,		// output_type			-> push-pull
+		  0,		// output_speed			-> low
+		  0,		// pup_pdown			-> none
+		  7,		// alter_func_low_sel	-> AF7
+		  0			// alter_func_high_sel	-> not used
+		},
+
+		/* HAL_MAT_PIN_USART1_TX */
+		{ GPIOA,	// port					-> A
+		  9,		// pin					-> 9
+		  2,		// mode					-> alternate
+		  0,		// output_type			-> push-pull
+		  0,		// output_speed			-> low
+		  0,		// pup_pdown			-> none
+		  0,		// alter_func_low_sel	-> not used
+		  7			// alter_func_high_sel	-> AF7
+		},
+
+		/* HAL_MAT_PIN_USART1_RX */
+		{ GPIOA,	// port					-> A
+		  10,		// pin					-> 10
+		  2,		// mode					-> alternate
+		  0,		// output_type			-> not used
+		  0,		// output_speed			-> not used
+		  0,		// pup_pdown			-> none
+		  0,		// alter_func_low_sel	-> not used
+		  7			// alter_func_high_sel	-> AF7
+		},
+
+		/* HAL_MAT_PIN_USART1_DE */
+		{ GPIOA,	// port					-> A
+		  12,		// pin					-> 12
+		  2,		// mode					-> alternate
+		  0,		// output_type			-> push-pull
+		  0,		// output_speed			-> low
+		  0,		// pup_pdown			-> none
+		  0,		// alter_func_low_sel	-> not used
+		  7			// alter_func_high_sel	-> AF7
+		},
 };
 
 static void hal_pin_mat_enable_port_clk(const GPIO_TypeDef *port)
@@ -28,6 +28,10 @@ typedef enum
 	HAL_MAT_PIN_PUSH_BUTTON,
 	HAL_MAT_PIN_USART2_TX,
 	HAL_MAT_PIN_USART2_RX,
+	HAL_MAT_PIN_USART2_DE,
+	HAL_MAT_PIN_USART1_TX,
+	HAL_MAT_PIN_USART1_RX,
+	HAL_MAT_PIN_USART1_DE,
 	HAL_MAT_PIN_MAX,
 } hal_mat_pin_e;
 
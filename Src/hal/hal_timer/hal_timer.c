@@ -6,6 +6,7 @@
  */
 
 #include "hal_timer.h"
+#include "hal_trace/hal_trace.h"
 #include <string.h>
 #include <stm32l476xx.h>
 #include <core_cm4.h>
@@ -20,6 +21,8 @@ static inline void hal_timer_interrupt_handler(hal_timer_timer_inst_e timer_inst
 
 static uint32_t vhal_timer_ticks[HAL_TIMER_TIMER_INST_MAX];
 static uint32_t vhal_timer_tick_freq_hz[HAL_TIMER_TIMER_INST_MAX];
+static uint32_t vhal_timer_count_freq_hz[HAL_TIMER_TIMER_INST_MAX];
+static void (*vhal_timer_tick_cb[HAL_TIMER_TIMER_INST_MAX])(void);
 
 extern TIM_TypeDef *vhal_timer_base[HAL_TIMER_TIMER_INST_MAX];
 extern const uint32_t chal_timer_max_count[HAL_TIMER_TIMER_INST_MAX];
@@ -29,6 +32,8 @@ void hal_timer_init(void)
 {
 	memset(vhal_timer_ticks, 0, sizeof(vhal_timer_ticks));
 	memset(vhal_timer_tick_freq_hz, 0, sizeof(vhal_timer_tick_freq_hz));
+	memset(vhal_timer_count_freq_hz, 0, sizeof(vhal_timer_count_freq_hz));
+	memset(vhal_timer_tick_cb, 0, sizeof(vhal_timer_tick_cb));
 }
 
 void hal_timer_start(hal_timer_config_s config)
@@ -69,6 +74,53 @@ void hal_timer_start(hal_timer_config_s config)
 	}
 }
 
+/* Starts a timer as a free running counter of count_freq_hz, with no
+ * interrupts. It wraps around at its maximum count, so 32-bit timers are
+ * preferred */
+void hal_timer_counter_start(hal_timer_timer_inst_e timer_inst,
+							 uint32_t clk_freq_hz,
+							 uint32_t count_freq_hz)
+{
+	TIM_TypeDef *base;
+
+	if(timer_inst < HAL_TIMER_TIMER_INST_MAX && count_freq_hz > 0 && count_freq_hz <= clk_freq_hz)
+	{
+		base = vhal_timer_base[timer_inst];
+
+		vhal_timer_count_freq_hz[timer_inst] = count_freq_hz;
+
+		hal_timer_enable_clk(timer_inst);
+
+		base->PSC = clk_freq_hz / count_freq_hz - 1;
+
+		base->ARR = chal_timer_max_count[timer_inst];
+
+		/* Load the prescaler right away */
+		base->EGR = TIM_EGR_UG;
+
+		base->CR1 |= TIM_CR1_CEN;
+	}
+}
+
+uint32_t hal_timer_counter_get(hal_timer_timer_inst_e timer_inst)
+{
+	if(timer_inst >= HAL_TIMER_TIMER_INST_MAX)
+
+		return 0;
+
+	return vhal_timer_base[timer_inst]->CNT;
+}
+
+/* Address of the counter register, for readers that can't afford a call */
+const volatile uint32_t *hal_timer_counter_reg_get(hal_timer_timer_inst_e timer_inst)
+{
+	if(timer_inst >= HAL_TIMER_TIMER_INST_MAX)
+
+		return NULL;
+
+	return &vhal_timer_base[timer_inst]->CNT;
+}
+
 error_e hal_timer_attach(hal_timer_timer_inst_e timer_inst,
 					  	 hal_timer_timer_s *timer,
 						 uint32_t timeout_ms)
@@ -112,6 +164,9 @@ hal_timer_status_e hal_timer_status_get(hal_timer_timer_s *timer)
 	{
 		/* First time this function is called and the timer is expired */
 		timer->status = HAL_TIMER_STATUS_TIMEOUT_REACHED;
+
+		HAL_TRACE(HAL_TRACE_ID_TIMER_EXPIRED, timer->inst, timer->diff);
+
 		return timer->status;
 	}
 	else if(timer->status == HAL_TIMER_STATUS_TIMEOUT_REACHED)
@@ -152,10 +207,23 @@ void hal_timer_update_freq(uint32_t clk_freq_hz)
 			/* Configure auto-reload register */
 			base->ARR = auto_reload;
 		}
+		else if(vhal_timer_count_freq_hz[inst] > 0)
+
+			/* Free running counters keep their count frequency */
+			vhal_timer_base[inst]->PSC = clk_freq_hz / vhal_timer_count_freq_hz[inst] - 1;
 	}
 
 }
 
+/* The callback is called from interrupt context on every tick */
+void hal_timer_tick_cb_attach(hal_timer_timer_inst_e timer_inst,
+							  void (*cb)(void))
+{
+	if(timer_inst < HAL_TIMER_TIMER_INST_MAX)
+
+		vhal_timer_tick_cb[timer_inst] = cb;
+}
+
 static void hal_timer_calc_prescaler_counts(uint32_t clk_freq_hz,
 											uint32_t tick_freq_hz,
 											hal_timer_timer_inst_e timer_inst,
@@ -246,6 +314,10 @@ static inline void hal_timer_interrupt_handler(hal_timer_timer_inst_e timer_inst
 
 	/* Increase tick counter */
 	vhal_timer_ticks[timer_inst]++;
+
+	if(vhal_timer_tick_cb[timer_inst] != NULL)
+
+		vhal_timer_tick_cb[timer_inst]();
 }
 
 void TIM1_UP_TIM16_IRQHandler(void)
@@ -51,11 +51,18 @@ typedef struct
 
 void hal_timer_init(void);
 void hal_timer_start(hal_timer_config_s config);
+void hal_timer_counter_start(hal_timer_timer_inst_e timer_inst,
+							 uint32_t clk_freq_hz,
+							 uint32_t count_freq_hz);
+uint32_t hal_timer_counter_get(hal_timer_timer_inst_e timer_inst);
+const volatile uint32_t *hal_timer_counter_reg_get(hal_timer_timer_inst_e timer_inst);
 error_e hal_timer_attach(hal_timer_timer_inst_e timer_inst,
 					  	 hal_timer_timer_s *timer,
 						 uint32_t timeout_ms);
 void hal_timer_detach(hal_timer_timer_s *timer);
 hal_timer_status_e hal_timer_status_get(hal_timer_timer_s *timer);
 void hal_timer_update_freq(uint32_t clk_freq_hz);
+void hal_timer_tick_cb_attach(hal_timer_timer_inst_e timer_inst,
+							  void (*cb)(void));
 
 #endif /* HAL_HAL_TIMER_HAL_TIMER_H_ */
@@ -0,0 +1,49 @@
+/*
+ * hal_trace.c
+ *
+ *  Created on: Oct 19, 2026
+ *      Author: ricard
+ */
+#include <stdlib.h>
+#include <string.h>
+#include "hal_trace.h"
+
+/* Stands in for the counter until start, so that events recorded before it
+ * are stamped 0 instead of dereferencing nothing */
+static const volatile uint32_t vhal_trace_no_counter = 0;
+
+hal_trace_buffer_s vhal_trace_buffer;
+const volatile uint32_t *vhal_trace_counter = &vhal_trace_no_counter;
+
+void hal_trace_init(void)
+{
+	memset(&vhal_trace_buffer, 0, sizeof(vhal_trace_buffer));
+
+	vhal_trace_buffer.n_records = HAL_TRACE_N_RECORDS;
+
+	vhal_trace_counter = &vhal_trace_no_counter;
+}
+
+/* Timestamps are the value of a free running counter of counter_freq_hz,
+ * started elsewhere */
+void hal_trace_start(hal_timer_timer_inst_e counter_timer_inst, uint32_t counter_freq_hz)
+{
+	const volatile uint32_t *counter = hal_timer_counter_reg_get(counter_timer_inst);
+
+	if(counter != NULL)
+	{
+		vhal_trace_counter = counter;
+
+		vhal_trace_buffer.timestamp_freq_hz = counter_freq_hz;
+	}
+}
+
+void hal_trace_freeze(bool frozen)
+{
+	vhal_trace_buffer.frozen = frozen ? 1 : 0;
+}
+
+const hal_trace_buffer_s *hal_trace_buffer_get(void)
+{
+	return &vhal_trace_buffer;
+}
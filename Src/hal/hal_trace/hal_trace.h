@@ -0,0 +1,113 @@
+/*
+ * hal_trace.h
+ *
+ *  Created on: Oct 19, 2026
+ *      Author: ricard
+ */
+
+#ifndef HAL_HAL_TRACE_HAL_TRACE_H_
+#define HAL_HAL_TRACE_HAL_TRACE_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "hal_timer/hal_timer.h"
+
+#if defined(__arm__)
+#include <stm32l476xx.h>
+#include <core_cm4.h>
+#endif
+
+/* Set to 0 to compile every trace point out */
+#define HAL_TRACE_ENABLE		1
+
+/* Records in the ring. Power of 2 */
+#define HAL_TRACE_N_RECORDS		256U
+
+/* Event ids. The host decoder (python/trace_decoder) has the same list, so
+ * ids are only ever added at the end */
+typedef enum
+{
+	HAL_TRACE_ID_NONE,
+	HAL_TRACE_ID_OS_TASK_BEGIN,			/* arg0: task id */
+	HAL_TRACE_ID_OS_TASK_END,			/* arg0: task id */
+	HAL_TRACE_ID_UART_RX_START,			/* arg0: uart, arg1: first byte after an idle line */
+	HAL_TRACE_ID_UART_RX_LOST,			/* arg0: uart, arg1: byte */
+	HAL_TRACE_ID_UART_OVERRUN,			/* arg0: uart */
+	HAL_TRACE_ID_UART_TX_COMPLETE,		/* arg0: uart */
+	HAL_TRACE_ID_TIMER_EXPIRED,			/* arg0: timer inst, arg1: timeout in ms */
+	HAL_TRACE_ID_MODBUS_STATE,			/* arg0: inst, arg1: previous state << 8 | new state */
+	HAL_TRACE_ID_MAX
+} hal_trace_id_e;
+
+/* Two words, so that a record is written with two stores. event holds the id
+ * in bits 0-7, arg0 in bits 8-15 and arg1 in bits 16-31 */
+typedef struct
+{
+	uint32_t timestamp;		/* Counter timer value */
+	uint32_t event;
+} hal_trace_record_s;
+
+/* The trace, as retrieved. head counts the records written since start: the
+ * newest one is records[(head - 1) % n_records]. While frozen, nothing is
+ * recorded, so that the trace can be read consistently */
+typedef struct
+{
+	uint32_t head;
+	uint16_t n_records;
+	uint16_t frozen;
+	uint32_t timestamp_freq_hz;
+	uint32_t reserved;
+	hal_trace_record_s records[HAL_TRACE_N_RECORDS];
+} hal_trace_buffer_s;
+
+/* Used by the inline recorder only */
+extern hal_trace_buffer_s vhal_trace_buffer;
+extern const volatile uint32_t *vhal_trace_counter;
+
+void hal_trace_init(void);
+void hal_trace_start(hal_timer_timer_inst_e counter_timer_inst, uint32_t counter_freq_hz);
+void hal_trace_freeze(bool frozen);
+const hal_trace_buffer_s *hal_trace_buffer_get(void);
+
+/* Records an event from any context. It takes a few tens of cycles: the slot
+ * is claimed with interrupts masked, then filled with two word stores */
+static inline void hal_trace_record(hal_trace_id_e id, uint8_t arg0, uint16_t arg1)
+{
+	hal_trace_record_s *record;
+	uint32_t head;
+#if defined(__arm__)
+	uint32_t primask;
+#endif
+
+	if(vhal_trace_buffer.frozen)
+
+		return;
+
+#if defined(__arm__)
+	primask = __get_PRIMASK();
+
+	__disable_irq();
+#endif
+
+	head = vhal_trace_buffer.head;
+
+	vhal_trace_buffer.head = head + 1U;
+
+#if defined(__arm__)
+	__set_PRIMASK(primask);
+#endif
+
+	record = &vhal_trace_buffer.records[head & (HAL_TRACE_N_RECORDS - 1U)];
+
+	record->timestamp = *vhal_trace_counter;
+
+	record->event = (uint32_t)id | ((uint32_t)arg0 << 8) | ((uint32_t)arg1 << 16);
+}
+
+#if HAL_TRACE_ENABLE
+#define HAL_TRACE(id, arg0, arg1)	hal_trace_record((id), (uint8_t)(arg0), (uint16_t)(arg1))
+#else
+#define HAL_TRACE(id, arg0, arg1)
+#endif
+
+#endif /* HAL_HAL_TRACE_HAL_TRACE_H_ */
@@ -6,12 +6,14 @@
  */
 #include <stm32l476xx.h>
 #include "hal_uart.h"
+#include "hal_trace/hal_trace.h"
 #include "string.h"
 #include <cmsis_gcc.h>
 #include <core_cm4.h>
 #include <stdio.h>
 
-#define HAL_UART_BUFFER_DEPTH	100
+/* Enough for a whole Modbus RTU frame (256 bytes) in each direction */
+#define HAL_UART_BUFFER_DEPTH	512
 
 typedef struct
 {
@@ -26,17 +28,25 @@ static void hal_uart_init_circular_buffer(hal_uart_uart_num_e uart_num);
 static error_e hal_uart_set_baudrate(USART_TypeDef *uart_inst,
 								  	 uint32_t clk_freq_hz,
 								  	 uint32_t baudrate);
+static uint16_t hal_uart_circ_buff_used(hal_uart_circ_buff_s *circ_buff);
 static error_e hal_uart_circ_buff_put_data(hal_uart_uart_num_e uart_num,
 										   hal_uart_circ_buff_dir_e dir,
 										   uint8_t *buf,
-										   uint8_t len);
+										   uint16_t len);
 static error_e hal_uart_circ_buff_get_data(hal_uart_uart_num_e uart_num,
 										   hal_uart_circ_buff_dir_e dir,
 										   uint8_t *buf,
-										   uint8_t len);
+										   uint16_t len);
 static void hal_uart_interrupt_handler(hal_uart_uart_num_e uart_num);
 
 static hal_uart_circ_buff_s hal_uart_circ_buff[HAL_UART_UART_MAX][HAL_UART_CIRC_BUFF_DIR_MAX];
+static volatile bool vhal_uart_tx_complete[HAL_UART_UART_MAX];
+static hal_uart_event_cb vhal_uart_event_cb[HAL_UART_UART_MAX];
+static volatile uint16_t vhal_uart_overrun_cnt[HAL_UART_UART_MAX];
+
+/* Cleared by the first byte received, which has no idle line before it */
+static bool vhal_uart_rx_first[HAL_UART_UART_MAX];
+static uint32_t vhal_uart_baudrate[HAL_UART_UART_MAX];
 
 extern USART_TypeDef *hal_uart_inst[HAL_UART_UART_MAX];
 
@@ -45,6 +55,16 @@ void hal_uart_init(void)
 	for(hal_uart_uart_num_e uart_num = 0; uart_num < HAL_UART_UART_MAX; uart_num++)
 	{
 		hal_uart_init_circular_buffer(uart_num);
+
+		vhal_uart_tx_complete[uart_num] = false;
+
+		vhal_uart_event_cb[uart_num] = NULL;
+
+		vhal_uart_overrun_cnt[uart_num] = 0;
+
+		vhal_uart_rx_first[uart_num] = true;
+
+		vhal_uart_baudrate[uart_num] = 0;
 	}
 }
 
@@ -189,6 +209,36 @@ void hal_uart_start(hal_uart_config_s config)
 								config.clk_freq_hz,
 								config.baudrate);
 
+	vhal_uart_baudrate[config.uart_num] = config.baudrate;
+
+	/* Driver enable. The DE pin is asserted by hardware DEAT sample times
+	 * before the start bit of the first byte, and released DEDT sample times
+	 * after the stop bit of the last one. DEAT and DEDT can only be written
+	 * while UE is cleared */
+	if(config.de_enable)
+	{
+		uart_inst->CR3 |= USART_CR3_DEM;
+
+		if(config.de_polarity == HAL_UART_DE_POLARITY_LOW)
+
+			uart_inst->CR3 |= USART_CR3_DEP;
+
+		else
+
+			uart_inst->CR3 &= ~USART_CR3_DEP;
+
+		uart_inst->CR1 &= ~(USART_CR1_DEAT_Msk | USART_CR1_DEDT_Msk);
+
+		uart_inst->CR1 |= ((uint32_t)config.de_assert_time << USART_CR1_DEAT_Pos)
+						  & USART_CR1_DEAT_Msk;
+
+		uart_inst->CR1 |= ((uint32_t)config.de_deassert_time << USART_CR1_DEDT_Pos)
+						  & USART_CR1_DEDT_Msk;
+	}
+	else
+
+		uart_inst->CR3 &= ~USART_CR3_DEM;
+
 	/* Enable UART */
 	uart_inst->CR1 |= USART_CR1_UE;
 
@@ -207,7 +257,7 @@ void hal_uart_start(hal_uart_config_s config)
 
 error_e hal_uart_send(hal_uart_uart_num_e uart_num,
 					  uint8_t *buf,
-					  uint8_t len)
+					  uint16_t len)
 {
 	USART_TypeDef *uart_inst = hal_uart_inst[uart_num];
 	error_e ret;
@@ -223,6 +273,9 @@ error_e hal_uart_send(hal_uart_uart_num_e uart_num,
 	/* If successful, start transmission and enable TX interrupt */
 	if(ret == ERROR_NONE)
 	{
+		/* A new transmission is in progress */
+		vhal_uart_tx_complete[uart_num] = false;
+
 		/* Start transmission */
 		// uart_inst->TDR = hal_uart_circ_buff[uart_num][HAL_UART_CIRC_BUFF_DIR_TX].buffer[hal_uart_circ_buff[uart_num][HAL_UART_CIRC_BUFF_DIR_TX].out_ptr];
 
@@ -238,7 +291,7 @@ error_e hal_uart_send(hal_uart_uart_num_e uart_num,
 
 error_e hal_uart_retrieve(hal_uart_uart_num_e uart_num,
 					 	  uint8_t *buf,
-						  uint8_t len)
+						  uint16_t len)
 {
 	USART_TypeDef *uart_inst = hal_uart_inst[uart_num];
 	error_e ret;
@@ -262,6 +315,76 @@ void hal_uart_flush_buffer(hal_uart_uart_num_e uart_num)
 	hal_uart_init_circular_buffer(uart_num);
 }
 
+/* Changes the baudrate, or recalculates it after a change of the clock
+ * frequency. BRR can only be written while the UART is disabled, so anything
+ * being transmitted or received at the time is lost */
+error_e hal_uart_update_baudrate(hal_uart_uart_num_e uart_num,
+								 uint32_t clk_freq_hz,
+								 uint32_t baudrate)
+{
+	USART_TypeDef *uart_inst;
+	error_e ret;
+
+	if(uart_num >= HAL_UART_UART_MAX || baudrate == 0)
+
+		return ERROR_INCORRECT_FREQ;
+
+	uart_inst = hal_uart_inst[uart_num];
+
+	uart_inst->CR1 &= ~USART_CR1_UE;
+
+	ret = hal_uart_set_baudrate(uart_inst, clk_freq_hz, baudrate);
+
+	uart_inst->CR1 |= USART_CR1_UE;
+
+	if(ret == ERROR_NONE)
+
+		vhal_uart_baudrate[uart_num] = baudrate;
+
+	return ret;
+}
+
+uint32_t hal_uart_baudrate_get(hal_uart_uart_num_e uart_num)
+{
+	if(uart_num >= HAL_UART_UART_MAX)
+
+		return 0;
+
+	return vhal_uart_baudrate[uart_num];
+}
+
+/* Returns true once after the last stop bit of a transmission has left the
+ * wire (and the DE pin, if used, has been released) */
+bool hal_uart_tx_complete_get(hal_uart_uart_num_e uart_num)
+{
+	if(uart_num >= HAL_UART_UART_MAX || vhal_uart_tx_complete[uart_num] == false)
+
+		return false;
+
+	vhal_uart_tx_complete[uart_num] = false;
+
+	return true;
+}
+
+/* Number of received characters lost, either because the hardware overran or
+ * because the RX buffer was full. Wraps around */
+uint16_t hal_uart_overrun_cnt_get(hal_uart_uart_num_e uart_num)
+{
+	if(uart_num >= HAL_UART_UART_MAX)
+
+		return 0;
+
+	return vhal_uart_overrun_cnt[uart_num];
+}
+
+void hal_uart_event_cb_attach(hal_uart_uart_num_e uart_num,
+							  hal_uart_event_cb cb)
+{
+	if(uart_num < HAL_UART_UART_MAX)
+
+		vhal_uart_event_cb[uart_num] = cb;
+}
+
 static void hal_uart_enable_clk(USART_TypeDef *uart_inst)
 {
 	/* By default, PCLK1 (or PCLK2 in the case of USART1) are the clock source for
@@ -348,139 +471,65 @@ static error_e hal_uart_set_baudrate(USART_TypeDef *uart_inst,
 	return ERROR_NONE;
 }
 
-static error_e hal_uart_circ_buff_put_data(hal_uart_uart_num_e uart_num,
-										   hal_uart_circ_buff_dir_e dir,
-										   uint8_t *buf,
-										   uint8_t len)
+/* One position is always left empty, so that in_ptr == out_ptr unambiguously
+ * means the buffer is empty */
+static uint16_t hal_uart_circ_buff_used(hal_uart_circ_buff_s *circ_buff)
 {
-	uint16_t i;
-	uint16_t available_size;
+	if(circ_buff->in_ptr >= circ_buff->out_ptr)
 
-	/* Calculate available room in the circular buffer */
-	if(hal_uart_circ_buff[uart_num][dir].in_ptr
-			>= hal_uart_circ_buff[uart_num][dir].out_ptr)
-	{
-		available_size =
-			HAL_UART_BUFFER_DEPTH
-			- hal_uart_circ_buff[uart_num][dir].in_ptr
-			+ hal_uart_circ_buff[uart_num][dir].out_ptr;
+		return circ_buff->in_ptr - circ_buff->out_ptr;
 
-	}
 	else
-	{
-		available_size =
-			hal_uart_circ_buff[uart_num][dir].out_ptr
-			- hal_uart_circ_buff[uart_num][dir].in_ptr;
-	}
+
+		return HAL_UART_BUFFER_DEPTH - circ_buff->out_ptr + circ_buff->in_ptr;
+}
+
+static error_e hal_uart_circ_buff_put_data(hal_uart_uart_num_e uart_num,
+										   hal_uart_circ_buff_dir_e dir,
+										   uint8_t *buf,
+										   uint16_t len)
+{
+	hal_uart_circ_buff_s *circ_buff = &hal_uart_circ_buff[uart_num][dir];
 
 	/* Is there enough room? */
-	if(available_size < len)
+	if(HAL_UART_BUFFER_DEPTH - 1 - hal_uart_circ_buff_used(circ_buff) < len)
+
 		/* Not enough room! */
 		return ERROR_UART_BUFFER_FULL;
 
-	/* Add data to the buffer */
-	if(hal_uart_circ_buff[uart_num][dir].in_ptr + len
-		>= HAL_UART_BUFFER_DEPTH)
+	/* Add data to the buffer, wrapping around at the end */
+	for(uint16_t i = 0; i < len; i++)
 	{
-		for(i = hal_uart_circ_buff[uart_num][dir].in_ptr;
-			i < HAL_UART_BUFFER_DEPTH;
-			i++)
+		circ_buff->buffer[circ_buff->in_ptr] = buf[i];
 
-			hal_uart_circ_buff[uart_num][dir].buffer[i] =
-				buf[i - hal_uart_circ_buff[uart_num][dir].in_ptr];
+		if(++circ_buff->in_ptr >= HAL_UART_BUFFER_DEPTH)
 
-		for(i = 0;
-			i < len + hal_uart_circ_buff[uart_num][dir].in_ptr - HAL_UART_BUFFER_DEPTH;
-			i++)
-
-			hal_uart_circ_buff[uart_num][dir].buffer[i] =
-				buf[len + hal_uart_circ_buff[uart_num][dir].in_ptr - HAL_UART_BUFFER_DEPTH + i - 1];
-
-		/* Update pointer */
-		hal_uart_circ_buff[uart_num][dir].in_ptr +=
-			(len - HAL_UART_BUFFER_DEPTH);
+			circ_buff->in_ptr = 0;
 	}
-	else
-	{
-		for(i = hal_uart_circ_buff[uart_num][dir].in_ptr;
-			i < hal_uart_circ_buff[uart_num][dir].in_ptr + len;
-			i++)
 
-			hal_uart_circ_buff[uart_num][dir].buffer[i] =
-				buf[i - hal_uart_circ_buff[uart_num][dir].in_ptr];
-
-		/* Update pointer */
-		hal_uart_circ_buff[uart_num][dir].in_ptr += len;
-	}
 	return ERROR_NONE;
 }
 
 static error_e hal_uart_circ_buff_get_data(hal_uart_uart_num_e uart_num,
 										   hal_uart_circ_buff_dir_e dir,
 										   uint8_t *buf,
-										   uint8_t len)
+										   uint16_t len)
 {
-	uint16_t i;
-	uint16_t available_data;
-
-	/* Calculate available data in the circular buffer */
-	if(hal_uart_circ_buff[uart_num][dir].out_ptr
-			> hal_uart_circ_buff[uart_num][dir].in_ptr)
-
-		available_data =
-			HAL_UART_BUFFER_DEPTH
-			- hal_uart_circ_buff[uart_num][dir].out_ptr
-			+ hal_uart_circ_buff[uart_num][dir].in_ptr;
-
-	else if(hal_uart_circ_buff[uart_num][dir].out_ptr
-			< hal_uart_circ_buff[uart_num][dir].in_ptr)
-
-		available_data =
-			hal_uart_circ_buff[uart_num][dir].in_ptr
-			- hal_uart_circ_buff[uart_num][dir].out_ptr;
-
-	else
-
-		available_data = 0;
+	hal_uart_circ_buff_s *circ_buff = &hal_uart_circ_buff[uart_num][dir];
 
 	/* Is there enough data? */
-	if(available_data < len)
+	if(hal_uart_circ_buff_used(circ_buff) < len)
 
 		return ERROR_UART_BUFFER_EMPTY;
 
-	/* Get data */
-	if(hal_uart_circ_buff[uart_num][dir].out_ptr + len
-		>= HAL_UART_BUFFER_DEPTH)
-	{
-		for(i = hal_uart_circ_buff[uart_num][dir].out_ptr;
-			i < HAL_UART_BUFFER_DEPTH;
-			i++)
-
-			buf[i - hal_uart_circ_buff[uart_num][dir].out_ptr] =
-				hal_uart_circ_buff[uart_num][dir].buffer[i];
-
-		for(i = 0;
-			i < len + hal_uart_circ_buff[uart_num][dir].out_ptr - HAL_UART_BUFFER_DEPTH;
-			i++)
-
-			buf[len + hal_uart_circ_buff[uart_num][dir].out_ptr - HAL_UART_BUFFER_DEPTH + i] =
-				hal_uart_circ_buff[uart_num][dir].buffer[i];
-
-		/* Update pointer */
-		hal_uart_circ_buff[uart_num][dir].out_ptr +=
-			(len - HAL_UART_BUFFER_DEPTH);
-	}
-	else
+	/* Get data, wrapping around at the end */
+	for(uint16_t i = 0; i < len; i++)
 	{
-		for(i = hal_uart_circ_buff[uart_num][dir].out_ptr;
-			i < hal_uart_circ_buff[uart_num][dir].out_ptr + len;
-			i++)
+		buf[i] = circ_buff->buffer[circ_buff->out_ptr];
 
-			buf[i - hal_uart_circ_buff[uart_num][dir].out_ptr] =
-				hal_uart_circ_buff[uart_num][dir].buffer[i];
+		if(++circ_buff->out_ptr >= HAL_UART_BUFFER_DEPTH)
 
-		/* Update pointer */
-		hal_uart_circ_buff[uart_num][dir].out_ptr += len;
+			circ_buff->out_ptr = 0;
 	}
 
 	return ERROR_NONE;
@@ -495,11 +544,34 @@ static void hal_uart_interrupt_handler(hal_uart_uart_num_e uart_num)
 
 		return;
 
+	/* A character arrived before the previous one was read. The flag must be
+	 * cleared, otherwise the interrupt would fire again and again */
+	if((uart_inst->ISR & USART_ISR_ORE) == USART_ISR_ORE)
+	{
+		uart_inst->ICR = USART_ICR_ORECF;
+
+		vhal_uart_overrun_cnt[uart_num]++;
+
+		HAL_TRACE(HAL_TRACE_ID_UART_OVERRUN, uart_num, 0);
+	}
+
 	if((uart_inst->ISR & USART_ISR_TC) == USART_ISR_TC
 		&& (uart_inst->CR1 & USART_CR1_TCIE) == USART_CR1_TCIE)
 	{
 		/* Transfer complete. Disable TCIE */
 		uart_inst->CR1 &= ~(USART_CR1_TCIE);
+
+		/* Clear TC flag */
+		uart_inst->ICR = USART_ICR_TCCF;
+
+		/* The line has been released */
+		vhal_uart_tx_complete[uart_num] = true;
+
+		HAL_TRACE(HAL_TRACE_ID_UART_TX_COMPLETE, uart_num, 0);
+
+		if(vhal_uart_event_cb[uart_num] != NULL)
+
+			vhal_uart_event_cb[uart_num](uart_num, HAL_UART_EVENT_TX_COMPLETE);
 	}
 	else if((uart_inst->ISR & USART_ISR_TXE) == USART_ISR_TXE
 		&& (uart_inst->CR1 & USART_CR1_TXEIE) == USART_CR1_TXEIE)
@@ -528,17 +600,40 @@ static void hal_uart_interrupt_handler(hal_uart_uart_num_e uart_num)
 	{
 		data = uart_inst->RDR;
 
-		/* If the data can't enter the buffer -> problem */
-		hal_uart_circ_buff_put_data(uart_num,
-									HAL_UART_CIRC_BUFF_DIR_RX,
-									&data,
-									1);
+		/* Only the first byte after an idle line is traced, so that a frame
+		 * takes one record. The idle flag is set by the hardware, without
+		 * its interrupt */
+		if(vhal_uart_rx_first[uart_num]
+			|| (uart_inst->ISR & USART_ISR_IDLE) == USART_ISR_IDLE)
+		{
+			uart_inst->ICR = USART_ICR_IDLECF;
+
+			vhal_uart_rx_first[uart_num] = false;
+
+			HAL_TRACE(HAL_TRACE_ID_UART_RX_START, uart_num, data);
+		}
+
+		/* If the data can't enter the buffer, it is lost */
+		if(hal_uart_circ_buff_put_data(uart_num,
+									   HAL_UART_CIRC_BUFF_DIR_RX,
+									   &data,
+									   1)
+			!= ERROR_NONE)
+		{
+			vhal_uart_overrun_cnt[uart_num]++;
+
+			HAL_TRACE(HAL_TRACE_ID_UART_RX_LOST, uart_num, data);
+		}
+
+		if(vhal_uart_event_cb[uart_num] != NULL)
+
+			vhal_uart_event_cb[uart_num](uart_num, HAL_UART_EVENT_RX);
 	}
 }
 
 void USART1_IRQHandler(void)
 {
-
+	hal_uart_interrupt_handler(HAL_UART_USART_1);
 }
 
 void USART2_IRQHandler(void)
@@ -563,5 +658,6 @@ void UART5_IRQHandler(void)
 
 USART_TypeDef *hal_uart_inst[HAL_UART_UART_MAX] =
 {
-		USART2
+		USART2,
+		USART1
 };
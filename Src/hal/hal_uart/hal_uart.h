@@ -9,11 +9,13 @@
 #define HAL_HAL_UART_HAL_UART_H_
 
 #include <stdint.h>
+#include <stdbool.h>
 #include <error.h>
 
 typedef enum
 {
 	HAL_UART_USART_2,
+	HAL_UART_USART_1,
 	HAL_UART_UART_MAX
 } hal_uart_uart_num_e;
 
@@ -50,6 +52,22 @@ typedef enum
 	HAL_UART_N_BITS_MAX
 } hal_uart_n_bits_s;
 
+typedef enum
+{
+	HAL_UART_DE_POLARITY_HIGH,
+	HAL_UART_DE_POLARITY_LOW,
+	HAL_UART_DE_POLARITY_MAX
+} hal_uart_de_polarity_e;
+
+typedef enum
+{
+	HAL_UART_EVENT_TX_COMPLETE,
+	HAL_UART_EVENT_RX,
+	HAL_UART_EVENT_MAX
+} hal_uart_event_e;
+
+/* DE assertion/deassertion times are expressed in sample time units, i.e.
+ * 1/16 of a bit time with the oversampling used by this driver (max 31) */
 typedef struct
 {
 	hal_uart_uart_num_e uart_num;
@@ -58,16 +76,32 @@ typedef struct
 	hal_uart_parity_s parity			: 2;
 	hal_uart_stop_bits_s n_stop_bits	: 3;
 	hal_uart_n_bits_s n_bits			: 3;
+	uint8_t de_enable					: 1;
+	hal_uart_de_polarity_e de_polarity	: 2;
+	uint8_t de_assert_time				: 5;
+	uint8_t de_deassert_time			: 5;
 } hal_uart_config_s;
 
+/* Event callbacks are called from interrupt context */
+typedef void (*hal_uart_event_cb)(hal_uart_uart_num_e uart_num,
+								  hal_uart_event_e event);
+
 void hal_uart_init(void);
 void hal_uart_start(hal_uart_config_s config);
 error_e hal_uart_send(hal_uart_uart_num_e uart_num,
 					  uint8_t *buf,
-					  uint8_t len);
+					  uint16_t len);
 error_e hal_uart_retrieve(hal_uart_uart_num_e uart_num,
 						  uint8_t *buf,
-						  uint8_t len);
+						  uint16_t len);
 void hal_uart_flush_buffer(hal_uart_uart_num_e uart_num);
+error_e hal_uart_update_baudrate(hal_uart_uart_num_e uart_num,
+								 uint32_t clk_freq_hz,
+								 uint32_t baudrate);
+uint32_t hal_uart_baudrate_get(hal_uart_uart_num_e uart_num);
+bool hal_uart_tx_complete_get(hal_uart_uart_num_e uart_num);
+uint16_t hal_uart_overrun_cnt_get(hal_uart_uart_num_e uart_num);
+void hal_uart_event_cb_attach(hal_uart_uart_num_e uart_num,
+							  hal_uart_event_cb cb);
 
 #endif /* HAL_HAL_UART_HAL_UART_H_ */
@@ -0,0 +1,244 @@
+import sys
+import struct
+import argparse
+import serial
+
+# Fetches the event trace of the board (file 4 of Modbus 0) and prints it as a
+# timeline. The trace is frozen while it is read, and resumed afterwards.
+#
+#   python trace_decoder.py --port /dev/ttyACM0
+#   python trace_decoder.py --port /dev/ttyACM0 --dump trace.bin
+#   python trace_decoder.py --load trace.bin
+
+TRACE_FILE = 4
+
+# Layout of hal_trace_buffer_s, in 16-bit records
+HEADER_RECORDS = 8
+FROZEN_RECORD = 3
+RECORD_RECORDS = 4
+
+# Records per Read File Record request, so that the response fits in a frame
+RECORDS_PER_REQUEST = 100
+
+# Same order as hal_trace_id_e
+EVENT_NAMES = [
+	"NONE",
+	"OS_TASK_BEGIN",
+	"OS_TASK_END",
+	"UART_RX_START",
+	"UART_RX_LOST",
+	"UART_OVERRUN",
+	"UART_TX_COMPLETE",
+	"TIMER_EXPIRED",
+	"MODBUS_STATE",
+]
+
+# Same order as drv_modbus_state_e
+MODBUS_STATE_NAMES = [
+	"IDLE",
+	"RECEIVING",
+	"DISCARD",
+	"CHECK_CRC",
+	"CHECK_FC",
+	"READ_HOLDING_REGS",
+	"READ_INPUT_REGS",
+	"WRITE_SINGLE_REG",
+	"WRITE_MULTIPLE_REGS",
+	"DIAGNOSTICS",
+	"GET_COMM_EVENT_CNT",
+	"GET_COMM_EVENT_LOG",
+	"READ_FIFO_QUEUE",
+	"READ_FILE_RECORD",
+	"WRITE_FILE_RECORD",
+	"READ_DEV_ID",
+	"REPORT_CHANGES",
+	"BUILD_EXCEPTION_RESPONSE",
+	"DELAY_BEFORE_RESPONSE",
+	"SEND_RESPONSE",
+	"WAIT_TX_COMPLETE",
+]
+
+UART_NAMES = ["USART2", "USART1"]
+
+# Same order as hal_timer_timer_inst_e
+TIMER_NAMES = ["TIM1", "TIM2", "TIM3", "TIM4", "TIM5", "TIM6", "TIM7", "TIM8", "TIM15", "TIM16", "TIM17"]
+
+def crc16(buf: bytes):
+	crc = 0xFFFF
+
+	for byte in buf:
+
+		crc ^= byte
+
+		for i in range(0, 8):
+
+			if crc & 1:
+
+				crc = (crc >> 1) ^ 0xA001
+
+			else:
+
+				crc >>= 1
+
+	return crc
+
+def transaction(ser, unit_id: int, pdu: bytes):
+	frame = bytes([unit_id]) + pdu
+	crc = crc16(frame)
+	frame += bytes([crc & 0xff, (crc >> 8) & 0xff])
+
+	ser.reset_input_buffer()
+	ser.write(frame)
+
+	response = ser.read(256)
+
+	if len(response) < 5 or crc16(response) != 0:
+
+		raise IOError("no response or bad CRC")
+
+	if response[1] & 0x80:
+
+		raise IOError("exception " + hex(response[2]))
+
+	return response[1: len(response) - 2]
+
+def read_file_records(ser, unit_id: int, file_num: int, record: int, n_records: int):
+	pdu = bytes([0x14, 7, 6]) + struct.pack(">HHH", file_num, record, n_records)
+
+	response = transaction(ser, unit_id, pdu)
+
+	# FC, byte count, sub-response length, reference type, then the records
+	return list(struct.unpack(">" + "H" * n_records, response[4: 4 + n_records * 2]))
+
+def write_file_records(ser, unit_id: int, file_num: int, record: int, vals: list):
+	data = struct.pack(">" + "H" * len(vals), *vals)
+	pdu = bytes([0x15, 7 + len(data), 6]) + struct.pack(">HHH", file_num, record, len(vals)) + data
+
+	transaction(ser, unit_id, pdu)
+
+def fetch(ser, unit_id: int):
+	write_file_records(ser, unit_id, TRACE_FILE, FROZEN_RECORD, [1])
+
+	try:
+
+		words = read_file_records(ser, unit_id, TRACE_FILE, 0, HEADER_RECORDS)
+
+		n_records = words[2]
+		total = HEADER_RECORDS + n_records * RECORD_RECORDS
+
+		while len(words) < total:
+
+			count = min(RECORDS_PER_REQUEST, total - len(words))
+			words += read_file_records(ser, unit_id, TRACE_FILE, len(words), count)
+
+	finally:
+
+		write_file_records(ser, unit_id, TRACE_FILE, FROZEN_RECORD, [0])
+
+	# Records are the little endian words of the board memory
+	return struct.pack("<" + "H" * len(words), *words)
+
+def describe(event_id: int, arg0: int, arg1: int):
+	if event_id in (1, 2):
+
+		return "task " + str(arg0)
+
+	if event_id in (3, 4):
+
+		return UART_NAMES[arg0] + " " + hex(arg1) if arg0 < len(UART_NAMES) else str(arg0)
+
+	if event_id in (5, 6):
+
+		return UART_NAMES[arg0] if arg0 < len(UART_NAMES) else str(arg0)
+
+	if event_id == 7:
+
+		timer = TIMER_NAMES[arg0] if arg0 < len(TIMER_NAMES) else str(arg0)
+
+		return timer + " after " + str(arg1) + " ms"
+
+	if event_id == 8:
+
+		prev_state = arg1 >> 8
+		new_state = arg1 & 0xff
+
+		def name(state):
+			return MODBUS_STATE_NAMES[state] if state < len(MODBUS_STATE_NAMES) else str(state)
+
+		return "modbus " + str(arg0) + " " + name(prev_state) + " -> " + name(new_state)
+
+	return "arg0 " + str(arg0) + " arg1 " + str(arg1)
+
+def decode(raw: bytes):
+	head, n_records, frozen, freq_hz, reserved = struct.unpack_from("<IHHII", raw, 0)
+
+	if n_records == 0 or freq_hz == 0:
+
+		print("trace not started")
+		return
+
+	# Oldest record first. Only the last n_records are still in the ring
+	first = max(0, head - n_records)
+	prev_timestamp = None
+	t = 0
+
+	print("%d events recorded, %d kept" % (head, head - first))
+
+	for seq in range(first, head):
+
+		offset = HEADER_RECORDS * 2 + (seq % n_records) * RECORD_RECORDS * 2
+		timestamp, event = struct.unpack_from("<II", raw, offset)
+
+		event_id = event & 0xff
+		arg0 = (event >> 8) & 0xff
+		arg1 = event >> 16
+
+		# The counter wraps around, so times are rebuilt from differences
+		if prev_timestamp is not None:
+
+			t += (timestamp - prev_timestamp) & 0xFFFFFFFF
+
+		prev_timestamp = timestamp
+
+		name = EVENT_NAMES[event_id] if event_id < len(EVENT_NAMES) else "ID_" + str(event_id)
+
+		print("%12.1f us  %-18s %s" % (t * 1e6 / freq_hz, name, describe(event_id, arg0, arg1)))
+
+parser = argparse.ArgumentParser(description="Decodes the event trace of the board")
+parser.add_argument("--port", help="serial port of the Modbus 0 bus")
+parser.add_argument("--unit", type=lambda x: int(x, 0), default=0x10, help="unit id of the board")
+parser.add_argument("--dump", help="also save the raw trace to this file")
+parser.add_argument("--load", help="decode a raw trace saved with --dump")
+args = parser.parse_args()
+
+if args.load:
+
+	with open(args.load, "rb") as f:
+
+		raw = f.read()
+
+elif args.port:
+
+	ser = serial.Serial(
+		port=args.port,
+		baudrate=19200,
+		parity=serial.PARITY_EVEN,
+		stopbits=serial.STOPBITS_ONE,
+		bytesize=serial.EIGHTBITS,
+		timeout=0.2
+	)
+
+	raw = fetch(ser, args.unit)
+
+	if args.dump:
+
+		with open(args.dump, "wb") as f:
+
+			f.write(raw)
+
+else:
+
+	parser.print_help()
+	sys.exit(1)
+
+decode(raw)
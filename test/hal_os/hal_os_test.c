@@ -0,0 +1,262 @@
+/*
+ * hal_os_test.c
+ *
+ * Host harness for the scheduler core. It needs no MCU, only plain gcc. From
+ * the project root:
+ *
+ *   gcc -std=gnu11 -Wall -Wextra -ISrc/hal -ISrc/common \
+ *       test/hal_os/hal_os_test.c Src/hal/hal_os/hal_os.c \
+ *       Src/hal/hal_trace/hal_trace.c -o hal_os_test && ./hal_os_test
+ */
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+#include <assert.h>
+#include "hal_os/hal_os.h"
+#include "hal_timer/hal_timer.h"
+
+#define TEST_MAX_RUNS	16
+
+/* Ids of the tasks in the order they have been run */
+static uint8_t vtest_runs[TEST_MAX_RUNS];
+static uint8_t vtest_run_cnt;
+
+static uint8_t vtest_task_id[3];
+
+/* Task readied by task 0 while it runs */
+static uint8_t vtest_ready_from_task = HAL_OS_INVALID_TASK_ID;
+
+static void test_run_log(uint8_t task_idx);
+static void test_task_0_fxn(void);
+static void test_task_1_fxn(void);
+static void test_task_2_fxn(void);
+static void test_reset(void);
+static void test_sched_pass(void);
+static void test_attach_order(void);
+static void test_ready_flags(void);
+static void test_ready_while_running(void);
+static void test_tick_release(void);
+static void test_missed_deadlines(void);
+
+/* hal_trace only reads a counter register when started, which the harness
+ * never does */
+const volatile uint32_t *hal_timer_counter_reg_get(hal_timer_timer_inst_e timer_inst)
+{
+	(void)timer_inst;
+
+	return NULL;
+}
+
+int main(void)
+{
+	test_attach_order();
+	test_ready_flags();
+	test_ready_while_running();
+	test_tick_release();
+	test_missed_deadlines();
+
+	printf("hal_os: all tests passed\n");
+
+	return 0;
+}
+
+static void test_run_log(uint8_t task_idx)
+{
+	assert(vtest_run_cnt < TEST_MAX_RUNS);
+
+	vtest_runs[vtest_run_cnt++] = task_idx;
+}
+
+static void test_task_0_fxn(void)
+{
+	test_run_log(0);
+
+	if(vtest_ready_from_task != HAL_OS_INVALID_TASK_ID)
+
+		hal_os_task_ready_set(vtest_ready_from_task);
+}
+
+static void test_task_1_fxn(void)
+{
+	test_run_log(1);
+}
+
+static void test_task_2_fxn(void)
+{
+	test_run_log(2);
+}
+
+/* Attaches task 0 with the lowest priority and task 2 with the highest, so
+ * that the attach order and the priority order differ */
+static void test_reset(void)
+{
+	hal_os_init();
+
+	vtest_task_id[0] = hal_os_task_attach(test_task_0_fxn, HAL_OS_NO_PERIOD, 2);
+	vtest_task_id[1] = hal_os_task_attach(test_task_1_fxn, 3, 1);
+	vtest_task_id[2] = hal_os_task_attach(test_task_2_fxn, HAL_OS_NO_PERIOD,
+										  HAL_OS_HIGHEST_PRIORITY);
+
+	hal_os_start();
+
+	vtest_run_cnt = 0;
+
+	vtest_ready_from_task = HAL_OS_INVALID_TASK_ID;
+}
+
+/* Runs one scheduler pass, which must run one task at most */
+static void test_sched_pass(void)
+{
+	uint8_t run_cnt = vtest_run_cnt;
+
+	hal_os_fxn();
+
+	assert(vtest_run_cnt - run_cnt <= 1);
+}
+
+/* Every task is ready once attached, and they run one per pass, by priority */
+static void test_attach_order(void)
+{
+	test_reset();
+
+	assert(hal_os_task_cnt_get() == 3);
+
+	test_sched_pass();
+	assert(vtest_run_cnt == 1 && vtest_runs[0] == 2);
+
+	test_sched_pass();
+	assert(vtest_run_cnt == 2 && vtest_runs[1] == 1);
+
+	test_sched_pass();
+	assert(vtest_run_cnt == 3 && vtest_runs[2] == 0);
+
+	/* Nothing is ready anymore */
+	test_sched_pass();
+	assert(vtest_run_cnt == 3);
+}
+
+/* Only the tasks made ready run, still by priority, and each of them once */
+static void test_ready_flags(void)
+{
+	hal_os_task_stats_s stats;
+
+	test_reset();
+
+	for(uint8_t i = 0; i < 3; i++)
+
+		test_sched_pass();
+
+	vtest_run_cnt = 0;
+
+	hal_os_task_ready_set(vtest_task_id[0]);
+	hal_os_task_ready_set(vtest_task_id[1]);
+	hal_os_task_ready_set(vtest_task_id[0]);
+
+	test_sched_pass();
+	test_sched_pass();
+	test_sched_pass();
+
+	assert(vtest_run_cnt == 2);
+	assert(vtest_runs[0] == 1 && vtest_runs[1] == 0);
+
+	/* The attach release plus the two ready_set calls */
+	assert(hal_os_task_stats_get(vtest_task_id[0], &stats) == ERROR_NONE);
+	assert(stats.releases == 3 && stats.runs == 2);
+
+	assert(hal_os_task_stats_get(3, &stats) == ERROR_OS_NON_EXISTENT_TASK);
+}
+
+/* A higher priority task made ready by a running one goes first in the next
+ * pass, even though lower priority tasks were already pending */
+static void test_ready_while_running(void)
+{
+	test_reset();
+
+	for(uint8_t i = 0; i < 3; i++)
+
+		test_sched_pass();
+
+	vtest_run_cnt = 0;
+
+	vtest_ready_from_task = vtest_task_id[2];
+
+	hal_os_task_ready_set(vtest_task_id[0]);
+
+	test_sched_pass();
+	test_sched_pass();
+
+	assert(vtest_run_cnt == 2);
+	assert(vtest_runs[0] == 0 && vtest_runs[1] == 2);
+}
+
+/* The periodic task is released every period_ticks ticks, the rest never */
+static void test_tick_release(void)
+{
+	test_reset();
+
+	for(uint8_t i = 0; i < 3; i++)
+
+		test_sched_pass();
+
+	vtest_run_cnt = 0;
+
+	hal_os_tick();
+	hal_os_tick();
+
+	test_sched_pass();
+	assert(vtest_run_cnt == 0);
+
+	hal_os_tick();
+
+	test_sched_pass();
+	assert(vtest_run_cnt == 1 && vtest_runs[0] == 1);
+
+	for(uint8_t i = 0; i < 3; i++)
+
+		hal_os_tick();
+
+	test_sched_pass();
+	test_sched_pass();
+	assert(vtest_run_cnt == 2 && vtest_runs[1] == 1);
+}
+
+/* A deadline is missed when a periodic release finds the previous one still
+ * pending, not when the task was only readied by an event */
+static void test_missed_deadlines(void)
+{
+	hal_os_task_stats_s stats;
+
+	test_reset();
+
+	for(uint8_t i = 0; i < 3; i++)
+
+		test_sched_pass();
+
+	/* Readied by an event just before its release */
+	hal_os_task_ready_set(vtest_task_id[1]);
+
+	for(uint8_t i = 0; i < 3; i++)
+
+		hal_os_tick();
+
+	assert(hal_os_task_stats_get(vtest_task_id[1], &stats) == ERROR_NONE);
+	assert(stats.missed_deadlines == 0);
+
+	/* The release isn't served before the next one */
+	for(uint8_t i = 0; i < 3; i++)
+
+		hal_os_tick();
+
+	assert(hal_os_task_stats_get(vtest_task_id[1], &stats) == ERROR_NONE);
+	assert(stats.missed_deadlines == 1);
+	assert(stats.releases == 4 && stats.runs == 1);
+
+	/* Both releases are served by a single run */
+	test_sched_pass();
+	test_sched_pass();
+
+	assert(hal_os_task_stats_get(vtest_task_id[1], &stats) == ERROR_NONE);
+	assert(stats.runs == 2 && stats.missed_deadlines == 1);
+}